@@ -56,7 +56,7 @@ void Application::run() {
 	}
 
 	if (camera.update(deltaTime)) {
-		renderer->resetFrameIndex();
+		renderer->cameraMoved();
 	}
 
 	renderer->startFrame(deltaTime);
@@ -70,6 +70,7 @@ void Application::shutdown() {
 	Logger::trace("Application::shutdown()");
 		
 	// TODO: Clean up rendering elements
+	renderer->shutdown();
 
 	// Cleanup ImGui
 	ImGui_ImplOpenGL3_Shutdown();
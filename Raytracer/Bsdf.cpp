@@ -0,0 +1,242 @@
+#include "Bsdf.h"
+
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace mtn {
+
+	namespace {
+
+		// Shirley and Chiu's concentric mapping from the unit square to the unit disk, which keeps
+		// stratification intact
+		glm::vec2 concentricDisk(const glm::vec2& u) {
+			glm::vec2 offset = u * 2.0f - 1.0f;
+			if (offset.x == 0.0f && offset.y == 0.0f) {
+				return glm::vec2(0.0f);
+			}
+
+			float r, theta;
+			if (std::abs(offset.x) > std::abs(offset.y)) {
+				r = offset.x;
+				theta = glm::quarter_pi<float>() * (offset.y / offset.x);
+			}
+			else {
+				r = offset.y;
+				theta = glm::half_pi<float>() - glm::quarter_pi<float>() * (offset.x / offset.y);
+			}
+			return r * glm::vec2(std::cos(theta), std::sin(theta));
+		}
+
+		// Malley's method: projecting a uniform disk sample up onto the hemisphere gives a cosine
+		// weighted direction
+		glm::vec3 cosineHemisphere(const glm::vec2& u, const glm::vec3& n) {
+			glm::vec2 d = concentricDisk(u);
+			float z = std::sqrt(std::max(0.0f, 1.0f - d.x * d.x - d.y * d.y));
+
+			glm::vec3 t, b;
+			makeBasis(n, t, b);
+			return glm::normalize(t * d.x + b * d.y + n * z);
+		}
+
+		// GGX (Trowbridge-Reitz) microfacet distribution. Directions are in the shading frame,
+		// where the normal is +Z.
+		float ggxD(const glm::vec3& h, float alpha) {
+			float alphaSq = alpha * alpha;
+			float t = (h.x * h.x + h.y * h.y) / alphaSq + h.z * h.z;
+			return 1.0f / (glm::pi<float>() * alphaSq * t * t);
+		}
+
+		// Smith's Lambda for GGX, with G1 = 1 / (1 + Lambda)
+		float ggxLambda(const glm::vec3& w, float alpha) {
+			float cosSq = w.z * w.z;
+			if (cosSq <= 0.0f) {
+				return 0.0f;
+			}
+			float tanSq = std::max(0.0f, 1.0f - cosSq) / cosSq;
+			return (std::sqrt(1.0f + alpha * alpha * tanSq) - 1.0f) * 0.5f;
+		}
+
+		// Samples a normal from the distribution of normals visible from wo, using Dupuy and
+		// Benyoub's spherical cap formulation of Heitz's method. The pdf is G1(wo) D(h) (wo.h) / wo.z.
+		glm::vec3 sampleGgxVndf(const glm::vec3& wo, float alpha, const glm::vec2& u) {
+			// Stretch to the configuration where the roughness is 1 and the distribution is a hemisphere
+			glm::vec3 woStd = glm::normalize(glm::vec3(wo.x * alpha, wo.y * alpha, wo.z));
+
+			// The visible normals there are a spherical cap around woStd
+			float phi = glm::two_pi<float>() * u.x;
+			float z = (1.0f - u.y) * (1.0f + woStd.z) - woStd.z;
+			float sinTheta = std::sqrt(glm::clamp(1.0f - z * z, 0.0f, 1.0f));
+			glm::vec3 hStd = glm::vec3(sinTheta * std::cos(phi), sinTheta * std::sin(phi), z) + woStd;
+
+			return glm::normalize(glm::vec3(hStd.x * alpha, hStd.y * alpha, std::max(hStd.z, 0.0f)));
+		}
+
+		// Schlick's approximation with a colored reflectance at normal incidence, for conductors
+		glm::vec3 schlickFresnel(const glm::vec3& f0, float cosine) {
+			float m = std::clamp(1.0f - cosine, 0.0f, 1.0f);
+			float m2 = m * m;
+			return f0 + (glm::vec3(1.0f) - f0) * (m2 * m2 * m);
+		}
+
+		// Schlick Reflectance approximation for reflectivity or refractive surfaces at steep viewing angles
+		float schlickReflectance(float cosine, float refIdx) {
+			float r0 = (1.0f - refIdx) / (1.0f + refIdx);
+			r0 = r0 * r0;
+			return r0 + (1.0f - r0) * (float)std::pow((1.0f - cosine), 5);
+		}
+
+	}
+
+	Bsdf::Bsdf(const Material& material, const glm::vec3& normal, const glm::vec3& wo)
+		: material_(material), normal_(normal), wo_(wo) {
+
+		// Opaque materials scatter on whichever side was hit. Dielectrics need to know which side
+		// it was, so they keep the outward normal.
+		if (material.matType != MaterialType::DIELECTRIC && glm::dot(wo, normal) < 0.0f) {
+			normal_ = -normal;
+		}
+
+		// Metallicness is the perceptual roughness, and the GGX alpha is its square
+		alpha_ = material.metallicness * material.metallicness;
+		makeBasis(normal_, tangent_, bitangent_);
+	}
+
+	glm::vec3 Bsdf::evaluate(const glm::vec3& wi) const {
+		float cosine = glm::dot(wi, normal_);
+		if (cosine <= 0.0f) {
+			return glm::vec3(0.0f);
+		}
+
+		switch (material_.matType) {
+			case MaterialType::LAMBERTIAN:
+				return material_.albedo * (cosine * glm::one_over_pi<float>());
+			case MaterialType::METALLIC: {
+				if (isDelta()) {
+					return glm::vec3(0.0f);
+				}
+
+				// D G F / (4 cos_o cos_i), times cos_i
+				glm::vec3 wo = toLocal(wo_), wiLocal = toLocal(wi);
+				if (wo.z <= 0.0f) {
+					return glm::vec3(0.0f);
+				}
+				glm::vec3 h = glm::normalize(wo + wiLocal);
+				float g = 1.0f / (1.0f + ggxLambda(wo, alpha_) + ggxLambda(wiLocal, alpha_));
+				return schlickFresnel(material_.albedo, glm::dot(wo, h)) * (ggxD(h, alpha_) * g / (4.0f * wo.z));
+			}
+			default:
+				return glm::vec3(0.0f);
+		}
+	}
+
+	float Bsdf::pdf(const glm::vec3& wi) const {
+		float cosine = glm::dot(wi, normal_);
+		if (cosine <= 0.0f || isDelta()) {
+			return 0.0f;
+		}
+
+		switch (material_.matType) {
+			case MaterialType::LAMBERTIAN:
+				return cosine * glm::one_over_pi<float>();
+			case MaterialType::METALLIC: {
+				// The visible normal density, changed from half vectors to reflected directions
+				glm::vec3 wo = toLocal(wo_);
+				if (wo.z <= 0.0f) {
+					return 0.0f;
+				}
+				glm::vec3 h = glm::normalize(wo + toLocal(wi));
+				float g1 = 1.0f / (1.0f + ggxLambda(wo, alpha_));
+				return g1 * ggxD(h, alpha_) / (4.0f * wo.z);
+			}
+			default:
+				return 0.0f;
+		}
+	}
+
+	bool Bsdf::sample(const glm::vec2& u, float uLobe, BsdfSample& sample) const {
+		switch (material_.matType) {
+			case MaterialType::LAMBERTIAN: {
+				sample.dir = cosineHemisphere(u, normal_);
+				sample.pdf = std::max(glm::dot(sample.dir, normal_), 0.0f) * glm::one_over_pi<float>();
+				// The cosine and 1 / pi cancel against the pdf
+				sample.weight = material_.albedo;
+				sample.lobe = BsdfLobe::DIFFUSE;
+				return true;
+			}
+			case MaterialType::METALLIC: {
+				glm::vec3 wo = toLocal(wo_);
+				if (wo.z <= 0.0f) {
+					return false;
+				}
+
+				if (isDelta()) {
+					sample.dir = glm::reflect(-wo_, normal_);
+					sample.pdf = 0.0f;
+					sample.weight = schlickFresnel(material_.albedo, wo.z);
+					sample.lobe = BsdfLobe::SPECULAR;
+					return true;
+				}
+
+				// Reflect about a visible microfacet normal. Light reflected below the surface is
+				// absorbed, which is what the shadowing term accounts for.
+				glm::vec3 h = sampleGgxVndf(wo, alpha_, u);
+				glm::vec3 wi = glm::reflect(-wo, h);
+				if (wi.z <= 0.0f) {
+					return false;
+				}
+
+				sample.dir = fromLocal(wi);
+				float g1 = 1.0f / (1.0f + ggxLambda(wo, alpha_));
+				sample.pdf = g1 * ggxD(h, alpha_) / (4.0f * wo.z);
+				// D and G1 cancel against the pdf, leaving F G2 / G1
+				float g2 = 1.0f / (1.0f + ggxLambda(wo, alpha_) + ggxLambda(wi, alpha_));
+				sample.weight = schlickFresnel(material_.albedo, glm::dot(wo, h)) * (g2 / g1);
+				sample.lobe = BsdfLobe::GLOSSY;
+				return true;
+			}
+			case MaterialType::DIELECTRIC: {
+				// Dielectric materials absorb no light
+				sample.weight = glm::vec3(1.0f);
+				sample.pdf = 0.0f;
+
+				// Refractive index is inversed when hitting the outside of a sphere
+				float cosIncident = glm::dot(wo_, normal_);
+				bool frontFace = cosIncident > 0.0f;
+				float refractionRatio = frontFace ? (1.0f / material_.refractiveIndex) : material_.refractiveIndex;
+				glm::vec3 n = frontFace ? normal_ : -normal_;
+
+				// Total Internal Reflection:
+				// If the ray is moving from a medium with a higher refractive index to one that's
+				// lower, then the ray cannot refract, since there would be no solution to Snell's Law.
+				float cosTheta = std::min(std::abs(cosIncident), 1.0f);
+				float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+				bool canRefract = refractionRatio * sinTheta <= 1.0f;
+
+				if (canRefract && schlickReflectance(cosTheta, refractionRatio) <= uLobe) {
+					// Refract using Snell's Law
+					sample.dir = glm::normalize(glm::refract(-wo_, n, refractionRatio));
+					sample.lobe = BsdfLobe::TRANSMISSION;
+				}
+				else {
+					sample.dir = glm::reflect(-wo_, n);
+					sample.lobe = BsdfLobe::SPECULAR;
+				}
+				return true;
+			}
+			default:
+				return false;
+		}
+	}
+
+	bool Bsdf::isDelta() const {
+		switch (material_.matType) {
+			case MaterialType::LAMBERTIAN: return false;
+			// Below this the lobe is narrower than float precision can sample usefully
+			case MaterialType::METALLIC: return alpha_ < 1e-3f;
+			default: return true;
+		}
+	}
+
+}
\ No newline at end of file
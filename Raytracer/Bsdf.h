@@ -0,0 +1,68 @@
+#pragma once
+
+#include "Scene.h"
+
+#include <glm/glm.hpp>
+
+namespace mtn {
+
+	enum class BsdfLobe {
+		DIFFUSE,
+		GLOSSY,
+		SPECULAR,		// Perfect reflection
+		TRANSMISSION	// Perfect refraction
+	};
+
+	struct BsdfSample {
+		glm::vec3 dir{ 0.0f };
+		glm::vec3 weight{ 0.0f };	// BSDF * |cos| / pdf
+		float pdf = 0.0f;			// Solid angle pdf, 0 for specular and transmission lobes
+		BsdfLobe lobe = BsdfLobe::DIFFUSE;
+	};
+
+	// Orthonormal basis around a unit vector (Duff et al. 2017)
+	inline void makeBasis(const glm::vec3& n, glm::vec3& t, glm::vec3& b) {
+		float sign = n.z >= 0.0f ? 1.0f : -1.0f;
+		float a = -1.0f / (sign + n.z);
+		float c = n.x * n.y * a;
+		t = glm::vec3(1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+		b = glm::vec3(c, sign + n.y * n.y * a, -n.y);
+	}
+
+	// Scattering of a material at a hit, for light arriving along wo (pointing away from the
+	// surface). evaluate() and pdf() are what light sampling and MIS need, sample() continues a path.
+	class Bsdf {
+	public:
+		Bsdf(const Material& material, const glm::vec3& normal, const glm::vec3& wo);
+
+		// BSDF times |cos| toward wi, zero for delta lobes
+		glm::vec3 evaluate(const glm::vec3& wi) const;
+		// Solid angle pdf of sample() returning wi, zero for delta lobes
+		float pdf(const glm::vec3& wi) const;
+		// Returns false if the path is absorbed
+		bool sample(const glm::vec2& u, float uLobe, BsdfSample& sample) const;
+
+		// Delta lobes can't be found by sampling the lights, so they aren't worth a light sample
+		bool isDelta() const;
+
+		// Facing wo for opaque materials, facing out of the sphere for dielectrics
+		inline const glm::vec3& getNormal() const { return normal_; }
+
+	private:
+		inline glm::vec3 toLocal(const glm::vec3& v) const {
+			return glm::vec3(glm::dot(v, tangent_), glm::dot(v, bitangent_), glm::dot(v, normal_));
+		}
+		inline glm::vec3 fromLocal(const glm::vec3& v) const {
+			return tangent_ * v.x + bitangent_ * v.y + normal_ * v.z;
+		}
+
+		const Material& material_;
+		glm::vec3 normal_;
+		glm::vec3 wo_;
+
+		// Shading frame and GGX roughness for metals
+		glm::vec3 tangent_, bitangent_;
+		float alpha_ = 0.0f;
+	};
+
+}
\ No newline at end of file
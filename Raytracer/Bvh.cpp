@@ -0,0 +1,464 @@
+#include "Bvh.h"
+
+#include "LightBvh.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <execution>
+#include <numeric>
+
+namespace mtn {
+
+	namespace {
+
+		// Spreads the lower 10 bits of v out so there are two zero bits between each of them
+		uint32_t expandBits(uint32_t v) {
+			v = (v * 0x00010001u) & 0xFF0000FFu;
+			v = (v * 0x00000101u) & 0x0F00F00Fu;
+			v = (v * 0x00000011u) & 0xC30C30C3u;
+			v = (v * 0x00000005u) & 0x49249249u;
+			return v;
+		}
+
+		int highestBit(uint32_t v) {
+			int bit = 31;
+			while ((v >> bit) == 0) {
+				--bit;
+			}
+			return bit;
+		}
+
+		uint32_t morton3D(const glm::vec3& p) {
+			glm::uvec3 q = glm::uvec3(glm::clamp(p * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f)));
+			return (expandBits(q.x) << 2) | (expandBits(q.y) << 1) | expandBits(q.z);
+		}
+
+		// Distance along the ray to the box, or FLT_MAX if it's missed or further than maxT
+		inline float intersectAabb(const Aabb& box, const glm::vec3& origin, const glm::vec3& invDir, float maxT) {
+			glm::vec3 t0 = (box.min - origin) * invDir;
+			glm::vec3 t1 = (box.max - origin) * invDir;
+			glm::vec3 tMin = glm::min(t0, t1);
+			glm::vec3 tMax = glm::max(t0, t1);
+
+			float entry = std::max(std::max(tMin.x, tMin.y), std::max(tMin.z, 0.0f));
+			float exit = std::min(std::min(tMax.x, tMax.y), std::min(tMax.z, maxT));
+			return entry <= exit ? entry : std::numeric_limits<float>::max();
+		}
+
+	}
+
+	std::shared_ptr<const Bvh> Bvh::build(const CowVector<Sphere>& spheres, BvhQuality quality) {
+		Logger::trace("Bvh::build()");
+
+		auto startTime = std::chrono::steady_clock::now();
+
+		std::shared_ptr<Bvh> bvh = std::make_shared<Bvh>();
+		bvh->quality_ = quality;
+
+		uint32_t primCount = (uint32_t)spheres.size();
+		if (primCount == 0) {
+			return bvh;
+		}
+
+		std::vector<Aabb> primBounds(primCount);
+		for (uint32_t i = 0; i < primCount; ++i) {
+			primBounds[i] = Aabb::ofSphere(spheres[i]);
+		}
+
+		bvh->primIndices_.resize(primCount);
+		std::iota(bvh->primIndices_.begin(), bvh->primIndices_.end(), 0);
+
+		// A binary tree with leaves of at least one primitive never needs more than 2n - 1 nodes
+		bvh->nodes_.reserve(2 * (size_t)primCount - 1);
+		bvh->nodes_.emplace_back();
+
+		if (quality == BvhQuality::FAST) {
+			Aabb centroidBounds;
+			for (const Aabb& b : primBounds) {
+				centroidBounds.grow(b.center());
+			}
+			glm::vec3 extent = glm::max(centroidBounds.max - centroidBounds.min, glm::vec3(1e-6f));
+
+			// Sorting the code and index packed together is much faster than sorting indices by code
+			std::vector<uint64_t> keys(primCount);
+			for (uint32_t i = 0; i < primCount; ++i) {
+				uint64_t code = morton3D((primBounds[i].center() - centroidBounds.min) / extent);
+				keys[i] = (code << 32) | i;
+			}
+			std::sort(std::execution::par, keys.begin(), keys.end());
+
+			std::vector<uint32_t> sortedCodes(primCount);
+			for (uint32_t i = 0; i < primCount; ++i) {
+				sortedCodes[i] = (uint32_t)(keys[i] >> 32);
+				bvh->primIndices_[i] = (uint32_t)keys[i];
+			}
+
+			bvh->buildMorton(primBounds, sortedCodes, 0, 0, primCount, 0);
+		}
+		else {
+			bvh->buildSah(primBounds, 0, 0, primCount, 0);
+		}
+
+		bvh->buildMs_ = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+		return bvh;
+	}
+
+	void Bvh::intersect(const Ray& ray, const CowVector<Sphere>& spheres, float& closestT, int& closestIdx) const {
+		if (nodes_.empty()) {
+			return;
+		}
+
+		glm::vec3 invDir = 1.0f / ray.dir;
+
+		uint32_t stack[MAX_DEPTH];
+		uint32_t stackSize = 0;
+		uint32_t nodeIdx = 0;
+
+		if (intersectAabb(nodes_[0].bounds, ray.origin, invDir, closestT) == std::numeric_limits<float>::max()) {
+			return;
+		}
+
+		while (true) {
+			const BvhNode& node = nodes_[nodeIdx];
+
+			if (node.count > 0) {
+				for (uint32_t i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i) {
+					uint32_t sphereIdx = primIndices_[i];
+					float t = spheres[sphereIdx].intersect(ray);
+					if (t > 0.0f && t < closestT) {
+						closestT = t;
+						closestIdx = (int)sphereIdx;
+					}
+				}
+			}
+			else {
+				// Visit the nearer child first and come back for the other one if it's still in range
+				uint32_t near = node.leftOrFirst, far = node.leftOrFirst + 1;
+				float nearT = intersectAabb(nodes_[near].bounds, ray.origin, invDir, closestT);
+				float farT = intersectAabb(nodes_[far].bounds, ray.origin, invDir, closestT);
+				if (farT < nearT) {
+					std::swap(near, far);
+					std::swap(nearT, farT);
+				}
+
+				if (nearT != std::numeric_limits<float>::max()) {
+					if (farT != std::numeric_limits<float>::max()) {
+						stack[stackSize++] = far;
+					}
+					nodeIdx = near;
+					continue;
+				}
+			}
+
+			if (stackSize == 0) {
+				return;
+			}
+			nodeIdx = stack[--stackSize];
+		}
+	}
+
+	void Bvh::buildSah(const std::vector<Aabb>& primBounds, uint32_t nodeIdx, uint32_t first, uint32_t count,
+					   uint32_t depth) {
+		Aabb bounds = boundsOf(primBounds, first, count);
+		nodes_[nodeIdx].bounds = bounds;
+		nodes_[nodeIdx].leftOrFirst = first;
+		nodes_[nodeIdx].count = count;
+
+		if (count <= 1) {
+			return;
+		}
+
+		Aabb centroidBounds;
+		for (uint32_t i = first; i < first + count; ++i) {
+			centroidBounds.grow(primBounds[primIndices_[i]].center());
+		}
+
+		// Skewed scenes, like exponentially spaced spheres, can make every binned split peel off a
+		// single primitive, so deep down the tree is finished with median splits along the widest axis
+		if (depth >= MEDIAN_DEPTH) {
+			if (count <= MAX_LEAF_SIZE) {
+				return;
+			}
+			glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+			int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+			uint32_t mid = first + count / 2;
+			std::nth_element(primIndices_.begin() + first, primIndices_.begin() + mid, primIndices_.begin() + first + count,
+				[&](uint32_t a, uint32_t b) { return primBounds[a].center()[axis] < primBounds[b].center()[axis]; });
+
+			makeChildren(nodeIdx);
+			uint32_t left = nodes_[nodeIdx].leftOrFirst;
+			buildSah(primBounds, left, first, mid - first, depth + 1);
+			buildSah(primBounds, left + 1, mid, first + count - mid, depth + 1);
+			return;
+		}
+
+		const int NUM_BINS = 12;
+		struct Bin {
+			Aabb bounds;
+			uint32_t count = 0;
+		};
+
+		// Find the cheapest bin boundary over all three axes
+		int bestAxis = -1, bestSplit = 0;
+		float bestCost = std::numeric_limits<float>::max();
+		for (int axis = 0; axis < 3; ++axis) {
+			float axisMin = centroidBounds.min[axis], axisMax = centroidBounds.max[axis];
+			if (axisMax - axisMin < 1e-6f) {
+				continue;
+			}
+
+			Bin bins[NUM_BINS];
+			float scale = NUM_BINS / (axisMax - axisMin);
+			for (uint32_t i = first; i < first + count; ++i) {
+				const Aabb& b = primBounds[primIndices_[i]];
+				int bin = std::min(NUM_BINS - 1, (int)((b.center()[axis] - axisMin) * scale));
+				bins[bin].bounds.grow(b);
+				++bins[bin].count;
+			}
+
+			// Sweep from the right to get the cost of everything past each boundary
+			float rightArea[NUM_BINS - 1];
+			uint32_t rightCount[NUM_BINS - 1];
+			Aabb rightBounds;
+			uint32_t rightSum = 0;
+			for (int i = NUM_BINS - 1; i > 0; --i) {
+				rightBounds.grow(bins[i].bounds);
+				rightSum += bins[i].count;
+				rightArea[i - 1] = rightBounds.surfaceArea();
+				rightCount[i - 1] = rightSum;
+			}
+
+			Aabb leftBounds;
+			uint32_t leftSum = 0;
+			for (int i = 0; i < NUM_BINS - 1; ++i) {
+				leftBounds.grow(bins[i].bounds);
+				leftSum += bins[i].count;
+				if (leftSum == 0 || rightCount[i] == 0) {
+					continue;
+				}
+
+				float cost = leftSum * leftBounds.surfaceArea() + rightCount[i] * rightArea[i];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+
+		// Splitting has to beat intersecting everything in one leaf, unless the leaf would be too big
+		float leafCost = count * bounds.surfaceArea();
+		if (count <= MAX_LEAF_SIZE && (bestAxis < 0 || bestCost >= leafCost)) {
+			return;
+		}
+
+		// Without a usable axis all the centroids are in the same spot, so any split is as good as another
+		uint32_t mid = first + count / 2;
+		if (bestAxis >= 0) {
+			float axisMin = centroidBounds.min[bestAxis];
+			float scale = NUM_BINS / (centroidBounds.max[bestAxis] - axisMin);
+			auto it = std::partition(primIndices_.begin() + first, primIndices_.begin() + first + count,
+				[&](uint32_t idx) {
+				int bin = std::min(NUM_BINS - 1, (int)((primBounds[idx].center()[bestAxis] - axisMin) * scale));
+				return bin <= bestSplit;
+			});
+			mid = (uint32_t)(it - primIndices_.begin());
+		}
+
+		makeChildren(nodeIdx);
+		uint32_t left = nodes_[nodeIdx].leftOrFirst;
+		buildSah(primBounds, left, first, mid - first, depth + 1);
+		buildSah(primBounds, left + 1, mid, first + count - mid, depth + 1);
+	}
+
+	void Bvh::buildMorton(const std::vector<Aabb>& primBounds, const std::vector<uint32_t>& codes,
+						  uint32_t nodeIdx, uint32_t first, uint32_t count, uint32_t depth) {
+		nodes_[nodeIdx].leftOrFirst = first;
+		nodes_[nodeIdx].count = count;
+
+		if (count <= MAX_LEAF_SIZE) {
+			nodes_[nodeIdx].bounds = boundsOf(primBounds, first, count);
+			return;
+		}
+
+		// Split where the highest bit that differs across the range flips. The codes are sorted, so
+		// that's a binary search. Identical codes, and every range below MEDIAN_DEPTH, are split down
+		// the middle.
+		uint32_t last = first + count - 1;
+		uint32_t mid = first + count / 2;
+		uint32_t diff = codes[first] ^ codes[last];
+		if (diff != 0 && depth < MEDIAN_DEPTH) {
+			uint32_t bit = 1u << highestBit(diff);
+			auto it = std::partition_point(codes.begin() + first, codes.begin() + last + 1,
+				[bit](uint32_t code) { return (code & bit) == 0; });
+			mid = (uint32_t)(it - codes.begin());
+		}
+
+		makeChildren(nodeIdx);
+		uint32_t left = nodes_[nodeIdx].leftOrFirst;
+		buildMorton(primBounds, codes, left, first, mid - first, depth + 1);
+		buildMorton(primBounds, codes, left + 1, mid, first + count - mid, depth + 1);
+
+		// Interior bounds come from the children, so every primitive is only visited once
+		nodes_[nodeIdx].bounds = nodes_[left].bounds;
+		nodes_[nodeIdx].bounds.grow(nodes_[left + 1].bounds);
+	}
+
+	Aabb Bvh::boundsOf(const std::vector<Aabb>& primBounds, uint32_t first, uint32_t count) const {
+		Aabb bounds;
+		for (uint32_t i = first; i < first + count; ++i) {
+			bounds.grow(primBounds[primIndices_[i]]);
+		}
+		return bounds;
+	}
+
+	void Bvh::makeChildren(uint32_t nodeIdx) {
+		uint32_t left = (uint32_t)nodes_.size();
+		nodes_.emplace_back();
+		nodes_.emplace_back();
+		nodes_[nodeIdx].leftOrFirst = left;
+		nodes_[nodeIdx].count = 0;
+	}
+
+	void SceneAcceleration::publish(AccelerationState state) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		states_.push_back(std::make_unique<AccelerationState>(std::move(state)));
+		pState_.store(states_.back().get(), std::memory_order_release);
+	}
+
+	BvhBuilder::BvhBuilder() {
+		thread_ = std::thread(&BvhBuilder::buildLoop, this);
+	}
+
+	BvhBuilder::~BvhBuilder() {
+		shutdown();
+	}
+
+	void BvhBuilder::attach(const std::shared_ptr<SceneSnapshot>& snapshot) {
+		snapshot->acceleration = std::make_shared<SceneAcceleration>();
+
+		// Edits that keep the sphere count can reuse the last BVH, as long as the spheres that
+		// changed since it was built are tested on their own
+		const AccelerationState* last = pLastAcceleration_ ? pLastAcceleration_->get() : nullptr;
+		if (last && snapshot->spheres.size() == lastSphereCount_) {
+			AccelerationState state;
+			state.bvh = last->bvh;
+			state.changedSpheres = last->changedSpheres;
+			state.changedSpheres.insert(state.changedSpheres.end(), snapshot->changedSpheres.begin(),
+										snapshot->changedSpheres.end());
+			std::sort(state.changedSpheres.begin(), state.changedSpheres.end());
+			state.changedSpheres.erase(std::unique(state.changedSpheres.begin(), state.changedSpheres.end()),
+									   state.changedSpheres.end());
+
+			// The light hierarchy still fits if the same spheres emit and none of them moved, since
+			// the tree only guides which one is picked and its pmf comes from the same tree
+			const std::vector<uint32_t>& emitters = snapshot->emissiveSpheres();
+			bool emittersMoved = std::any_of(snapshot->changedSpheres.begin(), snapshot->changedSpheres.end(),
+				[&emitters](uint32_t i) { return std::binary_search(emitters.begin(), emitters.end(), i); });
+			if (snapshot->emitterList == lastEmitters_ && !emittersMoved) {
+				state.lights = last->lights;
+			}
+			snapshot->acceleration->publish(std::move(state));
+		}
+
+		pLastAcceleration_ = snapshot->acceleration;
+		lastSphereCount_ = snapshot->spheres.size();
+		lastEmitters_ = snapshot->emitterList;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			pending_ = snapshot;
+			latest_ = snapshot;
+		}
+		cv_.notify_one();
+	}
+
+	void BvhBuilder::shutdown() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			running_ = false;
+		}
+		cv_.notify_one();
+
+		if (thread_.joinable()) {
+			thread_.join();
+		}
+	}
+
+	void BvhBuilder::buildLoop() {
+		// The latest snapshot, handed back for its full build when the queue drains without one
+		std::shared_ptr<const SceneSnapshot> requeued;
+		while (true) {
+			std::shared_ptr<const SceneSnapshot> snapshot;
+			bool fullBuildOnly;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cv_.wait(lock, [this, &requeued]() { return !running_ || pending_ || requeued; });
+				if (!running_) {
+					return;
+				}
+				fullBuildOnly = !pending_;
+				snapshot = pending_ ? std::move(pending_) : std::move(requeued);
+				pending_.reset();
+				requeued.reset();
+			}
+
+			building = true;
+
+			const AccelerationState* reused = snapshot->acceleration->get();
+			std::shared_ptr<const LightBvh> lights;
+			if (fullBuildOnly && reused->lights) {
+				lights = reused->lights;
+			}
+			else {
+				// Edits can change what emits and how much, so the light hierarchy is rebuilt. It
+				// goes out with the reused BVH if there is one, and otherwise with the first build.
+				lights = LightBvh::build(snapshot->spheres, snapshot->materials, snapshot->emissiveSpheres());
+				lastLightBuildMs = lights->buildMs();
+				lastLightCount = lights->lightCount();
+
+				if (reused) {
+					snapshot->acceleration->publish({ reused->bvh, reused->changedSpheres, lights });
+				}
+
+				// Something to trace against right away matters more than its quality, so a snapshot
+				// that would otherwise be brute forced gets the quick build first
+				if (!reused && snapshot->spheres.size() > BRUTE_FORCE_LIMIT) {
+					std::shared_ptr<const Bvh> bvh = Bvh::build(snapshot->spheres, BvhQuality::FAST);
+					snapshot->acceleration->publish({ bvh, {}, lights });
+					Logger::debug("Quick BVH built in {}ms ({} nodes)", bvh->buildMs(), bvh->nodeCount());
+				}
+			}
+
+			// Don't spend a full build on a snapshot that has already been replaced
+			bool superseded;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				superseded = pending_ != nullptr;
+			}
+
+			if (!superseded) {
+				std::shared_ptr<const Bvh> bvh = Bvh::build(snapshot->spheres, BvhQuality::SAH);
+				snapshot->acceleration->publish({ bvh, {}, lights });
+				lastBuildMs = bvh->buildMs();
+				lastNodeCount = bvh->nodeCount();
+			}
+
+			// A skipped full build would otherwise leave the scene on the quick tree, or on one that
+			// tests the edited spheres by brute force, until the next edit
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				std::shared_ptr<const SceneSnapshot> latest = latest_.lock();
+				const AccelerationState* state = latest ? latest->acceleration->get() : nullptr;
+				if (!pending_ && state && state->bvh &&
+					(state->bvh->quality() != BvhQuality::SAH || !state->changedSpheres.empty())) {
+					requeued = latest;
+				}
+			}
+
+			building = false;
+		}
+	}
+
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "Ray.h"
+#include "Scene.h"
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mtn {
+
+	class LightBvh;
+
+	struct Aabb {
+		glm::vec3 min{ std::numeric_limits<float>::max() };
+		glm::vec3 max{ -std::numeric_limits<float>::max() };
+
+		inline void grow(const Aabb& b) { min = glm::min(min, b.min); max = glm::max(max, b.max); }
+		inline void grow(const glm::vec3& p) { min = glm::min(min, p); max = glm::max(max, p); }
+		inline glm::vec3 center() const { return (min + max) * 0.5f; }
+		inline float surfaceArea() const {
+			glm::vec3 e = glm::max(max - min, glm::vec3(0.0f));
+			return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+		}
+
+		static inline Aabb ofSphere(const Sphere& s) {
+			Aabb b;
+			b.min = s.pos - glm::vec3(s.radius);
+			b.max = s.pos + glm::vec3(s.radius);
+			return b;
+		}
+	};
+
+	struct BvhNode {
+		Aabb bounds;
+		uint32_t leftOrFirst = 0;	// Left child index for interior nodes, first primitive for leaves
+		uint32_t count = 0;			// Number of primitives, 0 for interior nodes (right = left + 1)
+	};
+
+	enum class BvhQuality {
+		FAST,	// Splits on Morton codes. Quick to build, slower to trace.
+		SAH		// Binned surface area heuristic
+	};
+
+	// Bounding volume hierarchy over the spheres of a snapshot. It stores sphere indices, not
+	// sphere data, so it can keep being used after spheres have been edited as long as the edited
+	// ones are also tested separately (see AccelerationState).
+	class Bvh {
+	public:
+		static std::shared_ptr<const Bvh> build(const CowVector<Sphere>& spheres, BvhQuality quality);
+
+		// Updates closestT and closestIdx if a sphere closer than closestT is hit
+		void intersect(const Ray& ray, const CowVector<Sphere>& spheres, float& closestT, int& closestIdx) const;
+
+		inline size_t nodeCount() const { return nodes_.size(); }
+		inline BvhQuality quality() const { return quality_; }
+		inline float buildMs() const { return buildMs_; }
+
+	private:
+		void buildSah(const std::vector<Aabb>& primBounds, uint32_t nodeIdx, uint32_t first, uint32_t count,
+					  uint32_t depth);
+		void buildMorton(const std::vector<Aabb>& primBounds, const std::vector<uint32_t>& codes,
+						 uint32_t nodeIdx, uint32_t first, uint32_t count, uint32_t depth);
+		Aabb boundsOf(const std::vector<Aabb>& primBounds, uint32_t first, uint32_t count) const;
+		void makeChildren(uint32_t nodeIdx);
+
+		static const uint32_t MAX_LEAF_SIZE = 4;
+		// The traversal stack holds at most one node per level. Below MEDIAN_DEPTH every split is at
+		// the median, which finishes any 32-bit primitive count within MAX_DEPTH levels however
+		// skewed the scene is.
+		static const uint32_t MAX_DEPTH = 64;
+		static const uint32_t MEDIAN_DEPTH = MAX_DEPTH - 32;
+
+		std::vector<BvhNode> nodes_;
+		std::vector<uint32_t> primIndices_;
+		BvhQuality quality_ = BvhQuality::SAH;
+		float buildMs_ = 0.0f;
+	};
+
+	// What the render thread traces against: a BVH that may predate some edits, plus the spheres
+	// that changed since it was built, which are tested by brute force. The light hierarchy is
+	// always built for the snapshot itself, and is null until it has been.
+	struct AccelerationState {
+		std::shared_ptr<const Bvh> bvh;
+		std::vector<uint32_t> changedSpheres;
+		std::shared_ptr<const LightBvh> lights;
+	};
+
+	// Per-snapshot slot that background builds publish into. Swapping in a better acceleration
+	// structure doesn't change what rays hit, so the render thread picks it up mid-frame without
+	// restarting accumulation.
+	class SceneAcceleration {
+	public:
+		inline const AccelerationState* get() const { return pState_.load(std::memory_order_acquire); }
+		void publish(AccelerationState state);
+
+	private:
+		std::mutex mutex_;
+		// Every published state stays alive as long as the snapshot, since rays may still be using it
+		std::vector<std::unique_ptr<AccelerationState>> states_;
+		std::atomic<const AccelerationState*> pState_{ nullptr };
+	};
+
+	// Builds acceleration structures for newly published snapshots on a background thread. Until a
+	// build finishes, a snapshot reuses the previous snapshot's BVH if the sphere count didn't
+	// change, and otherwise falls back to brute force. Full builds skipped for superseded snapshots
+	// are made up for on the latest one once the builder is idle.
+	class BvhBuilder {
+	public:
+		BvhBuilder();
+		~BvhBuilder();
+
+		// Main thread only
+		void attach(const std::shared_ptr<SceneSnapshot>& snapshot);
+		void shutdown();
+
+		std::atomic<bool> building{ false };
+		std::atomic<float> lastBuildMs{ 0.0f };
+		std::atomic<size_t> lastNodeCount{ 0 };
+		std::atomic<float> lastLightBuildMs{ 0.0f };
+		std::atomic<size_t> lastLightCount{ 0 };
+
+	private:
+		void buildLoop();
+
+		// Below this many spheres brute force is about as fast as the quick build
+		static const size_t BRUTE_FORCE_LIMIT = 64;
+
+		std::thread thread_;
+		std::mutex mutex_;
+		std::condition_variable cv_;
+		std::shared_ptr<const SceneSnapshot> pending_;
+		bool running_ = true;
+
+		std::weak_ptr<const SceneSnapshot> latest_;		// Guarded by mutex_
+
+		std::shared_ptr<SceneAcceleration> pLastAcceleration_;
+		size_t lastSphereCount_ = 0;
+		std::shared_ptr<const std::vector<uint32_t>> lastEmitters_;
+	};
+
+}
@@ -6,6 +6,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <algorithm>
+#include <execution>
+#include <numeric>
 
 mtn::Camera::Camera(float verticalFov, float nearClip, float farClip) 
 	: fov_(verticalFov), nearClip_(nearClip), farClip_(farClip) {}
@@ -71,7 +73,6 @@ bool mtn::Camera::update(float deltaTime) {
 
 	if (moved) {
 		recalculateView();
-		recalculateRayDirections();
 	}
 
 	return moved;
@@ -87,14 +88,59 @@ bool mtn::Camera::resize(uint32_t width, uint32_t height) {
 
 	recalculateView();
 	recalculateProjection();
-	recalculateRayDirections();
+	if (rayTableEnabled_) {
+		recalculateRayDirections();
+	}
 	
 	return true;
 }
 
+void mtn::Camera::setRayTableEnabled(bool enabled) {
+	if (enabled == rayTableEnabled_) {
+		return;
+	}
+
+	rayTableEnabled_ = enabled;
+	if (enabled) {
+		recalculateRayDirections();
+	}
+	else {
+		rayDirections_.reset();
+	}
+}
+
+glm::vec3 mtn::Camera::computeRayDirection(float x, float y) const {
+	// Convert from view space to world space
+	return glm::vec3(inverseView_ * glm::vec4(computeViewDirection(x, y), 0.0f));
+}
+
+glm::vec3 mtn::Camera::computeViewDirection(float x, float y) const {
+	// Same as applying the inverse projection to the pixel's NDC at z = 1
+	glm::vec4 target = rayBase_ + rayStepX_ * x + rayStepY_ * y;
+	// Perform the perspective divide
+	return glm::normalize(glm::vec3(target) / target.w);
+}
+
+bool mtn::Camera::projectToRaster(const glm::vec3& point, glm::vec2& raster) const {
+	glm::vec4 clip = projection_ * view_ * glm::vec4(point, 1.0f);
+	if (clip.w <= 0.0f) {
+		return false;
+	}
+
+	// NDC back to the pixel coordinates computeRayDirection() takes
+	raster = (glm::vec2(clip.x, clip.y) / clip.w + 1.0f) * 0.5f * glm::vec2((float)viewportWidth_, (float)viewportHeight_);
+	return raster.x >= 0.0f && raster.y >= 0.0f && raster.x < viewportWidth_ && raster.y < viewportHeight_;
+}
+
 void mtn::Camera::recalculateProjection() {
 	projection_ = glm::perspective(glm::radians(fov_), viewportWidth_ / (float)viewportHeight_, nearClip_, farClip_);
 	inverseProjection_ = glm::inverse(projection_);
+
+	// NDC = (2x / width - 1, 2y / height - 1, 1, 1), so the inverse projection of it splits into
+	// a constant part and a part that's linear in x and y
+	rayBase_ = inverseProjection_[2] + inverseProjection_[3] - inverseProjection_[0] - inverseProjection_[1];
+	rayStepX_ = inverseProjection_[0] * (2.0f / viewportWidth_);
+	rayStepY_ = inverseProjection_[1] * (2.0f / viewportHeight_);
 }
 
 void mtn::Camera::recalculateView() {
@@ -103,27 +149,19 @@ void mtn::Camera::recalculateView() {
 }
 
 void mtn::Camera::recalculateRayDirections() {
-	rayDirections_.resize(viewportWidth_ * viewportHeight_);
+	// A new table rather than an edit of the old one, which copies of the camera may still be reading
+	std::shared_ptr<std::vector<glm::vec3>> table =
+		std::make_shared<std::vector<glm::vec3>>((size_t)viewportWidth_ * viewportHeight_);
 
-	// Get coordinates and convert from screen space back to world space
-	for (uint32_t y = 0; y < viewportHeight_; ++y) {
-		for (uint32_t x = 0; x < viewportWidth_; ++x) {
-			uint32_t index = x + y * viewportWidth_;
-			glm::vec2 coord{ x / (float)viewportWidth_, y / (float)viewportHeight_ };
-
-			// Convert coord from [0, 1] to NDC
-			coord = coord * 2.0f - 1.0f;
-
-			// Convert coord from clip space to view space
-			// *** Step 1: Apply the inverse projection to the coord
-			glm::vec4 target = inverseProjection_ * glm::vec4(coord.x, coord.y, 1.0f, 1.0f);
-			// *** Step 2: Perform the perspective divide
-			target = glm::vec4(glm::normalize(glm::vec3(target) / target.w), 0.0f);
+	std::vector<uint32_t> rows(viewportHeight_);
+	std::iota(rows.begin(), rows.end(), 0);
 
-			// Convert coord from view space to world space
-			glm::vec3 rayDirection = glm::vec3(inverseView_ * target);
-
-			rayDirections_[index] = rayDirection;
+	// Rows are independent, and the inner loop is simple enough for the compiler to vectorize
+	std::for_each(std::execution::par_unseq, rows.begin(), rows.end(), [this, &table](uint32_t y) {
+		glm::vec3* row = table->data() + (size_t)y * viewportWidth_;
+		for (uint32_t x = 0; x < viewportWidth_; ++x) {
+			row[x] = computeViewDirection((float)x, (float)y);
 		}
-	}
+	});
+	rayDirections_ = std::move(table);
 }
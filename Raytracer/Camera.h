@@ -3,6 +3,7 @@
 #include <glfw/glfw3.h>
 #include <glm/glm.hpp>
 
+#include <memory>
 #include <vector>
 
 namespace mtn {
@@ -28,7 +29,25 @@ namespace mtn {
 		inline const glm::vec3& getPosition() const { return position_; }
 		inline const glm::vec3& getDirection() const { return forwardDir_; }
 
-		inline const std::vector<glm::vec3>& getRayDirections() const { return rayDirections_; }
+		// Reads the precomputed table if it's enabled, otherwise computes the direction on the fly
+		inline glm::vec3 getRayDirection(uint32_t x, uint32_t y) const {
+			return rayDirections_ ? glm::mat3(inverseView_) * (*rayDirections_)[x + y * viewportWidth_]
+								  : computeRayDirection((float)x, (float)y);
+		}
+		glm::vec3 computeRayDirection(float x, float y) const;
+
+		// The inverse of computeRayDirection(). Returns false if the point is behind the camera or
+		// projects outside the image.
+		bool projectToRaster(const glm::vec3& point, glm::vec2& raster) const;
+		// Area of the image plane at unit distance from the pinhole, which normalizes its importance
+		// and the density of its ray directions
+		inline float imagePlaneArea() const { return 4.0f / (projection_[0][0] * projection_[1][1]); }
+
+		// The table costs 12 bytes per pixel and saves the perspective divide and normalization per
+		// primary ray. It holds view space directions, so it's only rebuilt on resize or a projection
+		// change, and copies of the camera share it.
+		void setRayTableEnabled(bool enabled);
+		inline bool isRayTableEnabled() const { return rayTableEnabled_; }
 
 		inline bool movedThisFrame() { return moved_; }
 
@@ -39,6 +58,7 @@ namespace mtn {
 		void recalculateProjection();
 		void recalculateView();
 		void recalculateRayDirections();
+		glm::vec3 computeViewDirection(float x, float y) const;
 
 		glm::vec3 position_{ 0.0f, 0.0f, 5.0f };
 		glm::vec3 forwardDir_{ 0.0f, 0.0f, -1.0f };
@@ -60,9 +80,16 @@ namespace mtn {
 
 		glm::vec2 lastMousePos_{ 0.0f, 0.0f };
 
-		std::vector<glm::vec3> rayDirections_;
+		std::shared_ptr<const std::vector<glm::vec3>> rayDirections_;	// Null unless the table is enabled
+		bool rayTableEnabled_ = false;
 		bool moved_ = false;
 
+		// The inverse projection of a pixel's NDC is affine in the pixel coordinates, so it's
+		// precomputed as a base plus a step per pixel along x and y
+		glm::vec4 rayBase_{ 0.0f };
+		glm::vec4 rayStepX_{ 0.0f };
+		glm::vec4 rayStepY_{ 0.0f };
+
 		uint32_t viewportWidth_ = 0, viewportHeight_ = 0;
 	};
 
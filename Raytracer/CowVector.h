@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace mtn {
+
+	// Copy-on-write array split into fixed size chunks. Copying a CowVector only copies the chunk
+	// pointers, and editing an element only copies the chunk that holds it if another copy still
+	// shares that chunk. This lets the render thread keep reading an old version of the scene
+	// while the editor changes a new one, without either side copying the whole array.
+	template <typename T>
+	class CowVector {
+	public:
+		static constexpr size_t CHUNK_SHIFT = 10;
+		static constexpr size_t CHUNK_SIZE = size_t(1) << CHUNK_SHIFT;
+
+		using Chunk = std::vector<T>;
+
+		inline size_t size() const { return size_; }
+		inline bool empty() const { return size_ == 0; }
+
+		inline const T& operator[](size_t i) const {
+			return (*chunks_[i >> CHUNK_SHIFT])[i & (CHUNK_SIZE - 1)];
+		}
+
+		// Chunk access for tight loops over every element
+		inline size_t chunkCount() const { return chunks_.size(); }
+		inline const Chunk& chunk(size_t i) const { return *chunks_[i]; }
+
+		// Returns a writable reference, detaching the element's chunk from any other copies first
+		T& edit(size_t i) {
+			return (*detach(i >> CHUNK_SHIFT))[i & (CHUNK_SIZE - 1)];
+		}
+
+		template <typename... Args>
+		T& emplace_back(Args&&... args) {
+			if (size_ == chunks_.size() * CHUNK_SIZE) {
+				chunks_.push_back(std::make_shared<Chunk>());
+				chunks_.back()->reserve(CHUNK_SIZE);
+			}
+
+			++size_;
+			return detach(chunks_.size() - 1)->emplace_back(std::forward<Args>(args)...);
+		}
+
+		// Copies the elements instead of sharing the chunks, so the copy lives in memory allocated
+		// by the calling thread
+		CowVector clone() const {
+			CowVector copy;
+			for (const std::shared_ptr<Chunk>& chunk : chunks_) {
+				copy.chunks_.push_back(std::make_shared<Chunk>());
+				copy.chunks_.back()->reserve(CHUNK_SIZE);
+				copy.chunks_.back()->insert(copy.chunks_.back()->end(), chunk->begin(), chunk->end());
+			}
+			copy.size_ = size_;
+			return copy;
+		}
+
+		void clear() {
+			chunks_.clear();
+			size_ = 0;
+		}
+
+	private:
+		// A chunk can only gain new owners through copies of this vector, which are made on the
+		// thread that edits it, so a use count of 1 means no other copy still holds the chunk. The
+		// count is read relaxed though, and the render thread may have released its reference right
+		// after its last read of the chunk. The acquire fence pairs with the release of that
+		// decrement, so the reads are finished before the chunk is edited in place.
+		const std::shared_ptr<Chunk>& detach(size_t chunkIdx) {
+			std::shared_ptr<Chunk>& chunk = chunks_[chunkIdx];
+			if (chunk.use_count() > 1) {
+				std::shared_ptr<Chunk> copy = std::make_shared<Chunk>();
+				copy->reserve(CHUNK_SIZE);
+				copy->insert(copy->end(), chunk->begin(), chunk->end());
+				chunk = std::move(copy);
+			}
+			else {
+				std::atomic_thread_fence(std::memory_order_acquire);
+			}
+			return chunk;
+		}
+
+		std::vector<std::shared_ptr<Chunk>> chunks_;
+		size_t size_ = 0;
+	};
+
+}
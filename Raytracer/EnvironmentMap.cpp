@@ -0,0 +1,319 @@
+#include "EnvironmentMap.h"
+
+#include "Logger.h"
+
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace mtn {
+
+	namespace {
+
+		std::string extensionOf(const std::string& path) {
+			size_t dot = path.find_last_of('.');
+			std::string ext = dot == std::string::npos ? "" : path.substr(dot + 1);
+			std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+			return ext;
+		}
+
+		glm::vec3 rgbeToColor(const uint8_t* rgbe) {
+			if (rgbe[3] == 0) {
+				return glm::vec3(0.0f);
+			}
+			float scale = std::ldexp(1.0f, (int)rgbe[3] - (128 + 8));
+			return glm::vec3(rgbe[0] + 0.5f, rgbe[1] + 0.5f, rgbe[2] + 0.5f) * scale;
+		}
+
+		// Radiance RGBE, flat or with the per-channel run length encoding. Only the standard
+		// "-Y height +X width" orientation is supported.
+		bool loadHdr(std::ifstream& file, uint32_t& width, uint32_t& height, std::vector<glm::vec3>& pixels) {
+			std::string line;
+			std::getline(file, line);
+			if (line.rfind("#?", 0) != 0) {
+				Logger::error("Not a Radiance HDR file");
+				return false;
+			}
+
+			// The header ends at the first empty line
+			while (std::getline(file, line) && !line.empty()) {
+				if (line.rfind("FORMAT=", 0) == 0 && line != "FORMAT=32-bit_rle_rgbe") {
+					Logger::error("Unsupported HDR format '{}'", line);
+					return false;
+				}
+			}
+
+			char yAxis[3] = {}, xAxis[3] = {};
+			std::getline(file, line);
+			if (std::sscanf(line.c_str(), "%2s %u %2s %u", yAxis, &height, xAxis, &width) != 4 ||
+				std::strcmp(yAxis, "-Y") != 0 || std::strcmp(xAxis, "+X") != 0) {
+				Logger::error("Unsupported HDR resolution line '{}'", line);
+				return false;
+			}
+
+			pixels.resize((size_t)width * height);
+			std::vector<uint8_t> scanline((size_t)width * 4);
+			for (uint32_t y = 0; y < height; ++y) {
+				uint8_t start[4];
+				if (!file.read((char*)start, 4)) {
+					Logger::error("HDR file ends at scanline {}", y);
+					return false;
+				}
+
+				bool encoded = width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 &&
+							   (uint32_t)((start[2] << 8) | start[3]) == width;
+				if (!encoded) {
+					std::memcpy(scanline.data(), start, 4);
+					if (!file.read((char*)scanline.data() + 4, (std::streamsize)width * 4 - 4)) {
+						Logger::error("HDR file ends at scanline {}", y);
+						return false;
+					}
+				}
+				else {
+					// Each channel is stored separately as runs (count > 128) and literals
+					for (int channel = 0; channel < 4; ++channel) {
+						uint32_t x = 0;
+						while (x < width) {
+							int count = file.get();
+							if (count == EOF) {
+								Logger::error("HDR file ends at scanline {}", y);
+								return false;
+							}
+
+							bool run = count > 128;
+							count = run ? count - 128 : count;
+							if (count == 0 || x + count > width) {
+								Logger::error("Corrupt HDR scanline {}", y);
+								return false;
+							}
+
+							if (run) {
+								int value = file.get();
+								for (int i = 0; i < count; ++i) {
+									scanline[(x++) * 4 + channel] = (uint8_t)value;
+								}
+							}
+							else {
+								for (int i = 0; i < count; ++i) {
+									scanline[(x++) * 4 + channel] = (uint8_t)file.get();
+								}
+							}
+						}
+					}
+					if (!file) {
+						Logger::error("HDR file ends at scanline {}", y);
+						return false;
+					}
+				}
+
+				for (uint32_t x = 0; x < width; ++x) {
+					pixels[(size_t)y * width + x] = rgbeToColor(&scanline[(size_t)x * 4]);
+				}
+			}
+			return true;
+		}
+
+		// Portable float map, color (PF) or grayscale (Pf). Rows are stored bottom to top, and a
+		// negative scale means little endian.
+		bool loadPfm(std::ifstream& file, uint32_t& width, uint32_t& height, std::vector<glm::vec3>& pixels) {
+			std::string magic;
+			float scale;
+			file >> magic >> width >> height >> scale;
+			if (!file || (magic != "PF" && magic != "Pf")) {
+				Logger::error("Not a PFM file");
+				return false;
+			}
+			file.get();		// The single whitespace character before the data
+
+			int channels = magic == "PF" ? 3 : 1;
+			std::vector<float> data((size_t)width * height * channels);
+			if (!file.read((char*)data.data(), (std::streamsize)(data.size() * sizeof(float)))) {
+				Logger::error("PFM file is truncated");
+				return false;
+			}
+
+			const uint32_t one = 1;
+			bool hostLittleEndian = *(const uint8_t*)&one == 1;
+			if ((scale < 0.0f) != hostLittleEndian) {
+				for (float& f : data) {
+					uint8_t* b = (uint8_t*)&f;
+					std::swap(b[0], b[3]);
+					std::swap(b[1], b[2]);
+				}
+			}
+
+			pixels.resize((size_t)width * height);
+			for (uint32_t y = 0; y < height; ++y) {
+				const float* row = &data[(size_t)(height - 1 - y) * width * channels];
+				for (uint32_t x = 0; x < width; ++x) {
+					pixels[(size_t)y * width + x] = channels == 3
+						? glm::vec3(row[x * 3], row[x * 3 + 1], row[x * 3 + 2])
+						: glm::vec3(row[x]);
+				}
+			}
+			return true;
+		}
+
+	}
+
+	AliasTable::AliasTable(const std::vector<float>& weights) {
+		size_t count = weights.size();
+		entries_.resize(count);
+		pmf_.resize(count);
+		if (count == 0) {
+			return;
+		}
+
+		double total = 0.0;
+		for (float w : weights) {
+			total += std::max(w, 0.0f);
+		}
+
+		// Scaled so the average is 1. Entries below it are topped up by one entry above it.
+		std::vector<double> scaled(count);
+		std::vector<uint32_t> small, large;
+		for (size_t i = 0; i < count; ++i) {
+			pmf_[i] = total > 0.0 ? (float)(std::max(weights[i], 0.0f) / total) : 1.0f / count;
+			scaled[i] = total > 0.0 ? std::max(weights[i], 0.0f) / total * count : 1.0;
+			(scaled[i] < 1.0 ? small : large).push_back((uint32_t)i);
+		}
+
+		while (!small.empty() && !large.empty()) {
+			uint32_t s = small.back(), l = large.back();
+			small.pop_back();
+
+			entries_[s].threshold = (float)scaled[s];
+			entries_[s].alias = l;
+
+			scaled[l] -= 1.0 - scaled[s];
+			if (scaled[l] < 1.0) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+
+		// Whatever is left is 1 up to rounding error
+		for (uint32_t i : small) {
+			entries_[i] = { 1.0f, i };
+		}
+		for (uint32_t i : large) {
+			entries_[i] = { 1.0f, i };
+		}
+	}
+
+	uint32_t AliasTable::sample(float u, float& remapped) const {
+		float scaled = u * entries_.size();
+		uint32_t i = std::min((uint32_t)scaled, (uint32_t)entries_.size() - 1);
+		float v = scaled - i;
+
+		const Entry& entry = entries_[i];
+		if (v < entry.threshold) {
+			remapped = std::min(v / entry.threshold, 0.99999994f);
+			return i;
+		}
+		remapped = std::min((v - entry.threshold) / (1.0f - entry.threshold), 0.99999994f);
+		return entry.alias;
+	}
+
+	std::shared_ptr<const EnvironmentMap> EnvironmentMap::load(const std::string& path) {
+		Logger::trace("EnvironmentMap::load()");
+
+		std::ifstream file(path, std::ios::binary);
+		if (!file) {
+			Logger::error("Failed to open environment map {}", path);
+			return nullptr;
+		}
+
+		uint32_t width = 0, height = 0;
+		std::vector<glm::vec3> pixels;
+		std::string ext = extensionOf(path);
+		bool loaded = false;
+		if (ext == "hdr") {
+			loaded = loadHdr(file, width, height, pixels);
+		}
+		else if (ext == "pfm") {
+			loaded = loadPfm(file, width, height, pixels);
+		}
+		else {
+			Logger::error("Environment maps must be .hdr or .pfm, not '{}'", path);
+		}
+
+		if (!loaded || width == 0 || height == 0) {
+			Logger::error("Failed to load environment map {}", path);
+			return nullptr;
+		}
+
+		Logger::info("Loaded environment map {} ({}x{})", path, width, height);
+		return std::make_shared<const EnvironmentMap>(width, height, std::move(pixels));
+	}
+
+	EnvironmentMap::EnvironmentMap(uint32_t width, uint32_t height, std::vector<glm::vec3> pixels)
+		: width_(width), height_(height), pixels_(std::move(pixels)) {
+		// Rows near the poles cover less solid angle, by sin(theta). A single table over every pixel
+		// would leave too few of a float's 24 bits for the alias choice on large maps, so each table
+		// only spans one dimension.
+		std::vector<float> rowWeights(height_);
+		std::vector<float> weights(width_);
+		columns_.reserve(height_);
+		for (uint32_t y = 0; y < height_; ++y) {
+			float sinTheta = std::sin(glm::pi<float>() * (y + 0.5f) / height_);
+			double rowWeight = 0.0;
+			for (uint32_t x = 0; x < width_; ++x) {
+				const glm::vec3& c = pixels_[(size_t)y * width_ + x];
+				float luminance = glm::dot(glm::max(c, glm::vec3(0.0f)), glm::vec3(0.2126f, 0.7152f, 0.0722f));
+				weights[x] = luminance * sinTheta;
+				rowWeight += weights[x];
+			}
+			rowWeights[y] = (float)rowWeight;
+			columns_.emplace_back(weights);
+		}
+		rows_ = AliasTable(rowWeights);
+	}
+
+	uint32_t EnvironmentMap::pixelIndex(const glm::vec3& dir) const {
+		float u = (std::atan2(dir.z, dir.x) + glm::pi<float>()) * glm::one_over_two_pi<float>();
+		float v = std::acos(glm::clamp(dir.y, -1.0f, 1.0f)) * glm::one_over_pi<float>();
+		uint32_t x = std::min((uint32_t)(u * width_), width_ - 1);
+		uint32_t y = std::min((uint32_t)(v * height_), height_ - 1);
+		return y * width_ + x;
+	}
+
+	glm::vec3 EnvironmentMap::lookup(const glm::vec3& dir) const {
+		return pixels_[pixelIndex(dir)];
+	}
+
+	glm::vec3 EnvironmentMap::sample(const glm::vec2& u, glm::vec3& dir, float& pdf) const {
+		// The tables pick a row and then a column, and what's left of u.y and u.x places the point in
+		// the pixel
+		float uX, uY;
+		uint32_t y = rows_.sample(u.y, uY);
+		uint32_t x = columns_[y].sample(u.x, uX);
+
+		float theta = glm::pi<float>() * (y + uY) / height_;
+		float phi = glm::two_pi<float>() * (x + uX) / width_ - glm::pi<float>();
+		float sinTheta = std::sin(theta);
+		dir = glm::vec3(sinTheta * std::cos(phi), std::cos(theta), sinTheta * std::sin(phi));
+
+		// Uniform in (phi, theta) within the pixel, so the solid angle pdf divides by sin(theta)
+		pdf = sinTheta > 0.0f
+			? pixelPmf(x, y) * width_ * height_ / (2.0f * glm::pi<float>() * glm::pi<float>() * sinTheta)
+			: 0.0f;
+		return pixels_[(size_t)y * width_ + x];
+	}
+
+	float EnvironmentMap::pdf(const glm::vec3& dir) const {
+		float sinTheta = std::sqrt(std::max(0.0f, 1.0f - dir.y * dir.y));
+		if (sinTheta <= 0.0f) {
+			return 0.0f;
+		}
+		uint32_t idx = pixelIndex(dir);
+		return pixelPmf(idx % width_, idx / width_) * width_ * height_ /
+			   (2.0f * glm::pi<float>() * glm::pi<float>() * sinTheta);
+	}
+
+}
\ No newline at end of file
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mtn {
+
+	// Walker's alias method: picks index i with probability weights[i] / sum(weights) in constant
+	// time from a single uniform number
+	class AliasTable {
+	public:
+		AliasTable() = default;
+		explicit AliasTable(const std::vector<float>& weights);
+
+		// remapped is left uniform in [0, 1) and independent of the choice, so it can be reused
+		uint32_t sample(float u, float& remapped) const;
+		inline float pmf(uint32_t i) const { return pmf_[i]; }
+		inline size_t size() const { return entries_.size(); }
+
+	private:
+		struct Entry {
+			float threshold = 1.0f;		// Keep i below this, take the alias above it
+			uint32_t alias = 0;
+		};
+
+		std::vector<Entry> entries_;
+		std::vector<float> pmf_;
+	};
+
+	// Equirectangular HDR image of the radiance arriving from every direction, with +Y up. Pixels
+	// are importance sampled in proportion to their luminance times the solid angle they cover, by
+	// picking a row from the rows' totals and then a column from that row.
+	class EnvironmentMap {
+	public:
+		// Loads a Radiance .hdr or a .pfm file. Returns null and logs why if it can't.
+		static std::shared_ptr<const EnvironmentMap> load(const std::string& path);
+
+		EnvironmentMap(uint32_t width, uint32_t height, std::vector<glm::vec3> pixels);
+
+		glm::vec3 lookup(const glm::vec3& dir) const;
+
+		// Samples a direction with u, returning the radiance from it and its solid angle pdf
+		glm::vec3 sample(const glm::vec2& u, glm::vec3& dir, float& pdf) const;
+		float pdf(const glm::vec3& dir) const;
+
+		inline uint32_t width() const { return width_; }
+		inline uint32_t height() const { return height_; }
+
+	private:
+		uint32_t pixelIndex(const glm::vec3& dir) const;
+		inline float pixelPmf(uint32_t x, uint32_t y) const { return rows_.pmf(y) * columns_[y].pmf(x); }
+
+		uint32_t width_ = 0;
+		uint32_t height_ = 0;
+		std::vector<glm::vec3> pixels_;
+		AliasTable rows_;
+		std::vector<AliasTable> columns_;	// One per row
+	};
+
+}
\ No newline at end of file
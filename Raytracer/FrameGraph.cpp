@@ -0,0 +1,265 @@
+#include "FrameGraph.h"
+
+#include "Logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <execution>
+
+namespace mtn {
+
+	namespace {
+
+		float toMiB(size_t bytes) {
+			return bytes / (1024.0f * 1024.0f);
+		}
+
+	}
+
+	void* FramePassContext::data(FrameResource resource) const {
+		return graph_.resourceData(resource);
+	}
+
+	FrameResource FrameGraph::createBuffer(const std::string& name, size_t size) {
+		Resource& resource = resources_.emplace_back();
+		resource.name = name;
+		resource.size = size;
+		compiled_ = false;
+		return (FrameResource)(resources_.size() - 1);
+	}
+
+	FrameResource FrameGraph::importBuffer(const std::string& name, size_t size, void* data) {
+		Resource& resource = resources_.emplace_back();
+		resource.name = name;
+		resource.size = size;
+		resource.imported = true;
+		resource.importedData = data;
+		compiled_ = false;
+		return (FrameResource)(resources_.size() - 1);
+	}
+
+	void FrameGraph::setImportedData(FrameResource resource, void* data) {
+		resources_[resource].importedData = data;
+	}
+
+	void FrameGraph::addPass(const std::string& name, const std::vector<FrameResource>& reads,
+							 const std::vector<FrameResource>& writes, FramePassFn execute) {
+		Pass& pass = passes_.emplace_back();
+		pass.name = name;
+		pass.reads = reads;
+		pass.writes = writes;
+		pass.execute = std::move(execute);
+		compiled_ = false;
+	}
+
+	void FrameGraph::compile() {
+		Logger::trace("FrameGraph::compile()");
+
+		// Passes are declared in submission order. A pass goes one level after the last writer of
+		// anything it touches, and after the readers of anything it overwrites.
+		std::vector<int> lastWriter(resources_.size(), -1);
+		std::vector<std::vector<uint32_t>> readers(resources_.size());
+
+		levels_.clear();
+		for (uint32_t p = 0; p < passes_.size(); ++p) {
+			Pass& pass = passes_[p];
+			uint32_t level = 0;
+
+			for (FrameResource r : pass.reads) {
+				if (lastWriter[r] >= 0) {
+					level = std::max(level, passes_[lastWriter[r]].level + 1);
+				}
+				else if (!resources_[r].imported) {
+					Logger::warn("Frame graph pass '{}' reads '{}' before anything writes it", pass.name,
+								 resources_[r].name);
+				}
+			}
+			for (FrameResource w : pass.writes) {
+				if (lastWriter[w] >= 0) {
+					level = std::max(level, passes_[lastWriter[w]].level + 1);
+				}
+				for (uint32_t reader : readers[w]) {
+					if (reader != p) {
+						level = std::max(level, passes_[reader].level + 1);
+					}
+				}
+			}
+
+			pass.level = level;
+			if (levels_.size() <= level) {
+				levels_.resize(level + 1);
+			}
+			levels_[level].push_back(p);
+
+			for (FrameResource r : pass.reads) {
+				readers[r].push_back(p);
+			}
+			for (FrameResource w : pass.writes) {
+				lastWriter[w] = (int)p;
+				readers[w].clear();
+			}
+		}
+
+		// Transient buffers live from the first to the last level that touches them. Passes in the
+		// same level run concurrently, so lifetimes have to be tracked in levels, not passes.
+		for (Resource& resource : resources_) {
+			resource.firstLevel = resource.lastLevel = -1;
+			resource.block = -1;
+		}
+		for (const Pass& pass : passes_) {
+			auto touch = [this, &pass](FrameResource r) {
+				Resource& resource = resources_[r];
+				int level = (int)pass.level;
+				resource.firstLevel = resource.firstLevel < 0 ? level : std::min(resource.firstLevel, level);
+				resource.lastLevel = std::max(resource.lastLevel, level);
+			};
+			std::for_each(pass.reads.begin(), pass.reads.end(), touch);
+			std::for_each(pass.writes.begin(), pass.writes.end(), touch);
+		}
+
+		std::vector<uint32_t> transients;
+		for (uint32_t r = 0; r < resources_.size(); ++r) {
+			if (!resources_[r].imported && resources_[r].firstLevel >= 0) {
+				transients.push_back(r);
+			}
+		}
+		std::sort(transients.begin(), transients.end(), [this](uint32_t a, uint32_t b) {
+			return resources_[a].firstLevel < resources_[b].firstLevel;
+		});
+
+		// Greedy aliasing: reuse the smallest free block that fits, otherwise grow the largest free
+		// block, otherwise start a new one.
+		std::vector<size_t> blockSizes;
+		std::vector<int> blockBusyUntil;
+		for (uint32_t r : transients) {
+			Resource& resource = resources_[r];
+
+			int best = -1;
+			for (int b = 0; b < (int)blockSizes.size(); ++b) {
+				if (blockBusyUntil[b] >= resource.firstLevel) {
+					continue;
+				}
+				if (best < 0) {
+					best = b;
+					continue;
+				}
+
+				bool fits = blockSizes[b] >= resource.size;
+				bool bestFits = blockSizes[best] >= resource.size;
+				if ((fits && (!bestFits || blockSizes[b] < blockSizes[best])) ||
+					(!fits && !bestFits && blockSizes[b] > blockSizes[best])) {
+					best = b;
+				}
+			}
+
+			if (best < 0) {
+				best = (int)blockSizes.size();
+				blockSizes.push_back(0);
+				blockBusyUntil.push_back(-1);
+			}
+
+			blockSizes[best] = std::max(blockSizes[best], resource.size);
+			blockBusyUntil[best] = resource.lastLevel;
+			resource.block = best;
+		}
+
+		// Keep the existing allocations when a recompile ends up with the same layout
+		if (blockSizes != blockSizes_) {
+			blocks_.clear();
+			for (size_t size : blockSizes) {
+				blocks_.push_back(std::unique_ptr<uint8_t[]>(new uint8_t[size]));
+			}
+			blockSizes_ = blockSizes;
+		}
+
+		compiled_ = true;
+	}
+
+	void FrameGraph::execute(bool parallel, const std::function<bool()>& cancelled) {
+		if (!compiled_) {
+			compile();
+		}
+
+		auto runPass = [this](uint32_t p) {
+			Pass& pass = passes_[p];
+
+			auto startTime = std::chrono::steady_clock::now();
+			pass.execute(FramePassContext(*this));
+			auto endTime = std::chrono::steady_clock::now();
+
+			pass.lastMs = std::chrono::duration<float, std::milli>(endTime - startTime).count();
+			pass.averageMs = pass.averageMs > 0.0f ? pass.averageMs + (pass.lastMs - pass.averageMs) * 0.1f
+											 : pass.lastMs;
+		};
+
+		for (const std::vector<uint32_t>& level : levels_) {
+			if (cancelled()) {
+				return;
+			}
+
+			if (parallel && level.size() > 1) {
+				std::for_each(std::execution::par, level.begin(), level.end(), runPass);
+			}
+			else {
+				std::for_each(level.begin(), level.end(), runPass);
+			}
+		}
+	}
+
+	void FrameGraph::clear() {
+		resources_.clear();
+		passes_.clear();
+		levels_.clear();
+		compiled_ = false;
+	}
+
+	std::string FrameGraph::report() const {
+		std::string out;
+		char line[256];
+
+		std::snprintf(line, sizeof(line), "%zu passes in %zu levels\n", passes_.size(), levels_.size());
+		out += line;
+		for (const Pass& pass : passes_) {
+			std::snprintf(line, sizeof(line), "  L%u %-12s %7.2fms (avg %.2fms)\n", pass.level,
+						  pass.name.c_str(), pass.lastMs, pass.averageMs);
+			out += line;
+		}
+
+		size_t transientSize = 0, importedSize = 0;
+		for (const Resource& resource : resources_) {
+			if (resource.imported) {
+				importedSize += resource.size;
+				std::snprintf(line, sizeof(line), "  %-14s %8.2f MiB  imported\n", resource.name.c_str(),
+							  toMiB(resource.size));
+			}
+			else {
+				transientSize += resource.size;
+				std::snprintf(line, sizeof(line), "  %-14s %8.2f MiB  block %d, L%d-L%d\n", resource.name.c_str(),
+							  toMiB(resource.size), resource.block, resource.firstLevel, resource.lastLevel);
+			}
+			out += line;
+		}
+
+		size_t allocatedSize = 0;
+		for (size_t size : blockSizes_) {
+			allocatedSize += size;
+		}
+		std::snprintf(line, sizeof(line), "Transient: %.2f MiB allocated for %.2f MiB of buffers\n",
+					  toMiB(allocatedSize), toMiB(transientSize));
+		out += line;
+		std::snprintf(line, sizeof(line), "Imported: %.2f MiB\n", toMiB(importedSize));
+		out += line;
+
+		return out;
+	}
+
+	void* FrameGraph::resourceData(FrameResource resource) const {
+		const Resource& r = resources_[resource];
+		if (r.imported) {
+			return r.importedData;
+		}
+		return r.block >= 0 ? blocks_[r.block].get() : nullptr;
+	}
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mtn {
+
+	using FrameResource = uint32_t;
+
+	class FrameGraph;
+
+	// Handed to a pass while it executes, for looking up the memory behind its resources
+	class FramePassContext {
+	public:
+		FramePassContext(FrameGraph& graph) : graph_(graph) {}
+
+		template <typename T>
+		T* get(FrameResource resource) const { return static_cast<T*>(data(resource)); }
+
+	private:
+		void* data(FrameResource resource) const;
+
+		FrameGraph& graph_;
+	};
+
+	using FramePassFn = std::function<void(const FramePassContext&)>;
+
+	// A small frame graph for the CPU render passes. Passes declare the buffers they read and write,
+	// compile() orders them into levels of independent passes and packs transient buffers with
+	// non-overlapping lifetimes into shared allocations, and execute() runs each level's passes
+	// concurrently.
+	class FrameGraph {
+	public:
+		// Buffers the graph owns, which only live for the duration of a frame
+		FrameResource createBuffer(const std::string& name, size_t size);
+		// Buffers owned outside the graph, which keep their contents between frames
+		FrameResource importBuffer(const std::string& name, size_t size, void* data = nullptr);
+		void setImportedData(FrameResource resource, void* data);
+
+		void addPass(const std::string& name, const std::vector<FrameResource>& reads,
+					 const std::vector<FrameResource>& writes, FramePassFn execute);
+
+		void compile();
+		// Runs the passes level by level, skipping the remaining levels once cancelled() is true
+		void execute(bool parallel, const std::function<bool()>& cancelled);
+		void clear();
+
+		// Per-pass timing and memory usage of the compiled graph
+		std::string report() const;
+
+		inline bool isCompiled() const { return compiled_; }
+
+	private:
+		friend class FramePassContext;
+
+		struct Resource {
+			std::string name;
+			size_t size = 0;
+			bool imported = false;
+			void* importedData = nullptr;
+
+			// Transient buffers only
+			int block = -1;
+			int firstLevel = -1, lastLevel = -1;
+		};
+
+		struct Pass {
+			std::string name;
+			std::vector<FrameResource> reads, writes;
+			FramePassFn execute;
+
+			uint32_t level = 0;
+			float lastMs = 0.0f;
+			float averageMs = 0.0f;
+		};
+
+		void* resourceData(FrameResource resource) const;
+
+		std::vector<Resource> resources_;
+		std::vector<Pass> passes_;
+		std::vector<std::vector<uint32_t>> levels_;			// Pass indices per level
+		std::vector<std::unique_ptr<uint8_t[]>> blocks_;	// Backing memory for transient buffers
+		std::vector<size_t> blockSizes_;
+
+		bool compiled_ = false;
+	};
+
+}
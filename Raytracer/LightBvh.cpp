@@ -0,0 +1,397 @@
+#include "LightBvh.h"
+
+#include "Logger.h"
+
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+
+namespace mtn {
+
+	namespace {
+
+		inline float safeSqrt(float x) {
+			return std::sqrt(std::max(x, 0.0f));
+		}
+
+		inline float safeAcos(float x) {
+			return std::acos(glm::clamp(x, -1.0f, 1.0f));
+		}
+
+		// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+		inline float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+			if (cosA > cosB) {
+				return 1.0f;
+			}
+			return cosA * cosB + sinA * sinB;
+		}
+
+		inline float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+			if (cosA > cosB) {
+				return 0.0f;
+			}
+			return sinA * cosB - cosA * sinB;
+		}
+
+	}
+
+	LightBounds LightBounds::ofSphere(const Sphere& sphere, const Material& material) {
+		// A sphere emits in every direction, and its power is its radiance over its area and the
+		// hemisphere at each point
+		glm::vec3 emission = material.getEmission();
+		float luminance = glm::dot(emission, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+
+		LightBounds light;
+		light.bounds = Aabb::ofSphere(sphere);
+		light.cosThetaO = -1.0f;
+		light.cosThetaE = 0.0f;
+		light.power = std::max(luminance, 1e-6f) * 4.0f * glm::pi<float>() * sphere.radius * sphere.radius *
+					  glm::pi<float>();
+		return light;
+	}
+
+	LightBounds LightBounds::merge(const LightBounds& a, const LightBounds& b) {
+		if (a.isEmpty()) {
+			return b;
+		}
+		if (b.isEmpty()) {
+			return a;
+		}
+
+		LightBounds merged;
+		merged.bounds = a.bounds;
+		merged.bounds.grow(b.bounds);
+		merged.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+		merged.power = a.power + b.power;
+
+		// Smallest cone around both normal cones
+		float thetaA = safeAcos(a.cosThetaO), thetaB = safeAcos(b.cosThetaO);
+		float thetaD = safeAcos(glm::dot(a.axis, b.axis));
+		if (std::min(thetaD + thetaB, glm::pi<float>()) <= thetaA) {
+			merged.axis = a.axis;
+			merged.cosThetaO = a.cosThetaO;
+			return merged;
+		}
+		if (std::min(thetaD + thetaA, glm::pi<float>()) <= thetaB) {
+			merged.axis = b.axis;
+			merged.cosThetaO = b.cosThetaO;
+			return merged;
+		}
+
+		float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+		glm::vec3 rotationAxis = glm::cross(a.axis, b.axis);
+		if (thetaO >= glm::pi<float>() || glm::dot(rotationAxis, rotationAxis) < 1e-12f) {
+			merged.axis = a.axis;
+			merged.cosThetaO = -1.0f;
+			return merged;
+		}
+
+		// Rotate a's axis toward b's until the cone's edge lines up with a's
+		float thetaR = thetaO - thetaA;
+		glm::vec3 toward = glm::cross(glm::normalize(rotationAxis), a.axis);
+		merged.axis = glm::normalize(a.axis * std::cos(thetaR) + toward * std::sin(thetaR));
+		merged.cosThetaO = std::cos(thetaO);
+		return merged;
+	}
+
+	float LightBounds::importance(const glm::vec3& pos, const glm::vec3& normal) const {
+		glm::vec3 center = bounds.center();
+		glm::vec3 toPos = pos - center;
+		float distanceSq = glm::dot(toPos, toPos);
+
+		// Distances inside the bounds would blow up. Clamping the squared distance to the radius of
+		// the bounding sphere, rather than to its square, keeps nearby nodes from being flattened.
+		glm::vec3 halfDiagonal = (bounds.max - bounds.min) * 0.5f;
+		float radiusSq = glm::dot(halfDiagonal, halfDiagonal);
+		distanceSq = std::max(distanceSq, std::sqrt(radiusSq));
+		glm::vec3 wi = toPos / std::sqrt(std::max(glm::dot(toPos, toPos), 1e-12f));
+
+		// Angle the bounds subtend from pos, all directions if pos is inside them
+		float cosThetaB = -1.0f;
+		if (glm::dot(toPos, toPos) > radiusSq) {
+			cosThetaB = safeSqrt(1.0f - radiusSq / glm::dot(toPos, toPos));
+		}
+		float sinThetaB = safeSqrt(1.0f - cosThetaB * cosThetaB);
+
+		// Smallest angle between an emission normal and a direction toward pos
+		float cosThetaW = glm::dot(axis, wi);
+		float sinThetaW = safeSqrt(1.0f - cosThetaW * cosThetaW);
+		float sinThetaO = safeSqrt(1.0f - cosThetaO * cosThetaO);
+		float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+		float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+		float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+		if (cosThetaP <= cosThetaE) {
+			return 0.0f;
+		}
+
+		float importance = power * cosThetaP / distanceSq;
+
+		// Smallest angle between the surface normal and a direction toward the lights
+		if (normal != glm::vec3(0.0f)) {
+			float cosThetaI = glm::dot(-wi, normal);
+			float sinThetaI = safeSqrt(1.0f - cosThetaI * cosThetaI);
+			importance *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+		}
+		return std::max(importance, 0.0f);
+	}
+
+	float LightBounds::orientationMeasure() const {
+		float thetaO = safeAcos(cosThetaO);
+		float thetaE = safeAcos(cosThetaE);
+		float thetaW = std::min(thetaO + thetaE, glm::pi<float>());
+		float sinThetaO = safeSqrt(1.0f - cosThetaO * cosThetaO);
+		return glm::two_pi<float>() * (1.0f - cosThetaO) +
+			   glm::half_pi<float>() * (2.0f * thetaW * sinThetaO - std::cos(thetaO - 2.0f * thetaW) -
+										2.0f * thetaO * sinThetaO + cosThetaO);
+	}
+
+	std::shared_ptr<const LightBvh> LightBvh::build(const CowVector<Sphere>& spheres,
+													const CowVector<Material>& materials,
+													const std::vector<uint32_t>& emitters) {
+		Logger::trace("LightBvh::build()");
+
+		auto startTime = std::chrono::steady_clock::now();
+
+		std::shared_ptr<LightBvh> bvh = std::make_shared<LightBvh>();
+		bvh->leafOfSphere_.assign(spheres.size(), INVALID_NODE);
+
+		uint32_t lightCount = (uint32_t)emitters.size();
+		if (lightCount == 0) {
+			return bvh;
+		}
+
+		std::vector<LightBounds> lightBounds(lightCount);
+		for (uint32_t i = 0; i < lightCount; ++i) {
+			const Sphere& sphere = spheres[emitters[i]];
+			lightBounds[i] = LightBounds::ofSphere(sphere, materials[sphere.matIdx]);
+		}
+
+		std::vector<uint32_t> order(lightCount);
+		std::iota(order.begin(), order.end(), 0);
+
+		bvh->leaves_.resize(lightCount);
+		bvh->nodes_.reserve(2 * (size_t)lightCount - 1);
+		bvh->nodes_.emplace_back();
+		bvh->buildNode(lightBounds, emitters, order, 0, 0, lightCount);
+
+		bvh->buildMs_ = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+		return bvh;
+	}
+
+	void LightBvh::buildNode(const std::vector<LightBounds>& lightBounds, const std::vector<uint32_t>& emitters,
+							 std::vector<uint32_t>& order, uint32_t nodeIdx, uint32_t first, uint32_t count) {
+		nodes_[nodeIdx].firstLight = first;
+		nodes_[nodeIdx].lightCount = count;
+		if (count == 1) {
+			leaves_[first] = nodeIdx;
+			uint32_t sphereIdx = emitters[order[first]];
+			nodes_[nodeIdx].bounds = lightBounds[order[first]];
+			nodes_[nodeIdx].childOrLight = sphereIdx;
+			nodes_[nodeIdx].leaf = true;
+			leafOfSphere_[sphereIdx] = nodeIdx;
+			return;
+		}
+
+		Aabb bounds, centroidBounds;
+		for (uint32_t i = first; i < first + count; ++i) {
+			bounds.grow(lightBounds[order[i]].bounds);
+			centroidBounds.grow(lightBounds[order[i]].bounds.center());
+		}
+		glm::vec3 extent = bounds.max - bounds.min;
+		float maxExtent = std::max(std::max(extent.x, extent.y), extent.z);
+
+		const int NUM_BINS = 12;
+
+		// Binned surface area orientation heuristic: like the SAH, but each side is also weighted by
+		// its power and by how widely its lights point, and thin axes are penalized so the nodes
+		// stay roughly cubical
+		auto cost = [](const LightBounds& b) {
+			return b.power * b.orientationMeasure() * b.bounds.surfaceArea();
+		};
+
+		int bestAxis = -1, bestSplit = 0;
+		float bestCost = std::numeric_limits<float>::max();
+		for (int axis = 0; axis < 3; ++axis) {
+			float axisMin = centroidBounds.min[axis], axisMax = centroidBounds.max[axis];
+			if (axisMax - axisMin < 1e-6f) {
+				continue;
+			}
+
+			LightBounds bins[NUM_BINS];
+			float scale = NUM_BINS / (axisMax - axisMin);
+			for (uint32_t i = first; i < first + count; ++i) {
+				const LightBounds& b = lightBounds[order[i]];
+				int bin = std::min(NUM_BINS - 1, (int)((b.bounds.center()[axis] - axisMin) * scale));
+				bins[bin] = LightBounds::merge(bins[bin], b);
+			}
+
+			float rightCost[NUM_BINS - 1];
+			LightBounds right;
+			for (int i = NUM_BINS - 1; i > 0; --i) {
+				right = LightBounds::merge(right, bins[i]);
+				rightCost[i - 1] = right.isEmpty() ? -1.0f : cost(right);
+			}
+
+			float axisWeight = maxExtent / std::max(extent[axis], 1e-6f);
+			LightBounds left;
+			for (int i = 0; i < NUM_BINS - 1; ++i) {
+				left = LightBounds::merge(left, bins[i]);
+				if (left.isEmpty() || rightCost[i] < 0.0f) {
+					continue;
+				}
+
+				float splitCost = axisWeight * (cost(left) + rightCost[i]);
+				if (splitCost < bestCost) {
+					bestCost = splitCost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+
+		// Without a usable axis all the centroids are in the same spot, so any split is as good as another
+		uint32_t mid = first + count / 2;
+		if (bestAxis >= 0) {
+			float axisMin = centroidBounds.min[bestAxis];
+			float scale = NUM_BINS / (centroidBounds.max[bestAxis] - axisMin);
+			auto it = std::partition(order.begin() + first, order.begin() + first + count, [&](uint32_t idx) {
+				int bin = std::min(NUM_BINS - 1, (int)((lightBounds[idx].bounds.center()[bestAxis] - axisMin) * scale));
+				return bin <= bestSplit;
+			});
+			mid = (uint32_t)(it - order.begin());
+		}
+
+		uint32_t left = (uint32_t)nodes_.size();
+		nodes_.emplace_back();
+		nodes_.emplace_back();
+		nodes_[left].parent = nodeIdx;
+		nodes_[left + 1].parent = nodeIdx;
+		nodes_[nodeIdx].childOrLight = left;
+
+		buildNode(lightBounds, emitters, order, left, first, mid - first);
+		buildNode(lightBounds, emitters, order, left + 1, mid, first + count - mid);
+
+		nodes_[nodeIdx].bounds = LightBounds::merge(nodes_[left].bounds, nodes_[left + 1].bounds);
+	}
+
+	bool LightBvh::sample(const glm::vec3& pos, const glm::vec3& normal, float u, uint32_t& sphereIdx,
+						  float& pmf) const {
+		if (nodes_.empty()) {
+			return false;
+		}
+
+		pmf = 1.0f;
+		uint32_t nodeIdx = 0;
+		while (!nodes_[nodeIdx].leaf) {
+			const LightBvhNode& node = nodes_[nodeIdx];
+			if (node.lightCount <= CLUSTER_SIZE) {
+				float importance[CLUSTER_SIZE];
+				float total = clusterImportance(pos, normal, node, importance);
+				if (total <= 0.0f) {
+					return false;
+				}
+
+				// Falls through to the last light with any importance if rounding leaves u past the end
+				float target = u * total;
+				uint32_t pick = 0;
+				for (uint32_t i = 0; i < node.lightCount; ++i) {
+					if (importance[i] > 0.0f) {
+						pick = i;
+						if (target < importance[i]) {
+							break;
+						}
+					}
+					target -= importance[i];
+				}
+				pmf *= importance[pick] / total;
+				sphereIdx = nodes_[leaves_[node.firstLight + pick]].childOrLight;
+				return true;
+			}
+
+			uint32_t left = nodes_[nodeIdx].childOrLight;
+			float leftImportance = nodes_[left].bounds.importance(pos, normal);
+			float rightImportance = nodes_[left + 1].bounds.importance(pos, normal);
+			float total = leftImportance + rightImportance;
+			if (total <= 0.0f) {
+				return false;
+			}
+			// Computed exactly as childProbability() does, so pmf() gives back the same value
+			float pLeft = leftImportance / total;
+			float pRight = rightImportance / total;
+
+			// Reuse the same random number all the way down by rescaling it into the chosen range
+			if (u < pLeft) {
+				u = std::min(u / pLeft, 0.99999994f);
+				pmf *= pLeft;
+				nodeIdx = left;
+			}
+			else {
+				u = std::min((u - pLeft) / pRight, 0.99999994f);
+				pmf *= pRight;
+				nodeIdx = left + 1;
+			}
+		}
+
+		sphereIdx = nodes_[nodeIdx].childOrLight;
+		return true;
+	}
+
+	float LightBvh::pmf(const glm::vec3& pos, const glm::vec3& normal, uint32_t sphereIdx) const {
+		if (sphereIdx >= leafOfSphere_.size() || leafOfSphere_[sphereIdx] == INVALID_NODE) {
+			return 0.0f;
+		}
+
+		// Same choices as sample(), starting from the cluster the leaf was picked from, if any, and
+		// walked back up to the root
+		uint32_t leaf = leafOfSphere_[sphereIdx];
+		uint32_t cluster = leaf;
+		while (cluster != 0 && nodes_[nodes_[cluster].parent].lightCount <= CLUSTER_SIZE) {
+			cluster = nodes_[cluster].parent;
+		}
+
+		float pmf = 1.0f;
+		if (cluster != leaf) {
+			const LightBvhNode& node = nodes_[cluster];
+			float importance[CLUSTER_SIZE];
+			float total = clusterImportance(pos, normal, node, importance);
+			// A leaf's first light is its own position in leaves_
+			float own = importance[nodes_[leaf].firstLight - node.firstLight];
+			if (total <= 0.0f || own <= 0.0f) {
+				return 0.0f;
+			}
+			pmf = own / total;
+		}
+		for (uint32_t nodeIdx = cluster; nodeIdx != 0; nodeIdx = nodes_[nodeIdx].parent) {
+			pmf *= childProbability(pos, normal, nodeIdx);
+			if (pmf <= 0.0f) {
+				return 0.0f;
+			}
+		}
+		return pmf;
+	}
+
+	float LightBvh::childProbability(const glm::vec3& pos, const glm::vec3& normal, uint32_t childIdx) const {
+		uint32_t left = nodes_[nodes_[childIdx].parent].childOrLight;
+		float leftImportance = nodes_[left].bounds.importance(pos, normal);
+		float rightImportance = nodes_[left + 1].bounds.importance(pos, normal);
+		float total = leftImportance + rightImportance;
+		if (total <= 0.0f) {
+			return 0.0f;
+		}
+		return (childIdx == left ? leftImportance : rightImportance) / total;
+	}
+
+	float LightBvh::clusterImportance(const glm::vec3& pos, const glm::vec3& normal, const LightBvhNode& cluster,
+									  float* importance) const {
+		float total = 0.0f;
+		for (uint32_t i = 0; i < cluster.lightCount; ++i) {
+			importance[i] = nodes_[leaves_[cluster.firstLight + i]].bounds.importance(pos, normal);
+			total += importance[i];
+		}
+		return total;
+	}
+
+}
\ No newline at end of file
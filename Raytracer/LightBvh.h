@@ -0,0 +1,89 @@
+#pragma once
+
+#include "Bvh.h"
+#include "CowVector.h"
+#include "Scene.h"
+
+#include <glm/glm.hpp>
+
+#include <limits>
+#include <memory>
+#include <vector>
+
+namespace mtn {
+
+	// Conservative bounds on a group of lights: where they are, which way they emit and how much.
+	// Emission normals lie within thetaO of the axis, and each light emits up to thetaE past its
+	// normal. Both angles are stored as cosines.
+	struct LightBounds {
+		Aabb bounds;
+		glm::vec3 axis{ 0.0f, 0.0f, 1.0f };
+		float cosThetaO = 1.0f;
+		float cosThetaE = 0.0f;
+		float power = 0.0f;
+
+		inline bool isEmpty() const { return power <= 0.0f; }
+
+		static LightBounds ofSphere(const Sphere& sphere, const Material& material);
+		static LightBounds merge(const LightBounds& a, const LightBounds& b);
+
+		// Upper bound style estimate of how much the lights contribute to a surface at pos facing
+		// normal. It's only zero when nothing in the bounds can reach the surface.
+		float importance(const glm::vec3& pos, const glm::vec3& normal) const;
+
+		// Measure of the directions the lights emit in, used by the build's cost function
+		float orientationMeasure() const;
+	};
+
+	struct LightBvhNode {
+		LightBounds bounds;
+		uint32_t childOrLight = 0;	// Left child for interior nodes (right = left + 1), sphere index for leaves
+		uint32_t parent = 0;
+		bool leaf = false;
+		uint32_t firstLight = 0;	// The node's leaves are leaves_[firstLight, firstLight + lightCount)
+		uint32_t lightCount = 0;
+	};
+
+	// Hierarchy over the emissive spheres of a snapshot, with one light per leaf. Lights are picked
+	// by walking down from the root and choosing each child in proportion to its importance, so the
+	// cost grows with the depth of the tree rather than the number of lights. Once a node holds
+	// CLUSTER_SIZE lights or fewer, one of them is picked directly in proportion to its own
+	// importance. That's more accurate than the bounds of the small nodes below.
+	class LightBvh {
+	public:
+		static std::shared_ptr<const LightBvh> build(const CowVector<Sphere>& spheres,
+													 const CowVector<Material>& materials,
+													 const std::vector<uint32_t>& emitters);
+
+		// Picks an emissive sphere for a surface at pos facing normal. Returns false if none of them
+		// can contribute.
+		bool sample(const glm::vec3& pos, const glm::vec3& normal, float u, uint32_t& sphereIdx,
+					float& pmf) const;
+
+		// Probability of sample() picking the sphere from the same surface
+		float pmf(const glm::vec3& pos, const glm::vec3& normal, uint32_t sphereIdx) const;
+
+		inline size_t nodeCount() const { return nodes_.size(); }
+		inline size_t lightCount() const { return nodes_.empty() ? 0 : (nodes_.size() + 1) / 2; }
+		inline float buildMs() const { return buildMs_; }
+
+	private:
+		void buildNode(const std::vector<LightBounds>& lightBounds, const std::vector<uint32_t>& emitters,
+					   std::vector<uint32_t>& order, uint32_t nodeIdx, uint32_t first, uint32_t count);
+
+		// Probability of walking into childIdx once its parent is reached
+		float childProbability(const glm::vec3& pos, const glm::vec3& normal, uint32_t childIdx) const;
+		// Importance of each leaf of a cluster node, returning their sum
+		float clusterImportance(const glm::vec3& pos, const glm::vec3& normal, const LightBvhNode& cluster,
+								float* importance) const;
+
+		static const uint32_t CLUSTER_SIZE = 16;
+		static const uint32_t INVALID_NODE = std::numeric_limits<uint32_t>::max();
+
+		std::vector<LightBvhNode> nodes_;
+		std::vector<uint32_t> leafOfSphere_;	// Leaf holding each sphere, INVALID_NODE for non-emitters
+		std::vector<uint32_t> leaves_;			// Leaf nodes in build order, so every node's leaves are a range
+		float buildMs_ = 0.0f;
+	};
+
+}
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include "Numa.h"
+
+#include "Logger.h"
+
+#include <algorithm>
+#include <new>
+#include <thread>
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <Windows.h>
+#endif
+
+namespace mtn {
+
+	namespace numa {
+
+	#ifdef _WIN32
+
+		uint32_t nodeCount() {
+			ULONG highestNode = 0;
+			if (!GetNumaHighestNodeNumber(&highestNode)) {
+				return 1;
+			}
+			return (uint32_t)highestNode + 1;
+		}
+
+		uint32_t processorCount(uint32_t node) {
+			GROUP_AFFINITY affinity{};
+			if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity)) {
+				return 0;
+			}
+
+			uint32_t count = 0;
+			for (KAFFINITY mask = affinity.Mask; mask; mask &= mask - 1) {
+				++count;
+			}
+			return count;
+		}
+
+		bool bindCurrentThread(uint32_t node) {
+			GROUP_AFFINITY affinity{};
+			if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) || affinity.Mask == 0) {
+				return false;
+			}
+			return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+		}
+
+		void* allocateUntouched(size_t bytes) {
+			// Committed pages don't get physical memory until they're first written
+			void* data = VirtualAlloc(nullptr, std::max<size_t>(bytes, 1), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+			if (!data) {
+				Logger::error("VirtualAlloc failed for {} bytes", bytes);
+				throw std::bad_alloc();
+			}
+			return data;
+		}
+
+		void release(void* data, size_t) {
+			VirtualFree(data, 0, MEM_RELEASE);
+		}
+
+	#else
+
+		uint32_t nodeCount() {
+			return 1;
+		}
+
+		uint32_t processorCount(uint32_t) {
+			return std::max(std::thread::hardware_concurrency(), 1u);
+		}
+
+		bool bindCurrentThread(uint32_t) {
+			return false;
+		}
+
+		void* allocateUntouched(size_t bytes) {
+			// Large allocations are mapped lazily by the allocator, which gives first touch placement
+			return ::operator new(std::max<size_t>(bytes, 1));
+		}
+
+		void release(void* data, size_t) {
+			::operator delete(data);
+		}
+
+	#endif
+
+	}
+
+}
\ No newline at end of file
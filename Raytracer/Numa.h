@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+namespace mtn {
+
+	// Minimal view of the machine's NUMA topology. On platforms without a NUMA API everything is
+	// reported as a single node, which makes the NUMA-aware paths degrade to plain multithreading.
+	namespace numa {
+
+		uint32_t nodeCount();
+		uint32_t processorCount(uint32_t node);
+
+		// Restricts the calling thread to the processors of a node
+		bool bindCurrentThread(uint32_t node);
+
+		// Maps pages without touching them, so each page is placed on the node of the thread that
+		// first writes to it
+		void* allocateUntouched(size_t bytes);
+		void release(void* data, size_t bytes);
+
+		template <typename T>
+		std::shared_ptr<T[]> makeUntouchedArray(size_t count) {
+			size_t bytes = count * sizeof(T);
+			return std::shared_ptr<T[]>(static_cast<T*>(allocateUntouched(bytes)),
+										[bytes](T* data) { release(data, bytes); });
+		}
+
+	}
+
+}
\ No newline at end of file
@@ -0,0 +1,278 @@
+#include "PathGuide.h"
+
+#include "Logger.h"
+
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace mtn {
+
+	namespace {
+
+		std::unique_ptr<std::atomic<float>[]> zeroedEnergy(size_t count) {
+			std::unique_ptr<std::atomic<float>[]> energy(new std::atomic<float>[count]);
+			for (size_t i = 0; i < count; ++i) {
+				energy[i].store(0.0f, std::memory_order_relaxed);
+			}
+			return energy;
+		}
+
+		// (cos theta, phi) mapping between the unit square and the sphere, which preserves area
+		glm::vec2 dirToSquare(const glm::vec3& dir) {
+			float phi = std::atan2(dir.y, dir.x);
+			if (phi < 0.0f) {
+				phi += glm::two_pi<float>();
+			}
+			return glm::clamp(glm::vec2((dir.z + 1.0f) * 0.5f, phi * glm::one_over_two_pi<float>()),
+							  glm::vec2(0.0f), glm::vec2(0.99999994f));
+		}
+
+		glm::vec3 squareToDir(const glm::vec2& p) {
+			float cosTheta = p.x * 2.0f - 1.0f;
+			float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+			float phi = glm::two_pi<float>() * p.y;
+			return glm::vec3(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+		}
+
+		// Picks between two options with weights a and b and rescales u back to [0, 1)
+		inline int choose(float& u, float a, float b) {
+			float pA = a / (a + b);
+			if (u < pA) {
+				u = std::min(u / pA, 0.99999994f);
+				return 0;
+			}
+			u = std::min((u - pA) / (1.0f - pA), 0.99999994f);
+			return 1;
+		}
+
+	}
+
+	DTree::DTree() : nodes_(1), energy_(4, 0.0f), recorded_(zeroedEnergy(4)) {}
+
+	DTree::DTree(const DTree& other)
+		: nodes_(other.nodes_), energy_(other.energy_), recorded_(zeroedEnergy(other.energy_.size())),
+		  total_(other.total_) {}
+
+	glm::vec3 DTree::sample(glm::vec2 u) const {
+		glm::vec2 origin(0.0f);
+		float size = 1.0f;
+		uint32_t node = 0;
+		while (true) {
+			// The column from its marginal, then the quadrant within it
+			const float* e = &energy_[node * 4];
+			int qx = choose(u.x, e[0] + e[2], e[1] + e[3]);
+			int qy = choose(u.y, e[qx], e[qx + 2]);
+
+			size *= 0.5f;
+			origin += glm::vec2((float)qx, (float)qy) * size;
+
+			uint32_t child = nodes_[node].child[qx + 2 * qy];
+			if (child == 0) {
+				return squareToDir(origin + u * size);
+			}
+			node = child;
+		}
+	}
+
+	float DTree::pdf(const glm::vec3& dir) const {
+		if (!isUsable()) {
+			return 0.0f;
+		}
+
+		glm::vec2 p = dirToSquare(dir);
+		float density = 1.0f;
+		uint32_t node = 0;
+		while (true) {
+			const float* e = &energy_[node * 4];
+			float total = e[0] + e[1] + e[2] + e[3];
+			if (total <= 0.0f) {
+				return 0.0f;
+			}
+
+			int qx = p.x >= 0.5f, qy = p.y >= 0.5f;
+			int q = qx + 2 * qy;
+			density *= 4.0f * e[q] / total;
+
+			uint32_t child = nodes_[node].child[q];
+			if (child == 0 || density <= 0.0f) {
+				break;
+			}
+			p = (p - glm::vec2((float)qx, (float)qy) * 0.5f) * 2.0f;
+			node = child;
+		}
+		return density / (4.0f * glm::pi<float>());
+	}
+
+	void DTree::record(const glm::vec3& dir, float value) {
+		if (!(value > 0.0f) || !std::isfinite(value)) {
+			return;
+		}
+
+		glm::vec2 p = dirToSquare(dir);
+		uint32_t node = 0;
+		while (true) {
+			int qx = p.x >= 0.5f, qy = p.y >= 0.5f;
+			int q = qx + 2 * qy;
+			uint32_t child = nodes_[node].child[q];
+			if (child == 0) {
+				std::atomic<float>& energy = recorded_[node * 4 + q];
+				float old = energy.load(std::memory_order_relaxed);
+				while (!energy.compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {}
+				return;
+			}
+			p = (p - glm::vec2((float)qx, (float)qy) * 0.5f) * 2.0f;
+			node = child;
+		}
+	}
+
+	float DTree::recordedSum(uint32_t node, int quadrant) const {
+		uint32_t child = nodes_[node].child[quadrant];
+		if (child == 0) {
+			return recorded_[node * 4 + quadrant].load(std::memory_order_relaxed);
+		}
+		return recordedSum(child, 0) + recordedSum(child, 1) + recordedSum(child, 2) + recordedSum(child, 3);
+	}
+
+	void DTree::refine() {
+		float quadrantEnergy[4];
+		float total = 0.0f;
+		for (int q = 0; q < 4; ++q) {
+			quadrantEnergy[q] = recordedSum(0, q);
+			total += quadrantEnergy[q];
+		}
+
+		std::vector<Node> nodes(1);
+		std::vector<float> energy(4, 0.0f);
+		buildRefined(nodes, energy, 0, 0, quadrantEnergy, total, 1);
+
+		nodes_ = std::move(nodes);
+		energy_ = std::move(energy);
+		total_ = total;
+		recorded_ = zeroedEnergy(energy_.size());
+		sampleCount_ = 0;
+	}
+
+	void DTree::buildRefined(std::vector<Node>& nodes, std::vector<float>& energy, uint32_t newNode,
+							 int oldNode, const float quadrantEnergy[4], float total, int depth) const {
+		for (int q = 0; q < 4; ++q) {
+			energy[newNode * 4 + q] = quadrantEnergy[q];
+			if (total <= 0.0f || quadrantEnergy[q] <= total * SUBDIVIDE_FRACTION || depth >= MAX_DEPTH) {
+				continue;
+			}
+
+			// Quadrants that were already subdivided pass on what their children recorded, new ones
+			// split their energy evenly so the distribution doesn't change until more is recorded
+			float childEnergy[4];
+			int oldChild = oldNode >= 0 && nodes_[oldNode].child[q] != 0 ? (int)nodes_[oldNode].child[q] : -1;
+			for (int i = 0; i < 4; ++i) {
+				childEnergy[i] = oldChild >= 0 ? recordedSum(oldChild, i) : quadrantEnergy[q] * 0.25f;
+			}
+
+			uint32_t child = (uint32_t)nodes.size();
+			nodes.emplace_back();
+			energy.resize(energy.size() + 4, 0.0f);
+			nodes[newNode].child[q] = child;
+			buildRefined(nodes, energy, child, oldChild, childEnergy, total, depth + 1);
+		}
+	}
+
+	void PathGuide::reset(const Aabb& bounds) {
+		Logger::trace("PathGuide::reset()");
+
+		bounds_ = bounds;
+		nodes_.assign(1, SNode());
+		dTrees_.clear();
+		dTrees_.push_back(std::make_unique<DTree>());
+		iteration_ = 0;
+		iterationSamples_ = 0.0f;
+	}
+
+	const DTree* PathGuide::find(const glm::vec3& pos) const {
+		if (nodes_.empty()) {
+			return nullptr;
+		}
+		const DTree* dTree = dTrees_[nodes_[findLeaf(pos)].dTree].get();
+		return dTree->isUsable() ? dTree : nullptr;
+	}
+
+	void PathGuide::record(const glm::vec3& pos, const glm::vec3& dir, float value) {
+		if (nodes_.empty()) {
+			return;
+		}
+		DTree& dTree = *dTrees_[nodes_[findLeaf(pos)].dTree];
+		dTree.countSample();
+		dTree.record(dir, value);
+	}
+
+	bool PathGuide::addSamples(float samplesPerPixel) {
+		if (nodes_.empty() || !isTraining()) {
+			return false;
+		}
+
+		iterationSamples_ += samplesPerPixel;
+		if (iterationSamples_ < (float)(1u << iteration_)) {
+			return false;
+		}
+
+		refine();
+		++iteration_;
+		iterationSamples_ = 0.0f;
+		return true;
+	}
+
+	uint32_t PathGuide::findLeaf(const glm::vec3& pos) const {
+		glm::vec3 min = bounds_.min, max = bounds_.max;
+		uint32_t node = 0;
+		while (nodes_[node].child != 0) {
+			int axis = nodes_[node].axis;
+			float mid = (min[axis] + max[axis]) * 0.5f;
+			if (pos[axis] < mid) {
+				max[axis] = mid;
+				node = nodes_[node].child;
+			}
+			else {
+				min[axis] = mid;
+				node = nodes_[node].child + 1;
+			}
+		}
+		return node;
+	}
+
+	void PathGuide::refine() {
+		// Leaves that saw enough samples split in two, and both halves start from the parent's
+		// refined directional tree. The threshold grows with the iteration length.
+		float threshold = SPATIAL_THRESHOLD * std::sqrt((float)(1u << iteration_));
+
+		std::vector<std::pair<uint32_t, uint32_t>> stack{ { 0, 0 } };
+		while (!stack.empty()) {
+			auto [node, depth] = stack.back();
+			stack.pop_back();
+			if (nodes_[node].child != 0) {
+				stack.push_back({ nodes_[node].child, depth + 1 });
+				stack.push_back({ nodes_[node].child + 1, depth + 1 });
+				continue;
+			}
+
+			DTree& dTree = *dTrees_[nodes_[node].dTree];
+			uint32_t count = dTree.sampleCount();
+			dTree.refine();
+
+			if (count > threshold && depth < MAX_SPATIAL_DEPTH) {
+				SNode left, right;
+				left.axis = right.axis = (uint8_t)((nodes_[node].axis + 1) % 3);
+				left.dTree = nodes_[node].dTree;
+				right.dTree = (uint32_t)dTrees_.size();
+				dTrees_.push_back(std::make_unique<DTree>(dTree));
+
+				nodes_[node].child = (uint32_t)nodes_.size();
+				nodes_.push_back(left);
+				nodes_.push_back(right);
+			}
+		}
+
+		Logger::debug("Path guide iteration {}: {} spatial leaves", iteration_, dTrees_.size());
+	}
+
+}
\ No newline at end of file
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "Bvh.h"
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace mtn {
+
+	// Directional quadtree over the sphere, mapped to the unit square by (cos theta, phi) so every
+	// cell covers solid angle in proportion to its area. Sampling and pdfs use the energy recorded
+	// in the previous training iteration, while the current one records into a zeroed copy of the
+	// same structure.
+	class DTree {
+	public:
+		DTree();
+		DTree(const DTree& other);
+
+		// Returns a direction drawn in proportion to the learned incident radiance
+		glm::vec3 sample(glm::vec2 u) const;
+		// Solid angle pdf of sample() returning dir
+		float pdf(const glm::vec3& dir) const;
+		inline bool isUsable() const { return total_ > 0.0f; }
+
+		// Thread safe, called by workers while rendering
+		void record(const glm::vec3& dir, float value);
+		inline void countSample() { sampleCount_.fetch_add(1, std::memory_order_relaxed); }
+		inline uint32_t sampleCount() const { return sampleCount_.load(std::memory_order_relaxed); }
+
+		// Rebuilds the structure around what was recorded, subdividing cells that hold more than
+		// a fraction of the energy and merging the rest, and makes it the new sampling distribution
+		void refine();
+
+		inline size_t nodeCount() const { return nodes_.size(); }
+
+	private:
+		struct Node {
+			uint32_t child[4] = { 0, 0, 0, 0 };	// 0 for quadrants that aren't subdivided
+		};
+
+		float recordedSum(uint32_t node, int quadrant) const;
+		void buildRefined(std::vector<Node>& nodes, std::vector<float>& energy, uint32_t newNode,
+						  int oldNode, const float quadrantEnergy[4], float total, int depth) const;
+
+		static const int MAX_DEPTH = 20;
+		static constexpr float SUBDIVIDE_FRACTION = 0.01f;
+
+		std::vector<Node> nodes_;
+		std::vector<float> energy_;		// 4 per node, the sampling distribution
+		std::unique_ptr<std::atomic<float>[]> recorded_;	// 4 per node, only at the deepest quadrants
+		std::atomic<uint32_t> sampleCount_{ 0 };
+		float total_ = 0.0f;
+	};
+
+	// Müller et al.'s SD-tree: a binary spatial subdivision of the scene whose leaves each hold a
+	// DTree. Paths record the radiance they find into it while rendering, and refine() ends a
+	// training iteration between frames. Iterations double in length, so the learned distribution
+	// keeps improving while the early noisy ones cost little.
+	class PathGuide {
+	public:
+		void reset(const Aabb& bounds);
+
+		// Null where nothing has been learned yet
+		const DTree* find(const glm::vec3& pos) const;
+		// Thread safe
+		void record(const glm::vec3& pos, const glm::vec3& dir, float value);
+
+		// Called by the render thread between frames with the samples per pixel just taken. Returns
+		// true if a training iteration ended and the sampling distribution changed.
+		bool addSamples(float samplesPerPixel);
+
+		inline bool isTraining() const { return iteration_ < MAX_ITERATIONS; }
+		inline uint32_t iteration() const { return iteration_; }
+		inline size_t leafCount() const { return dTrees_.size(); }
+
+	private:
+		struct SNode {
+			uint32_t child = 0;		// Left child (right = left + 1), 0 for leaves
+			uint32_t dTree = 0;
+			uint8_t axis = 0;
+		};
+
+		uint32_t findLeaf(const glm::vec3& pos) const;
+		void refine();
+
+		static const uint32_t MAX_ITERATIONS = 12;
+		static const uint32_t SPATIAL_THRESHOLD = 12000;
+		static const uint32_t MAX_SPATIAL_DEPTH = 24;
+
+		Aabb bounds_;
+		std::vector<SNode> nodes_;
+		std::vector<std::unique_ptr<DTree>> dTrees_;
+		uint32_t iteration_ = 0;
+		float iterationSamples_ = 0.0f;
+	};
+
+}
\ No newline at end of file
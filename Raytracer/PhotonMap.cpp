@@ -0,0 +1,167 @@
+#include "PhotonMap.h"
+
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <execution>
+#include <memory>
+#include <numeric>
+
+namespace mtn {
+
+	static_assert(sizeof(Photon) == 20, "Photons are meant to stay compact");
+
+	namespace {
+		const uint32_t BUILD_CHUNK = 1 << 16;
+
+		inline float signNotZero(float v) {
+			return v >= 0.0f ? 1.0f : -1.0f;
+		}
+
+		inline uint16_t quantize(float v) {
+			return (uint16_t)std::lround(glm::clamp(v * 0.5f + 0.5f, 0.0f, 1.0f) * 65535.0f);
+		}
+
+		inline float dequantize(uint16_t v) {
+			return v / 65535.0f * 2.0f - 1.0f;
+		}
+	}
+
+	Photon::Photon(const glm::vec3& pos, const glm::vec3& dir, const glm::vec3& power) : pos(pos) {
+		// Folds the octahedron's lower half over the upper one
+		glm::vec2 p = glm::vec2(dir) / (std::abs(dir.x) + std::abs(dir.y) + std::abs(dir.z));
+		if (dir.z < 0.0f) {
+			p = glm::vec2((1.0f - std::abs(p.y)) * signNotZero(p.x), (1.0f - std::abs(p.x)) * signNotZero(p.y));
+		}
+		this->dir[0] = quantize(p.x);
+		this->dir[1] = quantize(p.y);
+
+		// Ward's RGBE: the mantissas are scaled so the largest channel fills its 8 bits
+		float largest = glm::max(glm::max(power.r, power.g), power.b);
+		if (largest > 1e-32f) {
+			int exponent;
+			float scale = std::frexp(largest, &exponent) * 256.0f / largest;
+			// Rounded rather than truncated, so a channel that's 0 decodes to 0 and doesn't tint the photon
+			auto mantissa = [scale](float c) { return std::min((uint32_t)(c * scale + 0.5f), 255u); };
+			this->power = mantissa(power.r) | (mantissa(power.g) << 8) | (mantissa(power.b) << 16) |
+						  ((uint32_t)(exponent + 128) << 24);
+		}
+	}
+
+	glm::vec3 Photon::getDir() const {
+		glm::vec2 p(dequantize(dir[0]), dequantize(dir[1]));
+		glm::vec3 v(p, 1.0f - std::abs(p.x) - std::abs(p.y));
+		if (v.z < 0.0f) {
+			v = glm::vec3((1.0f - std::abs(p.y)) * signNotZero(p.x), (1.0f - std::abs(p.x)) * signNotZero(p.y), v.z);
+		}
+		return glm::normalize(v);
+	}
+
+	glm::vec3 Photon::getPower() const {
+		uint32_t exponent = power >> 24;
+		if (exponent == 0) {
+			return glm::vec3(0.0f);
+		}
+		float scale = std::ldexp(1.0f, (int)exponent - (128 + 8));
+		return glm::vec3((float)(power & 0xFF), (float)((power >> 8) & 0xFF), (float)((power >> 16) & 0xFF)) * scale;
+	}
+
+	uint32_t PhotonMap::bucket(const glm::ivec3& cell) const {
+		// Teschner et al.'s spatial hash
+		return (((uint32_t)cell.x * 73856093u) ^ ((uint32_t)cell.y * 19349663u) ^ ((uint32_t)cell.z * 83492791u)) &
+			   bucketMask_;
+	}
+
+	void PhotonMap::build(std::vector<Photon>&& photons, float radius) {
+		radius_ = radius;
+		cellSize_ = 2.0f * radius;
+
+		// About one bucket per photon keeps cells that share a bucket rare
+		uint32_t bucketCount = 1024;
+		while (bucketCount < photons.size() && bucketCount < (1u << 30)) {
+			bucketCount <<= 1;
+		}
+		bucketMask_ = bucketCount - 1;
+
+		// A counting sort: count the photons per bucket, turn the counts into offsets, then move
+		// every photon to the next free slot of its bucket
+		uint32_t count = (uint32_t)photons.size();
+		std::vector<uint32_t> chunks((count + BUILD_CHUNK - 1) / BUILD_CHUNK);
+		std::iota(chunks.begin(), chunks.end(), 0);
+		std::vector<uint32_t> buckets(count);
+		std::unique_ptr<std::atomic<uint32_t>[]> cursors(new std::atomic<uint32_t>[bucketCount]());
+
+		std::for_each(std::execution::par, chunks.begin(), chunks.end(), [&](uint32_t chunk) {
+			for (uint32_t i = chunk * BUILD_CHUNK; i < std::min(count, (chunk + 1) * BUILD_CHUNK); ++i) {
+				buckets[i] = bucket(glm::ivec3(glm::floor(photons[i].pos / cellSize_)));
+				cursors[buckets[i]].fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+
+		cellStart_.resize(bucketCount + 1);
+		uint32_t offset = 0;
+		for (uint32_t i = 0; i < bucketCount; ++i) {
+			cellStart_[i] = offset;
+			offset += cursors[i].load(std::memory_order_relaxed);
+			cursors[i].store(cellStart_[i], std::memory_order_relaxed);
+		}
+		cellStart_[bucketCount] = offset;
+
+		photons_.resize(count);
+		std::for_each(std::execution::par, chunks.begin(), chunks.end(), [&](uint32_t chunk) {
+			for (uint32_t i = chunk * BUILD_CHUNK; i < std::min(count, (chunk + 1) * BUILD_CHUNK); ++i) {
+				photons_[cursors[buckets[i]].fetch_add(1, std::memory_order_relaxed)] = photons[i];
+			}
+		});
+
+		photons.clear();
+		photons.shrink_to_fit();
+	}
+
+	void PhotonMap::clear() {
+		photons_.clear();
+		photons_.shrink_to_fit();
+		cellStart_.clear();
+		cellStart_.shrink_to_fit();
+	}
+
+	glm::vec3 PhotonMap::estimate(const glm::vec3& pos, const glm::vec3& normal) const {
+		if (photons_.empty()) {
+			return glm::vec3(0.0f);
+		}
+
+		// The cells are twice the radius wide, so the sphere overlaps at most two along each axis
+		glm::ivec3 lo(glm::floor((pos - radius_) / cellSize_));
+		// Rounding can still put hi two cells past lo, which would overrun visited
+		glm::ivec3 hi = glm::min(glm::ivec3(glm::floor((pos + radius_) / cellSize_)), lo + 1);
+
+		// Neighbouring cells can share a bucket, which must only be read once
+		uint32_t visited[8];
+		uint32_t visitedCount = 0;
+		float radiusSq = radius_ * radius_;
+		glm::vec3 sum(0.0f);
+		for (int z = lo.z; z <= hi.z; ++z) {
+			for (int y = lo.y; y <= hi.y; ++y) {
+				for (int x = lo.x; x <= hi.x; ++x) {
+					uint32_t b = bucket(glm::ivec3(x, y, z));
+					if (std::find(visited, visited + visitedCount, b) != visited + visitedCount) {
+						continue;
+					}
+					visited[visitedCount++] = b;
+
+					for (uint32_t i = cellStart_[b]; i < cellStart_[b + 1]; ++i) {
+						const Photon& photon = photons_[i];
+						glm::vec3 offset = photon.pos - pos;
+						if (glm::dot(offset, offset) <= radiusSq && glm::dot(photon.getDir(), normal) < 0.0f) {
+							sum += photon.getPower();
+						}
+					}
+				}
+			}
+		}
+		return sum / (glm::pi<float>() * radiusSq);
+	}
+
+}
\ No newline at end of file
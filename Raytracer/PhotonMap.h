@@ -0,0 +1,55 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace mtn {
+
+	// 20 bytes, so a hundred million photons fit in 2 GB
+	struct Photon {
+		Photon() = default;
+		Photon(const glm::vec3& pos, const glm::vec3& dir, const glm::vec3& power);
+
+		glm::vec3 getDir() const;
+		glm::vec3 getPower() const;
+
+		glm::vec3 pos{ 0.0f };
+		uint32_t power = 0;			// RGBE, the three channels share an 8 bit exponent
+		uint16_t dir[2] = { 0, 0 };	// Octahedral encoding of the direction it was travelling in
+	};
+
+	// Photons sorted by cell of a hashed uniform grid. Cells are as wide as the gather diameter, so
+	// a lookup only reads the photons of the eight cells around it, and each cell's photons sit next
+	// to each other in memory.
+	class PhotonMap {
+	public:
+		// Sorts the photons into their cells in parallel. The gather radius is fixed until the next
+		// build, since it sets the cell size.
+		void build(std::vector<Photon>&& photons, float radius);
+		void clear();
+
+		// Sum of the power of the photons within the radius that arrived at the front of the surface,
+		// per unit area. Times a diffuse BRDF, this is the radiance they reflect.
+		glm::vec3 estimate(const glm::vec3& pos, const glm::vec3& normal) const;
+
+		inline size_t size() const { return photons_.size(); }
+		inline float getRadius() const { return radius_; }
+		inline size_t memoryBytes() const {
+			return photons_.size() * sizeof(Photon) + cellStart_.size() * sizeof(uint32_t);
+		}
+
+	private:
+		uint32_t bucket(const glm::ivec3& cell) const;
+
+		std::vector<Photon> photons_;
+		// The photons of bucket i are [cellStart_[i], cellStart_[i + 1]). Cells that hash to the same
+		// bucket share it, and the distance test sorts them out.
+		std::vector<uint32_t> cellStart_;
+		uint32_t bucketMask_ = 0;
+		float radius_ = 0.0f;
+		float cellSize_ = 1.0f;
+	};
+
+}
\ No newline at end of file
@@ -0,0 +1,73 @@
+#include "PixelFilter.h"
+
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace mtn {
+
+	PixelFilter::PixelFilter(FilterType type, float radius) : type_(type), radius_(std::max(radius, 1e-3f)) {
+		if (type_ != FilterType::GAUSSIAN && type_ != FilterType::BLACKMAN_HARRIS) {
+			return;
+		}
+
+		// Piecewise constant over the bins, which is close enough at this resolution to be
+		// indistinguishable from the filter itself
+		cdf_.resize(TABLE_SIZE + 1);
+		cdf_[0] = 0.0f;
+		float binWidth = 2.0f * radius_ / TABLE_SIZE;
+		for (uint32_t i = 0; i < TABLE_SIZE; ++i) {
+			cdf_[i + 1] = cdf_[i] + evaluate(-radius_ + (i + 0.5f) * binWidth);
+		}
+		float total = cdf_[TABLE_SIZE];
+		for (float& c : cdf_) {
+			c /= total;
+		}
+	}
+
+	float PixelFilter::evaluate(float x) const {
+		x = std::abs(x);
+		if (x > radius_) {
+			return 0.0f;
+		}
+
+		switch (type_) {
+			case FilterType::TENT: return radius_ - x;
+			case FilterType::GAUSSIAN: {
+				float sigma = radius_ / 3.0f;
+				float scale = -0.5f / (sigma * sigma);
+				return std::max(std::exp(scale * x * x) - std::exp(scale * radius_ * radius_), 0.0f);
+			}
+			case FilterType::BLACKMAN_HARRIS: {
+				float t = glm::two_pi<float>() * (x + radius_) / (2.0f * radius_);
+				return 0.35875f - 0.48829f * std::cos(t) + 0.14128f * std::cos(2.0f * t) -
+					   0.01168f * std::cos(3.0f * t);
+			}
+			default: return 1.0f;
+		}
+	}
+
+	glm::vec2 PixelFilter::sample(const glm::vec2& u) const {
+		return glm::vec2(sample1D(u.x), sample1D(u.y));
+	}
+
+	float PixelFilter::sample1D(float u) const {
+		switch (type_) {
+			case FilterType::NONE: return 0.0f;
+			case FilterType::BOX: return (2.0f * u - 1.0f) * radius_;
+			case FilterType::TENT:
+				// Inverse of the tent's cumulative weight, one half at a time
+				return u < 0.5f ? radius_ * (std::sqrt(2.0f * u) - 1.0f)
+								: radius_ * (1.0f - std::sqrt(2.0f - 2.0f * u));
+			default: {
+				uint32_t bin = (uint32_t)(std::upper_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin()) - 1;
+				bin = std::min(bin, TABLE_SIZE - 1);
+				float width = cdf_[bin + 1] - cdf_[bin];
+				float t = width > 0.0f ? (u - cdf_[bin]) / width : 0.5f;
+				return -radius_ + (bin + t) * (2.0f * radius_ / TABLE_SIZE);
+			}
+		}
+	}
+
+}
\ No newline at end of file
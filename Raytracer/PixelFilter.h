@@ -0,0 +1,46 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace mtn {
+
+	enum class FilterType : int {
+		NONE = 0,			// Every sample goes through the pixel's corner
+		BOX,
+		TENT,
+		GAUSSIAN,			// Standard deviation of a third of the radius, shifted down to 0 at it
+		BLACKMAN_HARRIS
+	};
+
+	// Reconstruction filter that primary rays are importance sampled from (filter importance
+	// sampling). Each sample is offset from the pixel center in proportion to the filter's weight
+	// there, so averaging a pixel's own samples with equal weights converges to the filtered image
+	// without splatting into the neighbours. Every filter here is separable and non-negative.
+	class PixelFilter {
+	public:
+		PixelFilter(FilterType type, float radius);
+
+		// Offset from the pixel center in pixels, within the radius on both axes
+		glm::vec2 sample(const glm::vec2& u) const;
+		// Unnormalized weight of one axis at offset x
+		float evaluate(float x) const;
+
+		inline FilterType getType() const { return type_; }
+		inline float getRadius() const { return radius_; }
+
+	private:
+		float sample1D(float u) const;
+
+		static const uint32_t TABLE_SIZE = 256;
+
+		FilterType type_;
+		float radius_;
+		// Cumulative weight at the TABLE_SIZE + 1 bin edges over [-radius, radius], normalized to
+		// end at 1, for the filters without a closed form inverse
+		std::vector<float> cdf_;
+	};
+
+}
\ No newline at end of file
@@ -0,0 +1,230 @@
+#include "RadianceCache.h"
+
+#include "Scene.h"
+
+#include <cmath>
+
+namespace mtn {
+
+	namespace {
+		const int COORD_BITS = 20;
+		const uint64_t COORD_MASK = (uint64_t(1) << COORD_BITS) - 1;
+
+		// splitmix64's finalizer, so neighbouring cells land far apart in the table
+		inline uint64_t mixBits(uint64_t x) {
+			x ^= x >> 30;
+			x *= 0xBF58476D1CE4E5B9ull;
+			x ^= x >> 27;
+			x *= 0x94D049BB133111EBull;
+			x ^= x >> 31;
+			return x;
+		}
+
+		inline int64_t signExtend(uint64_t coord) {
+			return (int64_t)(coord << (64 - COORD_BITS)) >> (64 - COORD_BITS);
+		}
+
+		inline void atomicAdd(std::atomic<float>& target, float value) {
+			float old = target.load(std::memory_order_relaxed);
+			while (!target.compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {}
+		}
+
+		bool sameSphere(const Sphere& a, const Sphere& b) {
+			return a.pos == b.pos && a.radius == b.radius && a.matIdx == b.matIdx;
+		}
+
+		bool sameMaterial(const Material& a, const Material& b) {
+			return a.matType == b.matType && a.albedo == b.albedo && a.metallicness == b.metallicness &&
+				   a.getEmission() == b.getEmission() && a.refractiveIndex == b.refractiveIndex;
+		}
+	}
+
+	RadianceCache::RadianceCache() : entries_(new Entry[TABLE_SIZE]) {
+		clear();
+	}
+
+	uint64_t RadianceCache::cellKey(const glm::vec3& pos, const glm::vec3& normal) const {
+		glm::vec3 cell = glm::floor(pos / cellSize_);
+
+		// One cell per face of the dominant axis, so the two sides of a thin sphere or the faces
+		// meeting at a crease don't share their light
+		glm::vec3 a = glm::abs(normal);
+		int axis = a.x >= a.y && a.x >= a.z ? 0 : (a.y >= a.z ? 1 : 2);
+		uint64_t face = (uint64_t)(axis * 2 + (normal[axis] < 0.0f ? 1 : 0)) + 1;
+
+		// Coordinates wrap outside of 2^20 cells, which only lets far apart cells collide
+		return (((uint64_t)(int64_t)cell.x & COORD_MASK) << (3 + 2 * COORD_BITS)) |
+			   (((uint64_t)(int64_t)cell.y & COORD_MASK) << (3 + COORD_BITS)) |
+			   (((uint64_t)(int64_t)cell.z & COORD_MASK) << 3) | face;
+	}
+
+	glm::vec3 RadianceCache::cellCenter(uint64_t key) const {
+		glm::vec3 cell((float)signExtend(key >> (3 + 2 * COORD_BITS)),
+					   (float)signExtend(key >> (3 + COORD_BITS)),
+					   (float)signExtend(key >> 3));
+		return (cell + 0.5f) * cellSize_;
+	}
+
+	uint32_t RadianceCache::findOrInsert(const glm::vec3& pos, const glm::vec3& normal) {
+		uint64_t key = cellKey(pos, normal);
+		uint32_t slot = (uint32_t)mixBits(key) & (TABLE_SIZE - 1);
+
+		for (uint32_t probe = 0; probe < MAX_PROBES; ++probe) {
+			uint32_t i = (slot + probe) & (TABLE_SIZE - 1);
+			uint64_t current = entries_[i].key.load(std::memory_order_relaxed);
+			if (current == key) {
+				return i;
+			}
+			if (current == 0) {
+				// Another thread can claim the slot first, for this cell or another one
+				if (entries_[i].key.compare_exchange_strong(current, key, std::memory_order_relaxed) ||
+					current == key) {
+					return i;
+				}
+			}
+		}
+		return INVALID_ENTRY;
+	}
+
+	void RadianceCache::record(uint32_t entry, const glm::vec3& radiance) {
+		Entry& e = entries_[entry];
+		atomicAdd(e.radiance[0], radiance.r);
+		atomicAdd(e.radiance[1], radiance.g);
+		atomicAdd(e.radiance[2], radiance.b);
+		e.count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	bool RadianceCache::lookup(const glm::vec3& pos, const glm::vec3& normal, glm::vec3& radiance) const {
+		uint64_t key = cellKey(pos, normal);
+		uint32_t slot = (uint32_t)mixBits(key) & (TABLE_SIZE - 1);
+
+		for (uint32_t probe = 0; probe < MAX_PROBES; ++probe) {
+			const Entry& e = entries_[(slot + probe) & (TABLE_SIZE - 1)];
+			uint64_t current = e.key.load(std::memory_order_relaxed);
+			if (current == key) {
+				uint32_t count = e.count.load(std::memory_order_relaxed);
+				if (count < MIN_SAMPLES) {
+					return false;
+				}
+				radiance = glm::vec3(e.radiance[0].load(std::memory_order_relaxed),
+									 e.radiance[1].load(std::memory_order_relaxed),
+									 e.radiance[2].load(std::memory_order_relaxed)) / (float)count;
+				return true;
+			}
+			if (current == 0) {
+				return false;
+			}
+		}
+		return false;
+	}
+
+	void RadianceCache::setCellSize(float cellSize) {
+		if (cellSize != cellSize_) {
+			cellSize_ = cellSize;
+			clear();
+		}
+	}
+
+	void RadianceCache::clearEntry(Entry& entry) {
+		entry.key.store(0, std::memory_order_relaxed);
+		for (std::atomic<float>& channel : entry.radiance) {
+			channel.store(0.0f, std::memory_order_relaxed);
+		}
+		entry.count.store(0, std::memory_order_relaxed);
+	}
+
+	void RadianceCache::clear() {
+		for (uint32_t i = 0; i < TABLE_SIZE; ++i) {
+			clearEntry(entries_[i]);
+		}
+		usedEntries_ = 0;
+	}
+
+	void RadianceCache::invalidate(const Aabb& bounds) {
+		// Emptying a slot in the middle of a probe sequence would hide the entries after it, so
+		// invalidated cells keep their key and only lose their samples
+		for (uint32_t i = 0; i < TABLE_SIZE; ++i) {
+			Entry& e = entries_[i];
+			uint64_t key = e.key.load(std::memory_order_relaxed);
+			if (key == 0) {
+				continue;
+			}
+			glm::vec3 center = cellCenter(key);
+			if (glm::all(glm::greaterThanEqual(center, bounds.min)) && glm::all(glm::lessThanEqual(center, bounds.max))) {
+				for (std::atomic<float>& channel : e.radiance) {
+					channel.store(0.0f, std::memory_order_relaxed);
+				}
+				e.count.store(0, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void RadianceCache::invalidateChanges(const SceneSnapshot& previous, const SceneSnapshot& current) {
+		// A new material or emitter changes how much light reaches everything
+		bool materialsChanged = previous.materials.size() != current.materials.size();
+		for (size_t i = 0; i < current.materials.size() && !materialsChanged; ++i) {
+			materialsChanged = !sameMaterial(previous.materials[i], current.materials[i]);
+		}
+		if (materialsChanged) {
+			clear();
+			return;
+		}
+
+		// Unedited spheres still share their chunks with the previous snapshot
+		size_t count = std::max(previous.spheres.size(), current.spheres.size());
+		for (size_t i = 0; i < count; ++i) {
+			size_t chunk = i >> CowVector<Sphere>::CHUNK_SHIFT;
+			if (chunk < previous.spheres.chunkCount() && chunk < current.spheres.chunkCount() &&
+				&previous.spheres.chunk(chunk) == &current.spheres.chunk(chunk)) {
+				i = ((chunk + 1) << CowVector<Sphere>::CHUNK_SHIFT) - 1;
+				continue;
+			}
+
+			const Sphere* before = i < previous.spheres.size() ? &previous.spheres[i] : nullptr;
+			const Sphere* after = i < current.spheres.size() ? &current.spheres[i] : nullptr;
+			if (before && after && sameSphere(*before, *after)) {
+				continue;
+			}
+
+			// Where a sphere was and where it is now, and as far again around it, which covers the
+			// shadows and bounce light it changes without throwing away the whole cache
+			for (const Sphere* sphere : { before, after }) {
+				if (!sphere) {
+					continue;
+				}
+				if (current.materials[sphere->matIdx].isEmissive()) {
+					clear();
+					return;
+				}
+				Aabb bounds = Aabb::ofSphere(*sphere);
+				glm::vec3 margin(sphere->radius + 2.0f * cellSize_);
+				bounds.min -= margin;
+				bounds.max += margin;
+				invalidate(bounds);
+			}
+		}
+	}
+
+	void RadianceCache::age() {
+		uint32_t used = 0;
+		for (uint32_t i = 0; i < TABLE_SIZE; ++i) {
+			Entry& e = entries_[i];
+			if (e.key.load(std::memory_order_relaxed) == 0) {
+				continue;
+			}
+			++used;
+
+			uint32_t count = e.count.load(std::memory_order_relaxed);
+			if (count > MAX_SAMPLES) {
+				uint32_t kept = count / 2;
+				float scale = (float)kept / count;
+				for (std::atomic<float>& channel : e.radiance) {
+					channel.store(channel.load(std::memory_order_relaxed) * scale, std::memory_order_relaxed);
+				}
+				e.count.store(kept, std::memory_order_relaxed);
+			}
+		}
+		usedEntries_ = used;
+	}
+
+}
\ No newline at end of file
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Bvh.h"
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <memory>
+
+struct SceneSnapshot;
+
+namespace mtn {
+
+	// World space hash grid of the radiance reflected by diffuse surfaces. Cells are keyed on the
+	// quantized position and the dominant axis of the normal, and paths add what they find after
+	// each diffuse vertex with atomic adds. Other paths can then end at a cell that has enough
+	// samples and take its average instead of tracing the rest of the path, which brings in
+	// many bounces of light for the cost of one or two.
+	class RadianceCache {
+	public:
+		static const uint32_t INVALID_ENTRY = 0xFFFFFFFF;
+
+		RadianceCache();
+
+		// Thread safe. Returns the entry of the cell holding pos, adding it if needed, or
+		// INVALID_ENTRY if its probe sequence is full.
+		uint32_t findOrInsert(const glm::vec3& pos, const glm::vec3& normal);
+		void record(uint32_t entry, const glm::vec3& radiance);
+		// False if the cell doesn't have enough samples to be trusted yet
+		bool lookup(const glm::vec3& pos, const glm::vec3& normal, glm::vec3& radiance) const;
+
+		// Called by the render thread between frames. Changing the cell size clears the cache.
+		void setCellSize(float cellSize);
+		void clear();
+		// Clears the cells of a snapshot's edited spheres and their surroundings, or everything if a
+		// change can affect the lighting of the whole scene
+		void invalidateChanges(const SceneSnapshot& previous, const SceneSnapshot& current);
+		// Halves the weight of old samples in well sampled cells, so the average keeps following
+		// the cells around them as they converge
+		void age();
+
+		inline uint32_t usedEntries() const { return usedEntries_; }
+
+	private:
+		struct Entry {
+			std::atomic<uint64_t> key{ 0 };		// 0 while empty
+			std::atomic<float> radiance[3];
+			std::atomic<uint32_t> count{ 0 };
+		};
+
+		uint64_t cellKey(const glm::vec3& pos, const glm::vec3& normal) const;
+		glm::vec3 cellCenter(uint64_t key) const;
+		void invalidate(const Aabb& bounds);
+		void clearEntry(Entry& entry);
+
+		static const uint32_t TABLE_SIZE = 1 << 19;
+		static const uint32_t MAX_PROBES = 8;
+		static const uint32_t MIN_SAMPLES = 16;		// Before a cell is used to end paths
+		static const uint32_t MAX_SAMPLES = 1024;	// Before age() starts forgetting old samples
+
+		std::unique_ptr<Entry[]> entries_;
+		float cellSize_ = 0.05f;
+		uint32_t usedEntries_ = 0;
+	};
+
+}
\ No newline at end of file
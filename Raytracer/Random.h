@@ -41,12 +41,6 @@ namespace mtn {
 							 std::uniform_real_distribution<float>(a, b)(rng_));
 		}
 
-		static glm::vec3 inUnitSphere(uint32_t& seed) {
-			return glm::normalize(glm::vec3(rFloat(seed) * 2.0f - 1.0f,
-											rFloat(seed) * 2.0f - 1.0f,
-											rFloat(seed) * 2.0f - 1.0f));
-		}
-
 		static glm::vec3 inUnitSphereSlow() {
 			return glm::normalize(vec3(-1.0f, 1.0f));
 		}
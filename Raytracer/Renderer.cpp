@@ -3,13 +3,17 @@
 #include "Logger.h"
 #include "Shader.h"
 #include "Random.h"
+#include "Numa.h"
 
 #include "glm/gtc/type_ptr.hpp"
 #include <imgui/backends/imgui_impl_glfw.h>
 #include <imgui/backends/imgui_impl_opengl3.h>
 
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include <execution>
+#include <numeric>
 
 namespace mtn {
 
@@ -26,9 +30,45 @@ namespace mtn {
 			return glm::pow(color, glm::vec3(1.0f / 2.2f));
 		}
 
-		bool nearZero(const glm::vec3& dir) {
-			float nz = (float)1e-8;
-			return fabs(dir.x) < nz && fabs(dir.y) < nz && fabs(dir.z) < nz;
+		inline void atomicAdd(std::atomic<float>& target, float value) {
+			float old = target.load(std::memory_order_relaxed);
+			while (!target.compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {}
+		}
+
+		inline float luminance(const glm::vec3& color) {
+			return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+		}
+
+		// Blue -> cyan -> green -> yellow -> red
+		glm::vec4 heatmap(float t) {
+			t = glm::clamp(t, 0.0f, 1.0f) * 4.0f;
+			glm::vec3 color;
+			if (t < 1.0f) color = glm::vec3(0.0f, t, 1.0f);
+			else if (t < 2.0f) color = glm::vec3(0.0f, 1.0f, 2.0f - t);
+			else if (t < 3.0f) color = glm::vec3(t - 2.0f, 1.0f, 0.0f);
+			else color = glm::vec3(1.0f, 4.0f - t, 0.0f);
+			return glm::vec4(color, 1.0f);
+		}
+
+		// Moves a point off the surface to the side dir leaves from, so the ray doesn't hit the
+		// surface it starts on
+		inline glm::vec3 offsetOrigin(const glm::vec3& pos, const glm::vec3& normal, const glm::vec3& dir) {
+			return pos + normal * (glm::dot(dir, normal) > 0.0f ? 1e-3f : -1e-3f);
+		}
+
+		// 1 - cos of the half angle of the cone a sphere subtends, computed without cancellation
+		// since it's tiny for distant emitters like the sun
+		inline float sphereConeSize(float distanceSq, float radiusSq) {
+			float sinThetaMaxSq = radiusSq / distanceSq;
+			return sinThetaMaxSq / (1.0f + std::sqrt(1.0f - sinThetaMaxSq));
+		}
+
+		// Weight for a sample taken with pdf when the other strategy would have found it with otherPdf
+		inline float misWeight(LightSampling lightSampling, float pdf, float otherPdf) {
+			if (lightSampling == LightSampling::MIS_BALANCE) {
+				return pdf / (pdf + otherPdf);
+			}
+			return (pdf * pdf) / (pdf * pdf + otherPdf * otherPdf);
 		}
 
 	}
@@ -42,6 +82,12 @@ namespace mtn {
 
 		initGlad();
 		initImGui();
+
+		renderThread_ = std::thread(&Renderer::renderLoop, this);
+	}
+
+	Renderer::~Renderer() {
+		shutdown();
 	}
 
 	void Renderer::startFrame(float dt) {
@@ -63,9 +109,14 @@ namespace mtn {
 		ImGui::DockSpaceOverViewport(nullptr, ImGuiDockNodeFlags_PassthruCentralNode);
 
 		pCamera_ = camera;
-		pScene_ = scene;
+		if (pScene_ != scene) {
+			pScene_ = scene;
+			sceneDirty_ = true;
+			resetFrameIndex();
+		}
 
 		onRender();
+		publishFrameState();
 
 		//ImGui::ShowDemoWindow();
 
@@ -88,6 +139,21 @@ namespace mtn {
 		glfwSwapBuffers(pWindow_->handle());
 	}
 
+	void Renderer::shutdown() {
+		{
+			std::lock_guard<std::mutex> lock(stateMutex_);
+			running_ = false;
+		}
+		cancelToken_.cancel();
+		stateCv_.notify_one();
+
+		if (renderThread_.joinable()) {
+			renderThread_.join();
+		}
+
+		bvhBuilder_.shutdown();
+	}
+
 	void Renderer::setWindow(Window* const window) {
 		pWindow_ = window;
 	}
@@ -135,27 +201,245 @@ namespace mtn {
 		ImGui::Begin("Settings");
 
 		ImGui::Text("Last Frame Time: %fms (%d fps)", deltaTime_ * 1000, (int)(1 / deltaTime_));
+		ImGui::Text("Last Render Time: %.2fms (%u spp)", renderTimeMs_.load(), samplesPerFrame_.load());
+		ImGui::Text("Change Latency: %.2fms first pixel, %.2fms first frame",
+					firstPixelLatencyMs_.load(), firstFrameLatencyMs_.load());
+		ImGui::Text("BVH: %s (%zu nodes, built in %.1fms)", bvhBuilder_.building ? "building" : "ready",
+					bvhBuilder_.lastNodeCount.load(), bvhBuilder_.lastBuildMs.load());
+		ImGui::Text("Light BVH: %zu emitters (built in %.1fms)", bvhBuilder_.lastLightCount.load(),
+					bvhBuilder_.lastLightBuildMs.load());
 
 		//shouldRender_ = false;
 
 		if (ImGui::Button("Render")) {
 			Logger::debug("Beginning rendering");
 			shouldRender_ = true;
-		}
-		if (shouldRender_) {
-			renderImage();
+			// Time to first pixel is measured from here
+			resetFrameIndex();
 		}
 
 		ImGui::Checkbox("Accumulate", &settings_.accumulate);
 		ImGui::Checkbox("Gamma Correct", &settings_.gammaCorrect);
 		ImGui::Checkbox("Multithread", &settings_.multithread);
 		ImGui::Checkbox("Skylight", &settings_.skylight);
+		ImGui::Checkbox("Ray Direction Table", &settings_.rayDirectionTable);
+		ImGui::SliderFloat("Frame Budget (ms)", &settings_.frameBudgetMs, 1.0f, 100.0f);
+		if (ImGui::Combo("Integrator", (int*)&settings_.integrator, "Path\0Bidirectional\0Metropolis\0")) {
+			resetFrameIndex();
+		}
+		if (ImGui::Combo("Light Sampling", (int*)&settings_.lightSampling,
+						 "BSDF\0Emitters\0MIS (Balance)\0MIS (Power)\0")) {
+			resetFrameIndex();
+		}
+		if (ImGui::Combo("Light Selection", (int*)&settings_.lightSelection, "Uniform\0Light BVH\0")) {
+			resetFrameIndex();
+		}
+		if (ImGui::Combo("Sampler", (int*)&settings_.sampleSequence, "PCG\0Sobol (Owen)\0Halton\0Blue Noise\0")) {
+			resetFrameIndex();
+		}
+		if (ImGui::Combo("Pixel Filter", (int*)&settings_.pixelFilter,
+						 "None\0Box\0Tent\0Gaussian\0Blackman-Harris\0")) {
+			resetFrameIndex();
+		}
+		if (settings_.pixelFilter != FilterType::NONE &&
+			ImGui::SliderFloat("Filter Radius", &settings_.filterRadius, 0.5f, 3.0f, "%.2f px")) {
+			resetFrameIndex();
+		}
 
 		if (ImGui::Button("Reset")) {
 			Logger::debug("Resetting accumulated image data");
 			resetFrameIndex();
 		}
 
+		if (ImGui::CollapsingHeader("Environment")) {
+			ImGui::InputText("Path (.hdr/.pfm)", environmentPath_, sizeof(environmentPath_));
+			if (ImGui::Button("Load")) {
+				std::shared_ptr<const EnvironmentMap> environment = EnvironmentMap::load(environmentPath_);
+				if (environment) {
+					pEnvironment_ = environment;
+					char status[64];
+					std::snprintf(status, sizeof(status), "Loaded %ux%u", environment->width(), environment->height());
+					environmentStatus_ = status;
+					resetFrameIndex();
+				}
+				else {
+					environmentStatus_ = "Failed to load, see the log";
+				}
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Clear") && pEnvironment_) {
+				pEnvironment_ = nullptr;
+				environmentStatus_ = "Constant sky";
+				resetFrameIndex();
+			}
+			if (ImGui::DragFloat("Intensity", &settings_.environmentIntensity, 0.01f, 0.0f, 100.0f)) {
+				resetFrameIndex();
+			}
+			ImGui::TextUnformatted(environmentStatus_.c_str());
+		}
+
+		if (ImGui::CollapsingHeader("Adaptive Sampling")) {
+			bool changed = false;
+			changed |= ImGui::Checkbox("Enabled", &settings_.adaptiveSampling);
+			changed |= ImGui::SliderFloat("Error Target", &settings_.adaptiveErrorTarget, 0.001f, 0.2f, "%.3f",
+										  ImGuiSliderFlags_Logarithmic);
+			changed |= ImGui::SliderInt("Min Samples", &settings_.adaptiveMinSamples, 2, 256);
+			if (changed) {
+				resetFrameIndex();
+			}
+			ImGui::Combo("Display", (int*)&settings_.displayMode, "Image\0Samples Per Pixel\0");
+			ImGui::Text("Converged: %u / %zu tiles", convergedTiles_.load(), tiles_.size());
+		}
+
+		if (ImGui::CollapsingHeader("Temporal Reprojection")) {
+			// Only read when the camera moves, so none of these need a restart
+			ImGui::Checkbox("Enabled##Reprojection", &settings_.temporalReprojection);
+			ImGui::SliderFloat("History Weight", &settings_.reprojectionWeight, 0.0f, 1.0f);
+			ImGui::SliderInt("Max History Samples", &settings_.reprojectionMaxSamples, 1, 1024, "%d",
+							 ImGuiSliderFlags_Logarithmic);
+		}
+
+		if (ImGui::CollapsingHeader("Convergence")) {
+			// Stopping is decided against the latest settings, so none of these need a restart
+			ImGui::Checkbox("Auto Stop", &settings_.autoStop);
+			ImGui::SliderFloat("Image Error Target", &settings_.errorTarget, 0.001f, 0.1f, "%.3f",
+							   ImGuiSliderFlags_Logarithmic);
+			ImGui::SliderInt("Sample Cap", &settings_.maxSamples, 0, 65536, "%d", ImGuiSliderFlags_Logarithmic);
+			ImGui::SliderFloat("Time Cap (s)", &settings_.maxSeconds, 0.0f, 3600.0f, "%.0f",
+							   ImGuiSliderFlags_Logarithmic);
+
+			ImGui::Text("Error: %.2f%% (target %.2f%%)", displayedError_.load() * 100.0f, settings_.errorTarget * 100.0f);
+			ImGui::Text("Progress: %.1f spp in %.1fs", displayedSpp_.load(), displayedSeconds_.load());
+			switch (stopReason_.load()) {
+			case StopReason::ERROR_TARGET: ImGui::Text("Stopped: error target reached"); break;
+			case StopReason::SAMPLE_CAP: ImGui::Text("Stopped: sample cap reached"); break;
+			case StopReason::TIME_CAP: ImGui::Text("Stopped: time cap reached"); break;
+			case StopReason::ALL_TILES_CONVERGED: ImGui::Text("Stopped: every tile converged"); break;
+			default:
+				if (etaSeconds_.load() >= 0.0f) {
+					ImGui::Text("Time to target: %.1fs", etaSeconds_.load());
+				}
+				else {
+					ImGui::Text("Time to target: estimating");
+				}
+				break;
+			}
+		}
+
+		if (ImGui::CollapsingHeader("Path Length")) {
+			bool changed = false;
+			changed |= ImGui::SliderInt("Max Bounces", &settings_.maxBounces, 1, 64);
+			changed |= ImGui::SliderInt("Max Diffuse", &settings_.maxDiffuseBounces, 0, 64);
+			changed |= ImGui::SliderInt("Max Specular", &settings_.maxSpecularBounces, 0, 64);
+			changed |= ImGui::SliderInt("Max Transmission", &settings_.maxTransmissionBounces, 0, 64);
+			changed |= ImGui::Checkbox("Russian Roulette", &settings_.russianRoulette);
+			changed |= ImGui::SliderInt("Roulette Start", &settings_.rouletteMinBounces, 1, 16);
+			if (changed) {
+				resetFrameIndex();
+			}
+		}
+
+		if (ImGui::CollapsingHeader("Path Guiding")) {
+			if (ImGui::Checkbox("Enabled##Guiding", &settings_.pathGuiding)) {
+				resetFrameIndex();
+			}
+			ImGui::Text("Iteration %u, %u spatial leaves", guideIteration_.load(), guideLeaves_.load());
+			if (ImGui::Button("Compare") && pFinalImage_) {
+				requestBenchmark(Benchmark::GUIDING);
+			}
+			std::string result;
+			{
+				std::lock_guard<std::mutex> lock(stateMutex_);
+				result = guidingComparisonResult_;
+			}
+			ImGui::TextUnformatted(result.c_str());
+		}
+
+		if (ImGui::CollapsingHeader("Radiance Cache")) {
+			bool changed = false;
+			changed |= ImGui::Checkbox("Enabled##RadianceCache", &settings_.radianceCache);
+			changed |= ImGui::SliderInt("Bounces Before Lookup", &settings_.radianceCacheBounces, 1, 4);
+			changed |= ImGui::SliderFloat("Cell Size", &settings_.radianceCacheCellSize, 0.005f, 0.5f, "%.3f",
+										  ImGuiSliderFlags_Logarithmic);
+			if (changed) {
+				resetFrameIndex();
+			}
+			ImGui::Text("%u cells in use", cacheEntries_.load());
+		}
+
+		if (ImGui::CollapsingHeader("Photon Mapping")) {
+			bool changed = false;
+			changed |= ImGui::Checkbox("Enabled##PhotonMapping", &settings_.photonMapping);
+			changed |= ImGui::SliderInt("Photons per Pass", &settings_.photonsPerPass, 10000, 4000000, "%d",
+										ImGuiSliderFlags_Logarithmic);
+			changed |= ImGui::SliderFloat("Initial Radius", &settings_.photonRadius, 0.005f, 1.0f, "%.3f",
+										  ImGuiSliderFlags_Logarithmic);
+			if (changed) {
+				resetFrameIndex();
+			}
+			ImGui::Text("%u photons stored, %.1f MB", photonCount_.load(), photonMapMb_.load());
+			ImGui::Text("Radius %.4f", displayedPhotonRadius_.load());
+		}
+
+		if (ImGui::CollapsingHeader("ReSTIR")) {
+			bool changed = false;
+			changed |= ImGui::Checkbox("Enabled##Restir", &settings_.restir);
+			changed |= ImGui::SliderInt("Candidates", &settings_.restirCandidates, 1, 32);
+			changed |= ImGui::Checkbox("Temporal Reuse", &settings_.restirTemporal);
+			changed |= ImGui::SliderInt("Spatial Neighbors", &settings_.restirSpatialNeighbors, 0, 16);
+			changed |= ImGui::SliderFloat("Spatial Radius", &settings_.restirSpatialRadius, 1.0f, 64.0f, "%.0f px");
+			if (changed) {
+				resetFrameIndex();
+			}
+		}
+
+		if (ImGui::CollapsingHeader("Metropolis")) {
+			bool changed = false;
+			changed |= ImGui::SliderInt("Bootstrap Paths", &settings_.metropolisBootstrap, 1000, 1000000, "%d",
+										ImGuiSliderFlags_Logarithmic);
+			changed |= ImGui::SliderFloat("Sigma", &settings_.metropolisSigma, 0.001f, 0.1f, "%.3f",
+										  ImGuiSliderFlags_Logarithmic);
+			changed |= ImGui::SliderFloat("Large Step Probability", &settings_.metropolisLargeStep, 0.0f, 1.0f);
+			if (changed) {
+				resetFrameIndex();
+			}
+			uint64_t proposed = metropolisProposed_.load();
+			ImGui::Text("%.1f%% of mutations accepted",
+						proposed > 0 ? 100.0 * metropolisAccepted_.load() / proposed : 0.0);
+		}
+
+		if (ImGui::CollapsingHeader("NUMA")) {
+			ImGui::Text("%u node(s), %u workers", workerPool_.nodeCount(), workerPool_.workerCount());
+			// The framebuffers are placed when they're first touched, so they have to be reallocated
+			if (ImGui::Checkbox("NUMA Aware", &settings_.numaAware) && pFinalImage_) {
+				pauseRendering();
+				allocateImageBuffers(settings_.numaAware);
+				resumeRendering();
+				resetFrameIndex();
+			}
+			if (ImGui::Button("Benchmark") && pFinalImage_) {
+				requestBenchmark(Benchmark::NUMA);
+			}
+			std::string result;
+			{
+				std::lock_guard<std::mutex> lock(stateMutex_);
+				result = numaBenchmarkResult_;
+			}
+			ImGui::TextUnformatted(result.c_str());
+		}
+
+		if (ImGui::CollapsingHeader("Frame Graph")) {
+			std::string report;
+			{
+				std::lock_guard<std::mutex> lock(presentMutex_);
+				report = frameGraphReport_;
+			}
+			ImGui::TextUnformatted(report.c_str());
+			if (ImGui::Button("Log Report")) {
+				Logger::info("Frame graph report:\n{}", report);
+			}
+		}
+
 		ImGui::End(); // Scene
 
 		ImGui::Begin("Scene");
@@ -178,9 +462,13 @@ namespace mtn {
 			ImGui::EndCombo();
 		}
 
-		Sphere& sphere = pScene_->spheres[currSphereIdx];
-		ImGui::DragFloat3("Position", glm::value_ptr(sphere.pos), 0.1f);
-		ImGui::DragFloat("Radius", &sphere.radius, 0.1f);
+		// Edits go to the staging scene, and a new snapshot is published for the render thread at
+		// the end of the frame
+		bool sceneChanged = false;
+
+		Sphere sphere = pScene_->spheres[currSphereIdx];
+		sceneChanged |= ImGui::DragFloat3("Position", glm::value_ptr(sphere.pos), 0.1f);
+		sceneChanged |= ImGui::DragFloat("Radius", &sphere.radius, 0.1f);
 
 		const auto& matList = pScene_->getMatStrList();
 		if (ImGui::BeginCombo("Material Idx", matList[sphere.matIdx].c_str())) {
@@ -188,6 +476,7 @@ namespace mtn {
 				const bool isSelected = (sphere.matIdx == n);
 				if (ImGui::Selectable(matList[n].c_str(), isSelected)) {
 					sphere.matIdx = n;
+					sceneChanged = true;
 				}
 				// Set the initial focus when opening the combo (scrolling + keyboard navigation focus)
 				if (isSelected) {
@@ -200,15 +489,24 @@ namespace mtn {
 		ImGui::Separator();
 		ImGui::Text("Material Settings");
 
-		Material& material = pScene_->materials[sphere.matIdx];
+		Material material = pScene_->materials[sphere.matIdx];
 		int materialType = (int)material.matType;
-		ImGui::SliderInt("Material Type", &materialType, 0, 3);
-		material.matType = MaterialType(materialType);
-		ImGui::ColorEdit3("Albedo", glm::value_ptr(material.albedo));
-		ImGui::ColorEdit3("Emission Color", glm::value_ptr(material.emissionColor));
-		ImGui::DragFloat("Emission Strength", &material.emissionStrength, 0.01f, 0.0f, FLT_MAX);
-		ImGui::DragFloat("Metallicness", &material.metallicness, 0.001f, 0.0f, 1.0f);
-		ImGui::DragFloat("Refractive Index", &material.refractiveIndex, 0.001f, 1.0f, 3.0f);
+		if (ImGui::SliderInt("Material Type", &materialType, 0, 3)) {
+			material.matType = MaterialType(materialType);
+			sceneChanged = true;
+		}
+		sceneChanged |= ImGui::ColorEdit3("Albedo", glm::value_ptr(material.albedo));
+		sceneChanged |= ImGui::ColorEdit3("Emission Color", glm::value_ptr(material.emissionColor));
+		sceneChanged |= ImGui::DragFloat("Emission Strength", &material.emissionStrength, 0.01f, 0.0f, FLT_MAX);
+		sceneChanged |= ImGui::DragFloat("Metallicness", &material.metallicness, 0.001f, 0.0f, 1.0f);
+		sceneChanged |= ImGui::DragFloat("Refractive Index", &material.refractiveIndex, 0.001f, 1.0f, 3.0f);
+
+		if (sceneChanged) {
+			pScene_->editSphere(currSphereIdx) = sphere;
+			pScene_->editMaterial(sphere.matIdx) = material;
+			sceneDirty_ = true;
+			resetFrameIndex();
+		}
 
 		ImGui::End(); // Scene
 
@@ -218,6 +516,11 @@ namespace mtn {
 		viewportWidth_ = (uint32_t)ImGui::GetContentRegionAvail().x;
 		viewportHeight_ = (uint32_t)ImGui::GetContentRegionAvail().y;
 
+		if (shouldRender_) {
+			onResize(viewportWidth_, viewportHeight_);
+		}
+		presentImage();
+
 		if (pFinalImage_) {
 			ImGui::Image((void*)(GLuint*)pFinalImage_->getId(),
 						 ImVec2((float)pFinalImage_->getWidth(), (float)pFinalImage_->getHeight()),
@@ -228,268 +531,2232 @@ namespace mtn {
 		ImGui::PopStyleVar();
 	}
 
-	void Renderer::renderImage() {
-		Logger::trace("Renderer::render()");
+	void Renderer::renderLoop() {
+		while (true) {
+			FrameState frame;
+			Benchmark benchmark = Benchmark::NONE;
+			{
+				std::unique_lock<std::mutex> lock(stateMutex_);
+				// Once the image has converged the thread sleeps here, and the workers in their own
+				// waits, until a restart or a settings change asks for more samples
+				stateCv_.wait(lock, [this]() {
+					bool finished = accumulatedGeneration_ == cancelToken_.generation() &&
+									checkStop(pendingFrame_.settings) != StopReason::NONE;
+					bool ready = pauseCount_ == 0 && pendingFrame_.camera && pendingFrame_.scene;
+					return !running_ || (ready && pendingBenchmark_ != Benchmark::NONE) ||
+						   (ready && renderRequested_ && !finished);
+				});
 
-		onResize(viewportWidth_, viewportHeight_);
+				if (!running_) {
+					return;
+				}
 
-		if (frameIndex_ == 1) {
-			// Sets all values in the accumulated image data to 0
-			memset(pAccumulatedImageData_.get(), 0,
-				   pFinalImage_->getWidth() * pFinalImage_->getHeight() * sizeof(glm::vec4));
+				frame = pendingFrame_;
+				frame.generation = cancelToken_.generation();
+				if (pauseCount_ == 0 && pendingBenchmark_ != Benchmark::NONE) {
+					std::swap(benchmark, pendingBenchmark_);
+					benchmarkRunning_ = true;
+				}
+			}
+
+			if (benchmark != Benchmark::NONE) {
+				runBenchmark(benchmark, frame);
+			}
+			else {
+				renderImage(frame);
+			}
 		}
+	}
 
-		// for_each is just a really easy way to parallelize work for each pixel
-		// std::execution::par_unseq = parallel, unsequential processing
-		if (settings_.multithread) {
-			std::for_each(std::execution::par_unseq, imageVerticalItr_.begin(), imageVerticalItr_.end(),
-				[this](uint32_t y) {
-				std::for_each(std::execution::par_unseq, imageHorizontalItr_.begin(), imageHorizontalItr_.end(),
-					[this, y](uint32_t x) {
-					glm::vec4 pixelColor = perPixel(x, y);
+	bool Renderer::renderImage(const FrameState& frame) {
+		Logger::trace("Renderer::renderImage()");
 
-					pAccumulatedImageData_[x + (y * pFinalImage_->getWidth())] += pixelColor;
-					glm::vec4 accumulatedColor = pAccumulatedImageData_[x + y * pFinalImage_->getWidth()];
-					accumulatedColor /= (float)frameIndex_;
+		std::lock_guard<std::mutex> lock(frameMutex_);
 
-					accumulatedColor = glm::clamp(accumulatedColor, glm::vec4(0.0f), glm::vec4(1.0f));
+		// The main thread may have paused us between picking up the frame and starting it
+		if (cancelToken_.isCancelled(frame.generation)) {
+			return false;
+		}
 
-					pImageData_[x + (y * pFinalImage_->getWidth())] = utils::rgbaToColor32(accumulatedColor);
-				});
-			});
+		Clock::time_point startTime = Clock::now();
+
+		// A new generation means the camera or scene changed, so the accumulated samples are stale.
+		// If nothing but the camera moved since they were taken, they can be reprojected. Every other
+		// restart also changes the epoch, and skips the primary hit trace altogether.
+		const RendererSettings& settings = frame.settings;
+		bool canReproject = settings.temporalReprojection && settings.accumulate &&
+							settings.integrator == Integrator::PATH;
+		bool reproject = false;
+		if (frame.generation != accumulatedGeneration_ || !settings.accumulate) {
+			reproject = canReproject && frame.generation != accumulatedGeneration_ &&
+						frame.historyEpoch == accumulatedEpoch_ && accumulatedCamera_;
+			accumulatedGeneration_ = frame.generation;
+			accumulatedEpoch_ = frame.historyEpoch;
+			frameIndex_ = 1;
 		}
-		else {
-			for (uint32_t y = 0; y < pFinalImage_->getHeight(); ++y) {
-				for (uint32_t x = 0; x < pFinalImage_->getWidth(); ++x) {
-					glm::vec4 pixelColor = perPixel(x, y);
 
-					pAccumulatedImageData_[x + (y * pFinalImage_->getWidth())] += pixelColor;
-					glm::vec4 accumulatedColor = pAccumulatedImageData_[x + y * pFinalImage_->getWidth()];
-					accumulatedColor /= (float)frameIndex_;
+		replicateScene(frame);
 
-					accumulatedColor = glm::clamp(accumulatedColor, glm::vec4(0.0f), glm::vec4(1.0f));
+		if (frameIndex_ == 1) {
+			if (reproject) {
+				std::swap(pAccumulatedImageData_, pHistoryImageData_);
+				std::swap(pVarianceData_, pHistoryVarianceData_);
+				frameGraph_.setImportedData(accumulationBuffer_, pAccumulatedImageData_.get());
+				frameGraph_.setImportedData(varianceBuffer_, pVarianceData_.get());
+			}
+			clearAccumulation(frame);
+			if (reproject) {
+				reprojectAccumulation(frame);
+			}
+			else {
+				hitsCamera_.reset();
+			}
+			accumulatedCamera_ = canReproject ? frame.camera : nullptr;
+			generationSamples_ = 0;
+			generationRenderMs_ = 0.0f;
+		}
 
-					pImageData_[x + (y * pFinalImage_->getWidth())] = utils::rgbaToColor32(accumulatedColor);
-				}
+		// Converged tiles are skipped, so the ones left can take proportionally more samples
+		uint32_t converged = frame.settings.adaptiveSampling
+			? (uint32_t)std::count(tileConverged_.begin(), tileConverged_.end(), 1) : 0;
+		convergedTiles_ = converged;
+		activeTileFraction_ = std::max(1.0f - converged / (float)std::max<size_t>(tiles_.size(), 1), 0.01f);
+
+		// Fit as many samples per pixel as the recent per-sample cost says will fit in the budget
+		samplesPerPixel_ = 1;
+		if (samplePassMs_ > 0.0f) {
+			float fit = frame.settings.frameBudgetMs / (samplePassMs_ * activeTileFraction_);
+			samplesPerPixel_ = (uint32_t)std::clamp(fit, 1.0f, (float)MAX_SAMPLES_PER_FRAME);
+		}
+		deadline_ = startTime + std::chrono::microseconds((int64_t)(frame.settings.frameBudgetMs * 1000.0f));
+		frameSamples_ = 0;
+
+		prepareGuide(frame);
+		prepareRadianceCache(frame);
+		prepareEmitterTable(frame);
+		tracePhotons(frame);
+		prepareMetropolis(frame);
+		prepareRestir(frame);
+
+		pFrame_ = &frame;
+		frameGraph_.setImportedData(displayBuffer_, pImageData_.get());
+		frameGraph_.execute(frame.settings.multithread, [this, &frame]() {
+			return cancelToken_.isCancelled(frame.generation);
+		});
+
+		if (cancelToken_.isCancelled(frame.generation)) {
+			return false;
+		}
+
+		{
+			std::lock_guard<std::mutex> presentLock(presentMutex_);
+			std::swap(pImageData_, pPresentImageData_);
+			imageReady_ = true;
+			frameGraphReport_ = frameGraph_.report();
+		}
+
+		Clock::time_point endTime = Clock::now();
+		renderTimeMs_ = std::chrono::duration<float, std::milli>(endTime - startTime).count();
+
+		// Tiles may have stopped short of samplesPerPixel at the deadline, so the cost estimate is
+		// based on the samples that were actually taken
+		float samplesTaken = frameSamples_ / (float)(imageWidth_ * imageHeight_);
+		float passMs = renderTimeMs_ / std::max(samplesTaken, 1.0f);
+		samplePassMs_ = samplePassMs_ > 0.0f ? glm::mix(samplePassMs_, passMs, 0.25f) : passMs;
+		samplesPerFrame_ = (uint32_t)std::round(samplesTaken);
+		finishGuideFrame(frame, samplesTaken);
+		if (frame.generation != presentedGeneration_) {
+			presentedGeneration_ = frame.generation;
+			firstFrameLatencyMs_ = std::chrono::duration<float, std::milli>(endTime - frame.changeTime).count();
+		}
+
+		updateConvergence(frame);
+		++frameIndex_;
+
+		return true;
+	}
+
+	void Renderer::updateConvergence(const FrameState& frame) {
+		generationSamples_ += frameSamples_;
+		generationRenderMs_ += renderTimeMs_;
+
+		uint32_t pixelCount = imageWidth_ * imageHeight_;
+		float errorSum = 0.0f;
+		for (float tileError : tileError_) {
+			errorSum += tileError;
+		}
+		imageError_ = errorSum / std::max(pixelCount, 1u);
+
+		float spp = generationSamples_ / (float)std::max(pixelCount, 1u);
+		float seconds = generationRenderMs_ / 1000.0f;
+		StopReason reason = checkStop(frame.settings);
+
+		// Monte Carlo error falls off as 1/sqrt(n), so reaching the target takes (error / target)^2
+		// times the samples taken so far, at the rate they've been taken at
+		float eta = -1.0f;
+		if (reason == StopReason::NONE && spp >= 2.0f && seconds > 0.0f) {
+			float ratio = imageError_ / std::max(frame.settings.errorTarget, 1e-6f);
+			eta = seconds * std::max(ratio * ratio - 1.0f, 0.0f);
+			if (frame.settings.maxSamples > 0) {
+				eta = std::min(eta, seconds * std::max(frame.settings.maxSamples / spp - 1.0f, 0.0f));
+			}
+			if (frame.settings.maxSeconds > 0.0f) {
+				eta = std::min(eta, std::max(frame.settings.maxSeconds - seconds, 0.0f));
 			}
 		}
 
+		displayedError_ = imageError_;
+		displayedSpp_ = spp;
+		displayedSeconds_ = seconds;
+		etaSeconds_ = eta;
+		if (reason != StopReason::NONE && stopReason_ == StopReason::NONE) {
+			Logger::info("Rendering stopped after {:.1f} spp and {:.1f}s at {:.2f}% error", spp, seconds,
+						 imageError_ * 100.0f);
+		}
+		stopReason_ = reason;
+	}
 
-		pFinalImage_->setData(pImageData_);
+	StopReason Renderer::checkStop(const RendererSettings& settings) const {
+		// Without accumulation every frame starts over, so there's nothing to converge
+		if (!settings.accumulate || !settings.autoStop || generationSamples_ == 0) {
+			return StopReason::NONE;
+		}
 
-		// Update frame index depending on whether accumulation is enabled
-		if (settings_.accumulate) {
-			++frameIndex_;
+		if (imageError_ <= settings.errorTarget) {
+			return StopReason::ERROR_TARGET;
 		}
-		else {
-			resetFrameIndex();
+		float spp = generationSamples_ / (float)std::max(imageWidth_ * imageHeight_, 1u);
+		if (settings.maxSamples > 0 && spp >= settings.maxSamples) {
+			return StopReason::SAMPLE_CAP;
+		}
+		if (settings.maxSeconds > 0.0f && generationRenderMs_ >= settings.maxSeconds * 1000.0f) {
+			return StopReason::TIME_CAP;
+		}
+		// Every frame would return without tracing anything
+		if (settings.adaptiveSampling && !tileConverged_.empty() &&
+			std::all_of(tileConverged_.begin(), tileConverged_.end(), [](uint8_t c) { return c != 0; })) {
+			return StopReason::ALL_TILES_CONVERGED;
 		}
+		return StopReason::NONE;
 	}
 
-	void Renderer::onResize(uint32_t width, uint32_t height) {
-		bool resized = false;
-		if (pFinalImage_) {
-			if (width == pFinalImage_->getWidth() && height == pFinalImage_->getHeight()) {
+	void Renderer::buildFrameGraph() {
+		frameGraph_.clear();
+
+		size_t pixelCount = (size_t)imageWidth_ * imageHeight_;
+		radianceBuffer_ = frameGraph_.createBuffer("Radiance", pixelCount * sizeof(glm::vec4));
+		accumulationBuffer_ = frameGraph_.importBuffer("Accumulation", pixelCount * sizeof(glm::vec4),
+													   pAccumulatedImageData_.get());
+		// The display buffer is swapped with the present buffer every frame, so it's set per frame
+		displayBuffer_ = frameGraph_.importBuffer("Display", pixelCount * sizeof(uint32_t));
+		varianceBuffer_ = frameGraph_.importBuffer("Variance", pixelCount * sizeof(float), pVarianceData_.get());
+		splatBuffer_ = frameGraph_.importBuffer("Splats", pixelCount * 3 * sizeof(std::atomic<float>), pSplatData_.get());
+		// The reservoirs are swapped with their history every frame, so they're set per frame too
+		size_t reservoirCount = tiles_.size() * TILE_SIZE * TILE_SIZE;
+		restirCandidateBuffer_ = frameGraph_.createBuffer("Reservoir Candidates", reservoirCount * sizeof(RestirPixel));
+		restirBuffer_ = frameGraph_.importBuffer("Reservoirs", reservoirCount * sizeof(RestirPixel));
+		restirHistoryBuffer_ = frameGraph_.importBuffer("Reservoir History", reservoirCount * sizeof(RestirPixel));
+
+		// The passes read the frame being rendered from the render thread's members, which are only
+		// set while it holds frameMutex_.
+		frameGraph_.addPass("Reservoirs", { restirHistoryBuffer_ }, { restirCandidateBuffer_ },
+			[this](const FramePassContext& ctx) {
+			if (!restirCamera_) {
 				return;
 			}
-			resized = pFinalImage_->resize(width, height);
-		}
-		else {
-			pFinalImage_ = std::make_unique<Texture2D>(width, height);
-		}
+			const RestirPixel* history = restirHistoryCamera_ ? ctx.get<RestirPixel>(restirHistoryBuffer_) : nullptr;
+			RestirPixel* candidates = ctx.get<RestirPixel>(restirCandidateBuffer_);
+			forEachTile(*pFrame_, [&](const Tile& tile, uint32_t node) {
+				const SceneSnapshot& scene = sceneForNode(*pFrame_, node);
+				std::unique_ptr<SampleGenerator> sampler = createSampleGenerator(pFrame_->settings.sampleSequence);
+				for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+					for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+						generateReservoir(x, y, *pFrame_, scene, *sampler, history, candidates[restirIndex(x, y)]);
+					}
+				}
+			});
+		});
 
-		pImageData_ = std::shared_ptr<uint32_t[]>(new uint32_t[width * height]);
-		pAccumulatedImageData_ = std::unique_ptr<glm::vec4[]>(new glm::vec4[width * height]);
+		frameGraph_.addPass("Spatial Reuse", { restirCandidateBuffer_ }, { restirBuffer_ },
+			[this](const FramePassContext& ctx) {
+			if (!restirCamera_) {
+				return;
+			}
+			const RestirPixel* candidates = ctx.get<RestirPixel>(restirCandidateBuffer_);
+			RestirPixel* reservoirs = ctx.get<RestirPixel>(restirBuffer_);
+			forEachTile(*pFrame_, [&](const Tile& tile, uint32_t node) {
+				const SceneSnapshot& scene = sceneForNode(*pFrame_, node);
+				std::unique_ptr<SampleGenerator> sampler = createSampleGenerator(pFrame_->settings.sampleSequence);
+				for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+					for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+						reuseReservoirs(x, y, *pFrame_, scene, *sampler, candidates, reservoirs[restirIndex(x, y)]);
+					}
+				}
+			});
+		});
+
+		frameGraph_.addPass("Trace", { accumulationBuffer_, varianceBuffer_, restirBuffer_ },
+							{ radianceBuffer_, varianceBuffer_, splatBuffer_ },
+			[this](const FramePassContext& ctx) {
+			glm::vec4* radiance = ctx.get<glm::vec4>(radianceBuffer_);
+			const glm::vec4* accumulation = ctx.get<glm::vec4>(accumulationBuffer_);
+			float* variance = ctx.get<float>(varianceBuffer_);
+			const RestirPixel* reservoirs = restirCamera_ ? ctx.get<RestirPixel>(restirBuffer_) : nullptr;
+			forEachTile(*pFrame_, [&](const Tile& tile, uint32_t node) {
+				traceTile(tile, node, *pFrame_, radiance, accumulation, variance, reservoirs);
+			});
+		});
+
+		frameGraph_.addPass("Accumulate", { radianceBuffer_ }, { accumulationBuffer_ },
+			[this](const FramePassContext& ctx) {
+			const glm::vec4* radiance = ctx.get<glm::vec4>(radianceBuffer_);
+			glm::vec4* accumulation = ctx.get<glm::vec4>(accumulationBuffer_);
+			forEachTile(*pFrame_, [&](const Tile& tile, uint32_t) {
+				for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+					for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+						accumulation[x + y * imageWidth_] += radiance[x + y * imageWidth_];
+					}
+				}
+			});
+		});
+
+		frameGraph_.addPass("Resolve", { accumulationBuffer_, splatBuffer_ }, { displayBuffer_ },
+			[this](const FramePassContext& ctx) {
+			const glm::vec4* accumulation = ctx.get<glm::vec4>(accumulationBuffer_);
+			const std::atomic<float>* splats = ctx.get<std::atomic<float>>(splatBuffer_);
+			uint32_t* display = ctx.get<uint32_t>(displayBuffer_);
+			// Every light subpath or Metropolis sample could have reached any pixel, so each pixel's
+			// share of the splats is scaled by how many there were per pixel
+			float splatScale = (float)((double)imageWidth_ * imageHeight_ / std::max<uint64_t>(splatPaths_, 1));
+			forEachTile(*pFrame_, [&](const Tile& tile, uint32_t) {
+				for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+					for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+						if (pFrame_->settings.displayMode == DisplayMode::SAMPLE_HEATMAP) {
+							// Full red at 4096 samples
+							float samples = accumulation[x + y * imageWidth_].a;
+							display[x + y * imageWidth_] = utils::rgbaToColor32(utils::heatmap(std::log2(samples + 1.0f) / 12.0f));
+							continue;
+						}
+
+						glm::vec4 accumulatedColor = accumulation[x + y * imageWidth_];
+						accumulatedColor /= accumulatedColor.a;
+
+						// Every integrator accumulates linear radiance, so gamma is only applied here, after
+						// the bidirectional splats are added. Metropolis is all splats.
+						glm::vec3 color(accumulatedColor);
+						if (pFrame_->settings.integrator != Integrator::PATH) {
+							const std::atomic<float>* splat = splats + (x + y * imageWidth_) * 3;
+							glm::vec3 splatColor(splat[0].load(std::memory_order_relaxed),
+												 splat[1].load(std::memory_order_relaxed),
+												 splat[2].load(std::memory_order_relaxed));
+							color += splatColor * splatScale;
+						}
+						accumulatedColor = glm::vec4(utils::correctGamma(color), 1.0f);
+
+						accumulatedColor = glm::clamp(accumulatedColor, glm::vec4(0.0f), glm::vec4(1.0f));
+
+						display[x + y * imageWidth_] = utils::rgbaToColor32(accumulatedColor);
+					}
+				}
+			});
+		});
 
-		pCamera_->resize(width, height);
+		frameGraph_.compile();
+	}
 
-		imageHorizontalItr_.resize(width);
-		imageVerticalItr_.resize(height);
+	void Renderer::forEachTile(const FrameState& frame, const std::function<void(const Tile&, uint32_t)>& fn) {
+		// Tiles check the cancellation token before starting, so a stale frame is abandoned within
+		// roughly one tile's worth of work per thread.
+		auto runTile = [this, &frame, &fn](const Tile& tile, uint32_t node) {
+			if (!cancelToken_.isCancelled(frame.generation)) {
+				fn(tile, node);
+			}
+		};
 
-		// Initialize horizontal and vertical pixel iterators
-		for (uint32_t i = 0; i < width; ++i) {
-			imageHorizontalItr_[i] = i;
+		if (frame.settings.multithread && frame.settings.numaAware) {
+			// Each node gets the same band of tiles every pass, which is the band it first touched
+			workerPool_.run((uint32_t)tiles_.size(), [this, &runTile](uint32_t i, uint32_t node) {
+				runTile(tiles_[i], node);
+			});
 		}
-		for (uint32_t i = 0; i < height; ++i) {
-			imageVerticalItr_[i] = i;
+		else if (frame.settings.multithread) {
+			std::for_each(std::execution::par, tiles_.begin(), tiles_.end(), [&runTile](const Tile& tile) {
+				runTile(tile, 0);
+			});
+		}
+		else {
+			for (const Tile& tile : tiles_) {
+				runTile(tile, 0);
+			}
 		}
 	}
 
-	glm::vec4 Renderer::perPixel(uint32_t x, uint32_t y) {
-		// Initial ray starting at the camera's center, directed based on the pixel index
-		Ray ray;
-		ray.origin = pCamera_->getPosition();
-		ray.dir = pCamera_->getRayDirections()[x + y * pFinalImage_->getWidth()];
+	void Renderer::traceTile(const Tile& tile, uint32_t node, const FrameState& frame, glm::vec4* radiance,
+							 const glm::vec4* accumulation, float* variance, const RestirPixel* reservoirs) {
+		// This is also the first touch of the transient radiance buffer, which places it on the node
+		for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+			for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+				radiance[x + y * imageWidth_] = glm::vec4(0.0f);
+			}
+		}
 
-		glm::vec3 totalLight(0.0f);
-		glm::vec3 contribution(1.0f);
+		const RendererSettings& settings = frame.settings;
+		const SceneSnapshot& scene = sceneForNode(frame, node);
+
+		// The chains have no per-pixel error to converge on, so their tiles never stop early. Each
+		// pixel counts its share of the tile's mutations as samples.
+		if (settings.integrator == Integrator::METROPOLIS) {
+			if (tile.index < metropolisChains_.size()) {
+				uint32_t mutations = runMetropolisChain(tile, frame, scene);
+				float share = mutations / (float)((tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+				for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+					for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+						radiance[x + y * imageWidth_].a = share;
+					}
+				}
+			}
+			recordFirstPixel(frame);
+			return;
+		}
 
-		// Seed could probably be better, but it gets the job done
-		uint32_t seed = (x + y * pFinalImage_->getWidth()) * frameIndex_;
+		if (settings.adaptiveSampling && tileConverged_[tile.index]) {
+			return;
+		}
 
-		const int NUM_BOUNCES = 16;
-		for (int i = 0; i < NUM_BOUNCES; i++) {
-			seed += i;
+		std::unique_ptr<SampleGenerator> sampler = createSampleGenerator(settings.sampleSequence);
 
-			HitData hitData = traceRay(ray);
+		// The alpha channel counts the samples taken for each pixel, so tiles that run out of time
+		// can stop after any sample pass.
+		uint32_t sample = 0;
+		for (; sample < samplesPerPixel_; ++sample) {
+			// Every tile takes at least one sample so the whole image makes progress each frame
+			if (sample > 0 && (Clock::now() >= deadline_ || cancelToken_.isCancelled(frame.generation))) {
+				break;
+			}
 
-			// If we miss all objects in the scene, the sky color is added to the pixel color and
-			// we break out of the bounce loop
-			if (hitData.hitDistance < 0.0f) {
-				if (settings_.skylight) {
-					totalLight += skyLight * contribution;
+			for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+				for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+					uint32_t idx = x + y * imageWidth_;
+					uint32_t sampleIndex = (uint32_t)(accumulation[idx].a + radiance[idx].a) + 1;
+					// One reservoir per pixel per frame, so only the first sample can use it
+					const RestirPixel* reservoir = reservoirs && sample == 0 ? &reservoirs[restirIndex(x, y)] : nullptr;
+					glm::vec4 value = settings.integrator == Integrator::BIDIRECTIONAL
+						? perPixelBidirectional(x, y, sampleIndex, frame, scene, *sampler)
+						: perPixel(x, y, sampleIndex, frame, scene, *sampler, reservoir);
+
+					// Welford's update on linear luminance, with the means before and after this sample
+					// taken from the running sums
+					float oldMean = sampleIndex > 1
+						? utils::luminance(accumulation[idx] + radiance[idx]) / (sampleIndex - 1) : 0.0f;
+					radiance[idx] += value;
+					float newMean = utils::luminance(accumulation[idx] + radiance[idx]) / sampleIndex;
+					float l = utils::luminance(value);
+					variance[idx] += (l - oldMean) * (l - newMean);
 				}
-				break;
 			}
+		}
+		frameSamples_ += (uint64_t)sample * (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+		if (settings.integrator == Integrator::BIDIRECTIONAL) {
+			splatPaths_ += (uint64_t)sample * (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+		}
 
-			const Sphere& sphere = pScene_->spheres[hitData.objIdx];
-			const Material& material = pScene_->materials[sphere.matIdx];
+		// Relative standard error of each pixel's linear mean, against a floor (about 0.12 after gamma)
+		// so dark pixels don't need unbounded samples. The tile converges once its worst pixel does, and the convergence
+		// monitor averages the errors over the image.
+		bool converged = true;
+		float errorSum = 0.0f;
+		for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+			for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+				uint32_t idx = x + y * imageWidth_;
+				float n = accumulation[idx].a + radiance[idx].a;
+				if (n < 2.0f) {
+					errorSum += 1.0f;
+					converged = false;
+					continue;
+				}
 
-			// Small offset of pos along hit sphere's normal depending on the material to prevent
-			// Note: We can't hit the inside of spheres currently unless the material is dielectric, 
-			// so this solution is passable.
-			if (material.matType != MaterialType::DIELECTRIC) {
-				ray.origin = hitData.worldPos - ray.dir * 1e-3f;
+				float mean = utils::luminance(accumulation[idx] + radiance[idx]) / n;
+				float relativeError = std::sqrt(variance[idx] / (n * (n - 1.0f))) / std::max(mean, 0.01f);
+				errorSum += relativeError;
+				converged &= n >= settings.adaptiveMinSamples && relativeError <= settings.adaptiveErrorTarget;
 			}
+		}
+		tileError_[tile.index] = errorSum;
+		tileConverged_[tile.index] = settings.adaptiveSampling && converged;
 
-			if (material.matType == MaterialType::LAMBERTIAN) {
-				// Absorbs all the light of the material's albedo.
-				contribution *= material.albedo;
-
-				// Randomly scatter from the hit normal
-				glm::vec3 scattered = hitData.worldNormal + Random::inUnitSphere(seed);
+		recordFirstPixel(frame);
+	}
 
-				if (utils::nearZero(scattered)) {
-					ray.dir = hitData.worldNormal;
+	void Renderer::clearAccumulation(const FrameState& frame) {
+		glm::vec4* accumulation = pAccumulatedImageData_.get();
+		float* variance = pVarianceData_.get();
+		std::atomic<float>* splats = pSplatData_.get();
+		forEachTile(frame, [this, accumulation, variance, splats](const Tile& tile, uint32_t) {
+			for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+				std::fill(accumulation + tile.x0 + y * imageWidth_, accumulation + tile.x1 + y * imageWidth_,
+						  glm::vec4(0.0f));
+				std::fill(variance + tile.x0 + y * imageWidth_, variance + tile.x1 + y * imageWidth_, 0.0f);
+				for (uint32_t i = (tile.x0 + y * imageWidth_) * 3; i < (tile.x1 + y * imageWidth_) * 3; ++i) {
+					splats[i].store(0.0f, std::memory_order_relaxed);
 				}
-
-				ray.dir = glm::normalize(scattered);
 			}
-			else if (material.matType == MaterialType::METALLIC) {
-				glm::vec3 reflected = glm::reflect(ray.dir, hitData.worldNormal);
-				// Randomize the direction of the reflected ray based on the material's metallicness
-				ray.dir = glm::normalize(reflected + material.metallicness * Random::inUnitSphere(seed));
+		});
+		std::fill(tileConverged_.begin(), tileConverged_.end(), 0);
+		splatPaths_ = 0;
+		photonPass_ = 0;
+		metropolisChains_.clear();
+		for (const Tile& tile : tiles_) {
+			tileError_[tile.index] = (float)((tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+		}
+	}
+
+	void Renderer::reprojectAccumulation(const FrameState& frame) {
+		std::swap(pPrimaryHits_, pHistoryHits_);
+		const Camera& camera = *frame.camera;
+		const Camera& history = *accumulatedCamera_;
+
+		// The first camera move after any other restart has no hits for the old view yet. The scene
+		// hasn't changed since, so they can be traced now.
+		if (hitsCamera_ != accumulatedCamera_) {
+			forEachTile(frame, [&](const Tile& tile, uint32_t node) {
+				const SceneSnapshot& scene = sceneForNode(frame, node);
+				for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+					for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+						Ray ray;
+						ray.origin = history.getPosition();
+						ray.dir = history.computeRayDirection(x + 0.5f, y + 0.5f);
+						HitData hitData = traceRay(ray, scene);
+
+						PrimaryHit& hit = pHistoryHits_[x + (size_t)y * imageWidth_];
+						hit = PrimaryHit();
+						if (hitData.hitDistance >= 0.0f) {
+							hit.pos = hitData.worldPos;
+							hit.depth = hitData.hitDistance;
+							hit.objIdx = hitData.objIdx;
+						}
+					}
+				}
+			});
+		}
 
-				// Absorb all light if the ray scatters below the surface
-				if (glm::dot(ray.dir, hitData.worldNormal) > 0.0f) {
-					contribution *= material.albedo;
+		float weight = glm::clamp(frame.settings.reprojectionWeight, 0.0f, 1.0f);
+		float maxSamples = (float)std::max(frame.settings.reprojectionMaxSamples, 0);
+
+		forEachTile(frame, [&](const Tile& tile, uint32_t node) {
+			const SceneSnapshot& scene = sceneForNode(frame, node);
+			for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+				for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+					size_t idx = x + (size_t)y * imageWidth_;
+					Ray ray;
+					ray.origin = camera.getPosition();
+					ray.dir = camera.computeRayDirection(x + 0.5f, y + 0.5f);
+					HitData hitData = traceRay(ray, scene);
+
+					PrimaryHit& hit = pPrimaryHits_[idx];
+					hit = PrimaryHit();
+					if (hitData.hitDistance >= 0.0f) {
+						hit.pos = hitData.worldPos;
+						hit.depth = hitData.hitDistance;
+						hit.objIdx = hitData.objIdx;
+					}
+
+					// The sky is infinitely far away, so only its direction moves with the camera
+					glm::vec2 raster;
+					if (!history.projectToRaster(hit.depth >= 0.0f ? hit.pos : history.getPosition() + ray.dir, raster)) {
+						continue;
+					}
+					size_t previous = (uint32_t)raster.x + (size_t)(uint32_t)raster.y * imageWidth_;
+					const PrimaryHit& old = pHistoryHits_[previous];
+
+					// A disoccluded pixel used to see another sphere or another side of this one.
+					// Reflections and refractions move with the view, so only diffuse surfaces carry over.
+					bool matches = hit.depth < 0.0f ? old.depth < 0.0f
+						: old.depth >= 0.0f && old.objIdx == hit.objIdx &&
+						  scene.materials[scene.spheres[hit.objIdx].matIdx].matType == MaterialType::LAMBERTIAN &&
+						  std::abs(glm::dot(old.pos - hit.pos, hitData.worldNormal)) < REPROJECTION_TOLERANCE * hit.depth;
+					float n = pHistoryImageData_[previous].a;
+					float kept = std::floor(std::min(n * weight, maxSamples));
+					if (!matches || kept < 1.0f) {
+						continue;
+					}
+
+					// Scaling the sums keeps the mean, and M2 grows with one less than the sample count
+					pAccumulatedImageData_[idx] = pHistoryImageData_[previous] * (kept / n);
+					pVarianceData_[idx] = n > 1.0f ? pHistoryVarianceData_[previous] * ((kept - 1.0f) / (n - 1.0f)) : 0.0f;
 				}
 			}
+		});
+		hitsCamera_ = frame.camera;
+	}
 
-			else if (material.matType == MaterialType::DIELECTRIC) {
-				// Dielectric materials absorb no light
-				//contribution *= glm::vec3{ 1.0f };
+	void Renderer::recordFirstPixel(const FrameState& frame) {
+		uint32_t recorded = firstPixelGeneration_.load(std::memory_order_relaxed);
+		if (recorded == frame.generation) {
+			return;
+		}
 
-				// Refractive index is inversed when hitting the outside of a sphere
-				float refractionRatio = glm::dot(-ray.dir, hitData.worldNormal) < 0.0f
-					? material.refractiveIndex				// Hit the back face
-					: (1.0f / material.refractiveIndex);	// Hit the front face
+		// Only the first tile to finish in a generation gets to record the latency
+		if (firstPixelGeneration_.compare_exchange_strong(recorded, frame.generation)) {
+			firstPixelLatencyMs_ = std::chrono::duration<float, std::milli>(Clock::now() - frame.changeTime).count();
+		}
+	}
 
-				// Total Internal Reflection:
-				// If the ray is moving from a medium with a higher refractive index to one that's
-				// lower, then the ray cannot refract, since there would be no solution to Snell's Law.
-				float cosTheta = std::min(glm::dot(-ray.dir, hitData.worldNormal), 1.0f);
-				float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
-				bool canRefract = refractionRatio * sinTheta <= 1.0f;
+	void Renderer::publishFrameState() {
+		if (!pFinalImage_) {
+			return;
+		}
 
-				if (canRefract && schlickReflectance(cosTheta, refractionRatio) <= Random::rFloat(seed)) {
-					// Refract using Snell's Law
-					ray.dir = glm::normalize(glm::refract(ray.dir, hitData.worldNormal, refractionRatio));
-					ray.origin = hitData.worldPos + ray.dir * 1e-3f;
+		// The app may have resized the camera to the window rather than the viewport
+		if (pCamera_->resize(imageWidth_, imageHeight_)) {
+			resetFrameIndex();
+		}
+		// Both paths give the same directions, so switching doesn't need a restart
+		pCamera_->setRayTableEnabled(settings_.rayDirectionTable);
+
+		{
+			std::lock_guard<std::mutex> lock(stateMutex_);
+			pendingFrame_.settings = settings_;
+			renderRequested_ = shouldRender_;
+
+			// A running benchmark has the framebuffers, so restarts wait until it hands them back
+			if ((restartPending_ || !pendingFrame_.camera) && !benchmarkRunning_) {
+				// The new state and the cancellation are published together, so the render thread
+				// never starts the new generation with the old camera or scene
+				pendingFrame_.camera = std::make_shared<const Camera>(*pCamera_);
+				if (sceneDirty_ || !pendingFrame_.scene) {
+					// Rendering starts right away, tracing against whatever acceleration structure
+					// the builder can provide until the full build finishes
+					std::shared_ptr<SceneSnapshot> snapshot = pScene_->snapshot();
+					bvhBuilder_.attach(snapshot);
+					pendingFrame_.scene = snapshot;
+					sceneDirty_ = false;
 				}
-				else {
-					ray.dir = glm::normalize(glm::reflect(ray.dir, hitData.worldNormal));
+				pendingFrame_.environment = pEnvironment_;
+				if (settings_.pixelFilter == FilterType::NONE) {
+					pPixelFilter_.reset();
 				}
+				else if (!pPixelFilter_ || pPixelFilter_->getType() != settings_.pixelFilter ||
+						 pPixelFilter_->getRadius() != settings_.filterRadius) {
+					pPixelFilter_ = std::make_shared<const PixelFilter>(settings_.pixelFilter, settings_.filterRadius);
+				}
+				pendingFrame_.filter = pPixelFilter_;
+				pendingFrame_.historyEpoch = historyEpoch_;
+				pendingFrame_.changeTime = changeTime_;
+				cancelToken_.cancel();
+				restartPending_ = false;
 			}
-
-			totalLight += contribution * material.getEmission();
 		}
+		stateCv_.notify_one();
+	}
 
-		return glm::vec4(utils::correctGamma(totalLight), 1.0f);
+	void Renderer::requestBenchmark(Benchmark benchmark) {
+		{
+			std::lock_guard<std::mutex> lock(stateMutex_);
+			if (pendingBenchmark_ != Benchmark::NONE || benchmarkRunning_) {
+				return;
+			}
+			pendingBenchmark_ = benchmark;
+			(benchmark == Benchmark::NUMA ? numaBenchmarkResult_ : guidingComparisonResult_) = "Running...";
+		}
+		// Abandons the frame in flight so the benchmark starts right away
+		cancelToken_.cancel();
+		stateCv_.notify_one();
 	}
 
-	/*
-	* Ray intersection formula (for a circle at (0,0), for simplicity):
-	* Simply the equation for a point on a ray (a_xy + b_xy*t) plugged into the quadratic
-	* equation (x^2 + y^2 + z^2 - r^2 = 0)
-	*
-	* (b_x^2 + b_y^2)t^2 + (2(a_x*b_x + a_y*b_y))t + (a_x^2 + a_y^2 - r^2) = 0
-	* at^2 + 2bt + c = 0
-	*
-	* a = ray origin
-	* b = ray direction
-	* r = radius
-	* t = hit distance
-	*/
+	void Renderer::pauseRendering() {
+		{
+			std::lock_guard<std::mutex> lock(stateMutex_);
+			++pauseCount_;
+		}
+		cancelToken_.cancel();
+		frameMutex_.lock();
+	}
 
-	HitData Renderer::traceRay(const Ray& ray) {
-		int closestSphereIdx = -1;
+	void Renderer::resumeRendering() {
+		frameMutex_.unlock();
+		{
+			std::lock_guard<std::mutex> lock(stateMutex_);
+			--pauseCount_;
+		}
+		stateCv_.notify_one();
+	}
 
-		float closestHitDistance = std::numeric_limits<float>::max();
+	void Renderer::presentImage() {
+		std::lock_guard<std::mutex> lock(presentMutex_);
+		if (imageReady_) {
+			pFinalImage_->setData(pPresentImageData_);
+			imageReady_ = false;
+		}
+	}
 
-		for (size_t i = 0; i < pScene_->spheres.size(); ++i) {
-			const Sphere& sphere = pScene_->spheres[i];
-			// Shifting the origin effectively moves the sphere into position
-			glm::vec3 origin = ray.origin - sphere.pos;
+	void Renderer::onResize(uint32_t width, uint32_t height) {
+		if (width == 0 || height == 0) {
+			return;
+		}
+		if (pFinalImage_ && width == imageWidth_ && height == imageHeight_) {
+			return;
+		}
 
-			float a = glm::dot(ray.dir, ray.dir);
-			float halfB = glm::dot(origin, ray.dir);
-			float c = glm::dot(origin, origin) - (sphere.radius * sphere.radius);
+		pauseRendering();
 
-			// Use the discriminant to check if there is an intersection
-			float discriminant = (halfB * halfB) - (a * c);
+		if (pFinalImage_) {
+			pFinalImage_->resize(width, height);
+		}
+		else {
+			pFinalImage_ = std::make_unique<Texture2D>(width, height);
+		}
 
-			if (discriminant < 0) {
-				continue;
+		imageWidth_ = width;
+		imageHeight_ = height;
+
+		// Split the image into tiles, clipping the ones along the right and bottom edges
+		tiles_.clear();
+		for (uint32_t y = 0; y < height; y += TILE_SIZE) {
+			for (uint32_t x = 0; x < width; x += TILE_SIZE) {
+				Tile& tile = tiles_.emplace_back();
+				tile.x0 = x;
+				tile.y0 = y;
+				tile.x1 = std::min(x + TILE_SIZE, width);
+				tile.y1 = std::min(y + TILE_SIZE, height);
+				tile.index = (uint32_t)(tiles_.size() - 1);
 			}
+		}
+		tileConverged_.assign(tiles_.size(), 0);
+		tileError_.assign(tiles_.size(), 1.0f);
 
-			float closestT = (-halfB - sqrt(discriminant)) / a;
-			// closestT > 0 prevents redrawing spheres that don't actually exist
-			if (closestT > 1e-8f && closestT < closestHitDistance) {
-				closestSphereIdx = (int)i;
-				closestHitDistance = closestT;
-				continue;
-			}
-			//closestT = (-halfB + sqrt(discriminant)) / a;
-			//if (closestT > 1e-8f && closestT < closestHitDistance) {
-			//	closestSphereIdx = (int)i;
-			//	closestHitDistance = closestT;
-			//	continue;
-			//}
-		} // end loop
+		allocateImageBuffers(settings_.numaAware);
 
-		if (closestSphereIdx < 0) {
-			return miss(ray);
+		resumeRendering();
+		resetFrameIndex();
+	}
+
+	void Renderer::allocateImageBuffers(bool numaAware) {
+		size_t pixelCount = (size_t)imageWidth_ * imageHeight_;
+
+		if (numaAware) {
+			pImageData_ = numa::makeUntouchedArray<uint32_t>(pixelCount);
+			pPresentImageData_ = numa::makeUntouchedArray<uint32_t>(pixelCount);
+			pAccumulatedImageData_ = numa::makeUntouchedArray<glm::vec4>(pixelCount);
+			pVarianceData_ = numa::makeUntouchedArray<float>(pixelCount);
+			pHistoryImageData_ = numa::makeUntouchedArray<glm::vec4>(pixelCount);
+			pHistoryVarianceData_ = numa::makeUntouchedArray<float>(pixelCount);
+			pPrimaryHits_ = numa::makeUntouchedArray<PrimaryHit>(pixelCount);
+			pHistoryHits_ = numa::makeUntouchedArray<PrimaryHit>(pixelCount);
+
+			// First touch every tile from a worker on the node that will render it. Tiles are split
+			// into bands of rows per node, so only the pages on band edges end up shared.
+			workerPool_.run((uint32_t)tiles_.size(), [this](uint32_t i, uint32_t) {
+				const Tile& tile = tiles_[i];
+				for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+					size_t first = tile.x0 + (size_t)y * imageWidth_;
+					size_t last = tile.x1 + (size_t)y * imageWidth_;
+					std::fill(pImageData_.get() + first, pImageData_.get() + last, 0u);
+					std::fill(pPresentImageData_.get() + first, pPresentImageData_.get() + last, 0u);
+					std::fill(pAccumulatedImageData_.get() + first, pAccumulatedImageData_.get() + last,
+							  glm::vec4(0.0f));
+					std::fill(pVarianceData_.get() + first, pVarianceData_.get() + last, 0.0f);
+					std::fill(pHistoryImageData_.get() + first, pHistoryImageData_.get() + last, glm::vec4(0.0f));
+					std::fill(pHistoryVarianceData_.get() + first, pHistoryVarianceData_.get() + last, 0.0f);
+					std::fill(pPrimaryHits_.get() + first, pPrimaryHits_.get() + last, PrimaryHit());
+					std::fill(pHistoryHits_.get() + first, pHistoryHits_.get() + last, PrimaryHit());
+				}
+			}, false);
+		}
+		else {
+			pImageData_ = std::shared_ptr<uint32_t[]>(new uint32_t[pixelCount]);
+			pPresentImageData_ = std::shared_ptr<uint32_t[]>(new uint32_t[pixelCount]);
+			pAccumulatedImageData_ = std::shared_ptr<glm::vec4[]>(new glm::vec4[pixelCount]);
+			pVarianceData_ = std::shared_ptr<float[]>(new float[pixelCount]);
+			pHistoryImageData_ = std::shared_ptr<glm::vec4[]>(new glm::vec4[pixelCount]);
+			pHistoryVarianceData_ = std::shared_ptr<float[]>(new float[pixelCount]);
+			pPrimaryHits_ = std::shared_ptr<PrimaryHit[]>(new PrimaryHit[pixelCount]);
+			pHistoryHits_ = std::shared_ptr<PrimaryHit[]>(new PrimaryHit[pixelCount]);
+		}
+		// Any worker can splat to any pixel, so there's no node to place these on
+		pSplatData_ = std::shared_ptr<std::atomic<float>[]>(new std::atomic<float>[pixelCount * 3]);
+		for (size_t i = 0; i < pixelCount * 3; ++i) {
+			pSplatData_[i].store(0.0f, std::memory_order_relaxed);
 		}
 
-		return closestHit(ray, closestHitDistance, closestSphereIdx);
+		// Edge tiles are clipped, but every tile gets a full tile's worth of reservoirs
+		size_t reservoirCount = tiles_.size() * TILE_SIZE * TILE_SIZE;
+		pReservoirs_ = std::shared_ptr<RestirPixel[]>(new RestirPixel[reservoirCount]);
+		pReservoirHistory_ = std::shared_ptr<RestirPixel[]>(new RestirPixel[reservoirCount]);
+		restirCamera_.reset();
+		restirHistoryCamera_.reset();
+		hitsCamera_.reset();
+		accumulatedCamera_.reset();
+
+		{
+			std::lock_guard<std::mutex> lock(presentMutex_);
+			imageReady_ = false;
+		}
+
+		buildFrameGraph();
 	}
 
-	HitData Renderer::closestHit(const Ray& ray, float hitDistance, int objIdx) {
-		const Sphere& sphere = pScene_->spheres[objIdx];
+	void Renderer::replicateScene(const FrameState& frame) {
+		if (!frame.settings.numaAware || workerPool_.nodeCount() < 2) {
+			sceneReplicas_.clear();
+			return;
+		}
 
-		glm::vec3 hitPos = ray.origin + ray.dir * hitDistance; // a + bt
+		// Replicas are refreshed when the snapshot changes or the builder publishes a better BVH
+		const AccelerationState* state = frame.scene->acceleration->get();
+		sceneReplicas_.resize(workerPool_.nodeCount());
+		if (sceneReplicas_[0].source == frame.scene && sceneReplicas_[0].sourceState == state) {
+			return;
+		}
 
-		HitData hitData;
-		hitData.hitDistance = hitDistance;
-		hitData.worldPos = hitPos;
-		hitData.worldNormal = glm::normalize(hitPos - sphere.pos);
-		hitData.objIdx = objIdx;
-		
-		return hitData;
+		// Each node copies the data itself, so the copy is allocated in its own memory
+		workerPool_.runOnEachNode([this, &frame, state](uint32_t node) {
+			const SceneSnapshot& source = *frame.scene;
+
+			std::shared_ptr<SceneSnapshot> copy = std::make_shared<SceneSnapshot>();
+			copy->version = source.version;
+			copy->spheres = source.spheres.clone();
+			copy->materials = source.materials.clone();
+			copy->changedSpheres = source.changedSpheres;
+			copy->emitterList = std::make_shared<const std::vector<uint32_t>>(source.emissiveSpheres());
+			copy->acceleration = std::make_shared<SceneAcceleration>();
+			if (state) {
+				AccelerationState nodeState;
+				nodeState.bvh = std::make_shared<const Bvh>(*state->bvh);
+				nodeState.changedSpheres = state->changedSpheres;
+				if (state->lights) {
+					nodeState.lights = std::make_shared<const LightBvh>(*state->lights);
+				}
+				copy->acceleration->publish(std::move(nodeState));
+			}
+
+			SceneReplica& replica = sceneReplicas_[node];
+			replica.source = frame.scene;
+			replica.sourceState = state;
+			replica.snapshot = std::move(copy);
+		});
 	}
 
-	HitData Renderer::miss(const Ray& ray) {
-		HitData missData;
-		missData.hitDistance = -1.0f;
-		return missData;
+	const SceneSnapshot& Renderer::sceneForNode(const FrameState& frame, uint32_t node) const {
+		return sceneReplicas_.empty() ? *frame.scene : *sceneReplicas_[node].snapshot;
+	}
+
+	void Renderer::runBenchmark(Benchmark benchmark, FrameState frame) {
+		{
+			// Holding the frame lock makes the main thread's pauseRendering() wait for us, and its
+			// cancellation cuts the measurement short
+			std::lock_guard<std::mutex> lock(frameMutex_);
+			if (benchmark == Benchmark::NUMA) {
+				runNumaBenchmark(frame);
+			}
+			else {
+				runGuidingComparison(frame);
+			}
+		}
+
+		// The measurements overwrote the accumulation, so the image starts over, along with any
+		// restart the main thread held back meanwhile
+		std::lock_guard<std::mutex> lock(stateMutex_);
+		benchmarkRunning_ = false;
+		cancelToken_.cancel();
 	}
 
-	// Schlick Reflectance approximation for reflectivity or refractive surfaces at steep viewing angles
-	float Renderer::schlickReflectance(float cosine, float refIdx) {
-		float r0 = (1.0f - refIdx) / (1.0f + refIdx);
-		r0 = r0 * r0;
-		return r0 + (1.0f - r0) * (float)std::pow((1.0f - cosine), 5);
+	void Renderer::runNumaBenchmark(FrameState& frame) {
+		Logger::info("Benchmarking NUMA placement on {} node(s)", workerPool_.nodeCount());
+
+		bool numaAware = frame.settings.numaAware;
+		frame.settings.multithread = true;
+
+		const float BENCHMARK_SECONDS = 2.0f;
+		float throughput[2] = {};
+		for (int aware = 0; aware < 2; ++aware) {
+			frame.settings.numaAware = aware == 1;
+			allocateImageBuffers(frame.settings.numaAware);
+			replicateScene(frame);
+			throughput[aware] = measureThroughput(frame, BENCHMARK_SECONDS);
+		}
+
+		allocateImageBuffers(numaAware);
+
+		char result[128];
+		if (cancelToken_.isCancelled(frame.generation)) {
+			std::snprintf(result, sizeof(result), "Cancelled");
+		}
+		else {
+			std::snprintf(result, sizeof(result), "Off: %.2f Msamples/s\nOn: %.2f Msamples/s (%.2fx)",
+						  throughput[0], throughput[1], throughput[1] / std::max(throughput[0], 1e-6f));
+		}
+		Logger::info("NUMA benchmark:\n{}", result);
+
+		std::lock_guard<std::mutex> lock(stateMutex_);
+		numaBenchmarkResult_ = result;
+	}
+
+	void Renderer::runGuidingComparison(FrameState& frame) {
+		Logger::info("Comparing guided and unguided rendering");
+
+		frame.settings.multithread = true;
+		// Adaptive sampling would spend the two runs' samples differently
+		frame.settings.adaptiveSampling = false;
+
+		// Both get the same time, and the guided run includes its own training
+		const float COMPARISON_SECONDS = 5.0f;
+		float error[2] = {}, spp[2] = {};
+		for (int guided = 0; guided < 2; ++guided) {
+			frame.settings.pathGuiding = guided == 1;
+			guideSceneVersion_ = std::numeric_limits<uint64_t>::max();
+			float throughput = measureThroughput(frame, COMPARISON_SECONDS);
+
+			float errorSum = 0.0f;
+			for (float tileError : tileError_) {
+				errorSum += tileError;
+			}
+			error[guided] = errorSum / std::max(imageWidth_ * imageHeight_, 1u);
+			spp[guided] = throughput * 1e6f * COMPARISON_SECONDS / std::max(imageWidth_ * imageHeight_, 1u);
+		}
+
+		// Monte Carlo error falls off as 1/sqrt(time), so the ratio of the squared errors is how much
+		// longer the unguided render needs to match the guided one
+		char result[192];
+		if (cancelToken_.isCancelled(frame.generation)) {
+			std::snprintf(result, sizeof(result), "Cancelled");
+		}
+		else {
+			std::snprintf(result, sizeof(result),
+						  "Unguided: %.2f%% error (%.0f spp)\nGuided: %.2f%% error (%.0f spp)\nTime to equal quality: %.2fx",
+						  error[0] * 100.0f, spp[0], error[1] * 100.0f, spp[1],
+						  (error[0] * error[0]) / std::max(error[1] * error[1], 1e-12f));
+		}
+		Logger::info("Path guiding comparison after {}s each:\n{}", COMPARISON_SECONDS, result);
+
+		std::lock_guard<std::mutex> lock(stateMutex_);
+		guidingComparisonResult_ = result;
+	}
+
+	void Renderer::prepareGuide(const FrameState& frame) {
+		if (!frame.settings.pathGuiding) {
+			return;
+		}
+
+		// Recorded radiance is only valid for the scene and lighting it was recorded in
+		if (frame.scene->version == guideSceneVersion_ && frame.environment == guideEnvironment_ &&
+			frame.settings.environmentIntensity == guideEnvironmentIntensity_) {
+			return;
+		}
+		guideSceneVersion_ = frame.scene->version;
+		guideEnvironment_ = frame.environment;
+		guideEnvironmentIntensity_ = frame.settings.environmentIntensity;
+
+		Aabb bounds;
+		for (size_t i = 0; i < frame.scene->spheres.size(); ++i) {
+			bounds.grow(Aabb::ofSphere(frame.scene->spheres[i]));
+		}
+		if (frame.scene->spheres.empty()) {
+			bounds.grow(glm::vec3(-1.0f));
+			bounds.grow(glm::vec3(1.0f));
+		}
+		pathGuide_.reset(bounds);
+		guideIteration_ = 0;
+		guideLeaves_ = 1;
+	}
+
+	void Renderer::finishGuideFrame(const FrameState& frame, float samplesPerPixel) {
+		if (frame.settings.pathGuiding && pathGuide_.addSamples(samplesPerPixel)) {
+			guideIteration_ = pathGuide_.iteration();
+			guideLeaves_ = (uint32_t)pathGuide_.leafCount();
+		}
+	}
+
+	void Renderer::prepareRadianceCache(const FrameState& frame) {
+		if (!frame.settings.radianceCache) {
+			// Edits made meanwhile aren't tracked, so turning it back on starts over
+			cacheScene_.reset();
+			return;
+		}
+
+		radianceCache_.setCellSize(frame.settings.radianceCacheCellSize);
+		if (!cacheScene_ || frame.environment != cacheEnvironment_ || frame.settings.skylight != cacheSkylight_ ||
+			frame.settings.environmentIntensity != cacheEnvironmentIntensity_) {
+			radianceCache_.clear();
+		}
+		else if (frame.scene->version != cacheScene_->version) {
+			radianceCache_.invalidateChanges(*cacheScene_, *frame.scene);
+		}
+		cacheScene_ = frame.scene;
+		cacheEnvironment_ = frame.environment;
+		cacheSkylight_ = frame.settings.skylight;
+		cacheEnvironmentIntensity_ = frame.settings.environmentIntensity;
+
+		radianceCache_.age();
+		cacheEntries_ = radianceCache_.usedEntries();
+	}
+
+	float Renderer::measureThroughput(const FrameState& frame, float seconds) {
+		// Runs the whole frame graph at one sample per pixel per pass, so the accumulate and resolve
+		// memory traffic is part of the measurement
+		pFrame_ = &frame;
+		samplesPerPixel_ = 1;
+		deadline_ = Clock::time_point::max();
+		frameSamples_ = 0;
+		clearAccumulation(frame);
+		hitsCamera_.reset();
+		accumulatedCamera_.reset();
+
+		Clock::time_point startTime = Clock::now();
+		float elapsed = 0.0f;
+		do {
+			prepareGuide(frame);
+			prepareRadianceCache(frame);
+			prepareEmitterTable(frame);
+			tracePhotons(frame);
+			prepareMetropolis(frame);
+			prepareRestir(frame);
+			frameGraph_.setImportedData(displayBuffer_, pImageData_.get());
+			frameGraph_.execute(true, [this, &frame]() {
+				return cancelToken_.isCancelled(frame.generation);
+			});
+			finishGuideFrame(frame, 1.0f);
+			elapsed = std::chrono::duration<float>(Clock::now() - startTime).count();
+		} while (elapsed < seconds && !cancelToken_.isCancelled(frame.generation));
+
+		pFrame_ = nullptr;
+		return frameSamples_ / elapsed / 1e6f;
+	}
+
+	glm::vec4 Renderer::perPixel(uint32_t x, uint32_t y, uint32_t sampleIndex, const FrameState& frame,
+								 const SceneSnapshot& scene, SampleGenerator& sampler, const RestirPixel* reservoir) {
+		sampler.startSample(x, y, sampleIndex);
+
+		// Initial ray starting at the camera's center, directed based on the pixel index
+		Ray ray;
+		ray.origin = frame.camera->getPosition();
+		if (frame.filter) {
+			glm::vec2 offset = frame.filter->sample(sampler.get2D());
+			ray.dir = frame.camera->computeRayDirection(x + 0.5f + offset.x, y + 0.5f + offset.y);
+		}
+		else {
+			ray.dir = frame.camera->getRayDirection(x, y);
+		}
+		return glm::vec4(tracePath(ray, frame, scene, sampler, reservoir), 1.0f);
+	}
+
+	glm::vec3 Renderer::tracePath(Ray ray, const FrameState& frame, const SceneSnapshot& scene,
+								  SampleGenerator& sampler, const RestirPixel* reservoir) {
+		glm::vec3 totalLight(0.0f);
+		glm::vec3 contribution(1.0f);
+
+		// Solid angle pdf of the last scatter if the emitters were also sampled at that bounce, or
+		// 0 for delta lobes, in which case emission found by the scattered ray counts fully. The
+		// light sample's position and normal are kept to evaluate its pdf for the same emitter.
+		float scatterPdf = 0.0f;
+		glm::vec3 lightOrigin(0.0f), lightNormal(0.0f);
+
+		const RendererSettings& settings = frame.settings;
+		LightSampling lightSampling = settings.lightSampling;
+
+		// The environment map is sampled as one more light, picked half the time when there are
+		// emissive spheres too
+		const EnvironmentMap* environment = settings.skylight ? frame.environment.get() : nullptr;
+		bool hasEmitters = !scene.emissiveSpheres().empty();
+		float environmentChance = !environment ? 0.0f : (hasEmitters ? 0.5f : 1.0f);
+		bool sampleEmitters = lightSampling != LightSampling::BSDF && (hasEmitters || environment);
+
+		// Fetched once, so sampling an emitter and finding the pdf of hitting it later in the path
+		// use the same hierarchy even if the builder publishes a new one in between
+		const AccelerationState* acceleration = scene.acceleration->get();
+		const LightBvh* lights = settings.lightSelection == LightSelection::LIGHT_BVH && acceleration
+			? acceleration->lights.get() : nullptr;
+
+		// Scatters taken so far of each kind, checked against the per-kind limits
+		int diffuseBounces = 0, specularBounces = 0, transmissionBounces = 0;
+
+		// Guided bounces remember what they need to record the radiance their continuation finds:
+		// the light gathered before it and the throughput that scales everything after it
+		struct GuideVertex {
+			glm::vec3 pos, dir;
+			glm::vec3 lightBefore, throughput;
+			float pdf;
+		};
+		const uint32_t MAX_RECORDED_VERTICES = 64;
+		GuideVertex guideVertices[MAX_RECORDED_VERTICES];
+		uint32_t guideVertexCount = 0;
+		// Metropolis chains would train them on paths that aren't independent
+		bool pathIntegrator = settings.integrator == Integrator::PATH;
+		bool guiding = settings.pathGuiding && pathIntegrator;
+		bool recordGuide = guiding && pathGuide_.isTraining();
+
+		// Diffuse vertices record the light reflected from them into the radiance cache the same way.
+		// One path in eight never reads from the cache and keeps training the cells it can't see.
+		struct CacheVertex {
+			uint32_t entry;
+			glm::vec3 lightBefore, throughput;
+		};
+		CacheVertex cacheVertices[MAX_RECORDED_VERTICES];
+		uint32_t cacheVertexCount = 0;
+		// Photons bring the light of the emitters that arrives at the first diffuse surface after
+		// more than one bounce. From there the path only looks for the sky, and it's gone entirely
+		// without one. They replace the same part of the path the radiance cache does.
+		const PhotonMap* photons = settings.photonMapping && photonMap_.size() > 0 && sampleEmitters && hasEmitters
+			? &photonMap_ : nullptr;
+		bool emittersGathered = false;
+
+		// A reservoir lights the emitters at the first hit in place of the emitter samples, and the
+		// scattered ray leaving it doesn't count the emitters it finds
+		bool reservoirLit = false;
+
+		bool useCache = settings.radianceCache && pathIntegrator && !photons;
+		bool readCache = useCache && sampler.get1D() >= 0.125f;
+
+		for (int i = 0; i < settings.maxBounces; i++) {
+			// Every bounce draws the same dimensions whether it uses them or not, so a dimension
+			// always drives the same decision
+			float uLight = sampler.get1D();
+			glm::vec2 uCone = sampler.get2D();
+			glm::vec2 uScatter = sampler.get2D();
+			float uLobe = sampler.get1D();
+			float uRoulette = sampler.get1D();
+
+			HitData hitData = traceRay(ray, scene);
+
+			// If we miss all objects in the scene, the sky color is added to the pixel color and
+			// we break out of the bounce loop
+			if (hitData.hitDistance < 0.0f) {
+				if (environment) {
+					float weight = 1.0f;
+					if (scatterPdf > 0.0f && sampleEmitters) {
+						float lightPdf = environment->pdf(ray.dir) * environmentChance;
+						weight = lightSampling == LightSampling::EMITTERS
+							? 0.0f : utils::misWeight(lightSampling, scatterPdf, lightPdf);
+					}
+					totalLight += contribution * environment->lookup(ray.dir) * settings.environmentIntensity * weight;
+				}
+				else if (settings.skylight) {
+					totalLight += skyLight * contribution;
+				}
+				break;
+			}
+
+			const Sphere& sphere = scene.spheres[hitData.objIdx];
+			const Material& material = scene.materials[sphere.matIdx];
+
+			if (material.isEmissive() && !emittersGathered && !reservoirLit) {
+				// The light sample at the last bounce could also have found this emitter
+				float weight = 1.0f;
+				if (scatterPdf > 0.0f && sampleEmitters) {
+					float lightPdf = emitterPdf(lightOrigin, lightNormal, hitData.objIdx, scene, lights) *
+									 (1.0f - environmentChance);
+					weight = lightSampling == LightSampling::EMITTERS
+						? 0.0f : utils::misWeight(lightSampling, scatterPdf, lightPdf);
+				}
+				totalLight += contribution * material.getEmission() * weight;
+			}
+
+			if (useCache && material.matType == MaterialType::LAMBERTIAN) {
+				glm::vec3 cached;
+				if (readCache && i >= settings.radianceCacheBounces &&
+					radianceCache_.lookup(hitData.worldPos, hitData.worldNormal, cached)) {
+					totalLight += contribution * cached;
+					break;
+				}
+				uint32_t entry = cacheVertexCount < MAX_RECORDED_VERTICES
+					? radianceCache_.findOrInsert(hitData.worldPos, hitData.worldNormal) : RadianceCache::INVALID_ENTRY;
+				if (entry != RadianceCache::INVALID_ENTRY) {
+					cacheVertices[cacheVertexCount++] = { entry, totalLight, contribution };
+				}
+			}
+
+			Bsdf bsdf(material, hitData.worldNormal, -ray.dir);
+
+			// Where the guide has learned something, directions come from a mix of it and the BSDF
+			const DTree* dTree = guiding && !bsdf.isDelta() ? pathGuide_.find(hitData.worldPos) : nullptr;
+
+			// Scattered rays won't count the emitters from here on, so their light samples take it all
+			bool gatherPhotons = photons && !emittersGathered && material.matType == MaterialType::LAMBERTIAN;
+
+			// The reservoir was made at the pixel's center hit, while this ray is jittered over the
+			// filter. It's shaded here only if this is a similar spot on the same object, and otherwise
+			// the emitters are sampled as usual.
+			reservoirLit = false;
+			if (i == 0 && reservoir && !emittersGathered && reservoir->surface.objIdx == hitData.objIdx) {
+				RestirSurface surface;
+				surface.pos = hitData.worldPos;
+				surface.normal = bsdf.getNormal();
+				surface.wo = -ray.dir;
+				surface.depth = hitData.hitDistance;
+				surface.objIdx = hitData.objIdx;
+				reservoirLit = !bsdf.isDelta() && similarSurfaces(surface, reservoir->surface);
+				if (reservoirLit) {
+					totalLight += contribution * shadeReservoir(reservoir->reservoir, surface, scene);
+				}
+			}
+
+			if (sampleEmitters && !bsdf.isDelta()) {
+				lightOrigin = utils::offsetOrigin(hitData.worldPos, bsdf.getNormal(), bsdf.getNormal());
+				lightNormal = bsdf.getNormal();
+				glm::vec3 lightDir(0.0f);
+				float lightPdf = 0.0f;
+				glm::vec3 emitted(0.0f);
+				bool emitterSample = uLight >= environmentChance;
+				if (!emitterSample) {
+					emitted = sampleEnvironment(lightOrigin, scene, *environment, uCone, lightDir, lightPdf) *
+							  settings.environmentIntensity;
+					lightPdf *= environmentChance;
+				}
+				else if (!emittersGathered && !reservoirLit) {
+					float uPick = (uLight - environmentChance) / (1.0f - environmentChance);
+					emitted = sampleEmitter(lightOrigin, lightNormal, scene, lights, uPick, uCone, lightDir, lightPdf);
+					lightPdf *= 1.0f - environmentChance;
+				}
+				glm::vec3 f = bsdf.evaluate(lightDir);
+				if (lightPdf > 0.0f && (f.r > 0.0f || f.g > 0.0f || f.b > 0.0f)) {
+					float weight = lightSampling == LightSampling::EMITTERS || (gatherPhotons && emitterSample)
+						? 1.0f : utils::misWeight(lightSampling, lightPdf, dTree
+							? GUIDE_BSDF_FRACTION * bsdf.pdf(lightDir) + (1.0f - GUIDE_BSDF_FRACTION) * dTree->pdf(lightDir)
+							: bsdf.pdf(lightDir));
+					totalLight += contribution * f * emitted * (weight / lightPdf);
+				}
+			}
+
+			if (gatherPhotons) {
+				totalLight += contribution * material.albedo * glm::one_over_pi<float>() *
+							  photons->estimate(hitData.worldPos, bsdf.getNormal());
+				emittersGathered = true;
+				if (!settings.skylight) {
+					break;
+				}
+			}
+
+			BsdfSample scatter;
+			if (dTree && uLobe >= GUIDE_BSDF_FRACTION) {
+				scatter.dir = dTree->sample(uScatter);
+				scatter.weight = bsdf.evaluate(scatter.dir);
+				scatter.lobe = material.matType == MaterialType::LAMBERTIAN ? BsdfLobe::DIFFUSE : BsdfLobe::GLOSSY;
+			}
+			else {
+				if (!bsdf.sample(uScatter, dTree ? uLobe / GUIDE_BSDF_FRACTION : uLobe, scatter)) {
+					break;
+				}
+				// Back to the BSDF times the cosine, to divide by the mixture's pdf instead
+				if (dTree) {
+					scatter.weight *= scatter.pdf;
+				}
+			}
+			if (dTree) {
+				scatter.pdf = GUIDE_BSDF_FRACTION * bsdf.pdf(scatter.dir) +
+							  (1.0f - GUIDE_BSDF_FRACTION) * dTree->pdf(scatter.dir);
+				if (scatter.pdf <= 0.0f || glm::max(glm::max(scatter.weight.r, scatter.weight.g), scatter.weight.b) <= 0.0f) {
+					break;
+				}
+				scatter.weight /= scatter.pdf;
+			}
+
+			contribution *= scatter.weight;
+			scatterPdf = scatter.pdf;
+
+			bool recordVertex = recordGuide && !bsdf.isDelta() && guideVertexCount < MAX_RECORDED_VERTICES;
+			if (recordVertex) {
+				guideVertices[guideVertexCount++] = { hitData.worldPos, scatter.dir, totalLight, contribution, scatter.pdf };
+			}
+			// Spawn the next ray on the side of the surface it leaves from
+			ray.origin = utils::offsetOrigin(hitData.worldPos, hitData.worldNormal, scatter.dir);
+			ray.dir = scatter.dir;
+
+			bool withinLimits = true;
+			switch (scatter.lobe) {
+				case BsdfLobe::DIFFUSE: withinLimits = ++diffuseBounces <= settings.maxDiffuseBounces; break;
+				case BsdfLobe::TRANSMISSION: withinLimits = ++transmissionBounces <= settings.maxTransmissionBounces; break;
+				default: withinLimits = ++specularBounces <= settings.maxSpecularBounces; break;
+			}
+			if (!withinLimits) {
+				break;
+			}
+
+			// Russian roulette: past the minimum depth, continue with a probability that follows
+			// the path's throughput and divide by it, so dim paths end early without bias
+			if (settings.russianRoulette && i + 1 >= settings.rouletteMinBounces) {
+				float survival = std::min(glm::max(glm::max(contribution.r, contribution.g), contribution.b), 0.95f);
+				if (uRoulette >= survival) {
+					break;
+				}
+				contribution /= survival;
+				if (recordVertex) {
+					guideVertices[guideVertexCount - 1].throughput = contribution;
+				}
+			}
+		}
+
+		// Whatever was gathered after a guided bounce, divided by the throughput up to it, is an
+		// estimate of the radiance arriving from the direction it took
+		for (uint32_t v = 0; v < guideVertexCount; ++v) {
+			const GuideVertex& vertex = guideVertices[v];
+			glm::vec3 incident = (totalLight - vertex.lightBefore) / glm::max(vertex.throughput, glm::vec3(1e-8f));
+			pathGuide_.record(vertex.pos, vertex.dir, utils::luminance(incident) / vertex.pdf);
+		}
+		for (uint32_t v = 0; v < cacheVertexCount; ++v) {
+			const CacheVertex& vertex = cacheVertices[v];
+			radianceCache_.record(vertex.entry,
+								  (totalLight - vertex.lightBefore) / glm::max(vertex.throughput, glm::vec3(1e-8f)));
+		}
+
+		return totalLight;
+	}
+
+	void Renderer::prepareRestir(const FrameState& frame) {
+		if (!frame.settings.restir || frame.settings.integrator != Integrator::PATH) {
+			restirCamera_.reset();
+			restirHistoryCamera_.reset();
+		}
+		else {
+			// Last frame's reservoirs become the history, if it made any
+			std::swap(pReservoirs_, pReservoirHistory_);
+			restirHistoryCamera_ = frame.settings.restirTemporal ? restirCamera_ : nullptr;
+			restirCamera_ = frame.camera;
+			++restirFrame_;
+		}
+		frameGraph_.setImportedData(restirBuffer_, pReservoirs_.get());
+		frameGraph_.setImportedData(restirHistoryBuffer_, pReservoirHistory_.get());
+	}
+
+	void Renderer::generateReservoir(uint32_t x, uint32_t y, const FrameState& frame, const SceneSnapshot& scene,
+									 SampleGenerator& sampler, const RestirPixel* history, RestirPixel& out) {
+		out = RestirPixel();
+
+		// The ray perPixel() starts from, or the middle of the ones it jitters over the filter
+		Ray ray;
+		ray.origin = frame.camera->getPosition();
+		ray.dir = frame.filter ? frame.camera->computeRayDirection(x + 0.5f, y + 0.5f)
+							   : frame.camera->getRayDirection(x, y);
+		HitData hitData = traceRay(ray, scene);
+		if (hitData.hitDistance < 0.0f) {
+			return;
+		}
+		Bsdf bsdf(scene.materials[scene.spheres[hitData.objIdx].matIdx], hitData.worldNormal, -ray.dir);
+		if (bsdf.isDelta()) {
+			return;
+		}
+
+		RestirSurface& surface = out.surface;
+		surface.pos = hitData.worldPos;
+		surface.normal = bsdf.getNormal();
+		surface.wo = -ray.dir;
+		surface.depth = hitData.hitDistance;
+		surface.objIdx = hitData.objIdx;
+		if (scene.emissiveSpheres().empty()) {
+			return;
+		}
+
+		// Rows below the image, so these numbers are independent of the ones the pixel's paths use
+		sampler.startSample(x, y + imageHeight_, restirFrame_);
+		const AccelerationState* acceleration = scene.acceleration->get();
+		const LightBvh* lights = frame.settings.lightSelection == LightSelection::LIGHT_BVH && acceleration
+			? acceleration->lights.get() : nullptr;
+
+		// Resampled importance sampling of the candidates toward the unshadowed target
+		Reservoir& reservoir = out.reservoir;
+		int candidates = std::max(frame.settings.restirCandidates, 1);
+		for (int c = 0; c < candidates; ++c) {
+			float uPick = sampler.get1D();
+			glm::vec2 uCone = sampler.get2D();
+			float uSelect = sampler.get1D();
+
+			LightSample candidate;
+			float areaPdf;
+			if (sampleLightPoint(surface, scene, lights, uPick, uCone, candidate, areaPdf)) {
+				float target = restirTarget(surface, candidate, scene);
+				reservoir.update(candidate, target / areaPdf, target, uSelect);
+			}
+			reservoir.count += 1.0f;
+		}
+		if (reservoir.targetPdf > 0.0f) {
+			reservoir.weight = reservoir.weightSum / (reservoir.count * reservoir.targetPdf);
+		}
+
+		// Visibility reuse: a shadowed sample is dropped before neighbours can pick it up
+		if (reservoir.weight > 0.0f && !restirVisible(surface, reservoir.sample, scene)) {
+			reservoir.weight = 0.0f;
+		}
+
+		if (!history) {
+			return;
+		}
+		glm::vec2 raster;
+		if (!restirHistoryCamera_->projectToRaster(surface.pos, raster) || raster.x < 0.0f || raster.y < 0.0f ||
+			raster.x >= imageWidth_ || raster.y >= imageHeight_) {
+			return;
+		}
+		const RestirPixel& previous = history[restirIndex((uint32_t)raster.x, (uint32_t)raster.y)];
+		if (!similarSurfaces(surface, previous.surface)) {
+			return;
+		}
+
+		// The history is capped so the reservoir keeps up with lighting that changes
+		const RestirPixel* sources[2] = { &out, &previous };
+		float counts[2] = { reservoir.count, std::min(previous.reservoir.count, RESTIR_MAX_HISTORY * reservoir.count) };
+		reservoir = combineReservoirs(surface, sources, counts, 2, scene, sampler);
+	}
+
+	void Renderer::reuseReservoirs(uint32_t x, uint32_t y, const FrameState& frame, const SceneSnapshot& scene,
+								   SampleGenerator& sampler, const RestirPixel* candidates, RestirPixel& out) {
+		const RestirPixel& self = candidates[restirIndex(x, y)];
+		out = self;
+		int neighbors = std::min(frame.settings.restirSpatialNeighbors, 16);
+		if (self.surface.depth < 0.0f || neighbors <= 0) {
+			return;
+		}
+
+		sampler.startSample(x, y + 2 * imageHeight_, restirFrame_);
+		const RestirPixel* sources[17] = { &self };
+		float counts[17] = { self.reservoir.count };
+		uint32_t sourceCount = 1;
+		for (int n = 0; n < neighbors; ++n) {
+			// Uniform over a disk, so close and far neighbours are as likely as their area
+			glm::vec2 u = sampler.get2D();
+			float r = frame.settings.restirSpatialRadius * std::sqrt(u.x);
+			float phi = glm::two_pi<float>() * u.y;
+			int nx = (int)x + (int)std::lround(r * std::cos(phi));
+			int ny = (int)y + (int)std::lround(r * std::sin(phi));
+			if (nx < 0 || ny < 0 || nx >= (int)imageWidth_ || ny >= (int)imageHeight_ || (nx == (int)x && ny == (int)y)) {
+				continue;
+			}
+
+			const RestirPixel& neighbor = candidates[restirIndex((uint32_t)nx, (uint32_t)ny)];
+			if (similarSurfaces(self.surface, neighbor.surface)) {
+				sources[sourceCount] = &neighbor;
+				counts[sourceCount] = neighbor.reservoir.count;
+				++sourceCount;
+			}
+		}
+		if (sourceCount > 1) {
+			out.reservoir = combineReservoirs(self.surface, sources, counts, sourceCount, scene, sampler);
+		}
+	}
+
+	glm::vec3 Renderer::shadeReservoir(const Reservoir& reservoir, const RestirSurface& surface,
+									   const SceneSnapshot& scene) {
+		glm::vec3 radiance;
+		if (reservoir.weight <= 0.0f || restirTarget(surface, reservoir.sample, scene, &radiance) <= 0.0f ||
+			!restirVisible(surface, reservoir.sample, scene)) {
+			return glm::vec3(0.0f);
+		}
+		return radiance * reservoir.weight;
+	}
+
+	bool Renderer::restirVisible(const RestirSurface& surface, const LightSample& sample, const SceneSnapshot& scene) {
+		const Sphere& light = scene.spheres[sample.light];
+		Ray shadowRay;
+		shadowRay.origin = utils::offsetOrigin(surface.pos, surface.normal, surface.normal);
+		shadowRay.dir = glm::normalize(light.pos + sample.normal * light.radius - shadowRay.origin);
+		// The sample faces the surface, so the first point of its sphere the ray reaches is the sample
+		HitData hit = traceRay(shadowRay, scene);
+		return hit.hitDistance >= 0.0f && hit.objIdx == sample.light;
+	}
+
+	void Renderer::prepareMetropolis(const FrameState& frame) {
+		const RendererSettings& settings = frame.settings;
+		if (settings.integrator != Integrator::METROPOLIS) {
+			metropolisChains_.clear();
+			return;
+		}
+		if (!metropolisChains_.empty()) {
+			return;
+		}
+
+		// Bootstrap: independent paths, each from a sampler seeded with its index, so the chain that
+		// starts from one can make the same path again
+		const SceneSnapshot& scene = *frame.scene;
+		uint32_t count = (uint32_t)std::max(settings.metropolisBootstrap, 1);
+		std::vector<float> weights(count);
+		const uint32_t CHUNK = 1024;
+		std::vector<uint32_t> chunks((count + CHUNK - 1) / CHUNK);
+		std::iota(chunks.begin(), chunks.end(), 0);
+
+		auto bootstrapChunk = [this, &frame, &scene, &weights, &settings, count](uint32_t chunk) {
+			for (uint32_t i = chunk * CHUNK; i < std::min(count, (chunk + 1) * CHUNK); ++i) {
+				MetropolisSampleGenerator sampler(i, settings.metropolisSigma, settings.metropolisLargeStep);
+				glm::vec2 raster;
+				weights[i] = utils::luminance(metropolisPath(frame, scene, sampler, raster));
+			}
+		};
+		if (settings.multithread) {
+			std::for_each(std::execution::par, chunks.begin(), chunks.end(), bootstrapChunk);
+		}
+		else {
+			std::for_each(chunks.begin(), chunks.end(), bootstrapChunk);
+		}
+
+		double sum = 0.0;
+		for (float weight : weights) {
+			sum += weight;
+		}
+		metropolisNormalization_ = (float)(sum / count);
+
+		// A black image leaves every chain on a path of its own, and splats nothing
+		AliasTable bootstrap = sum > 0.0 ? AliasTable(weights) : AliasTable();
+		uint32_t seed = 1;
+		metropolisChains_.resize(tiles_.size());
+		for (uint32_t c = 0; c < metropolisChains_.size(); ++c) {
+			uint32_t index = c;
+			if (bootstrap.size() > 0) {
+				float remapped;
+				index = bootstrap.sample(Random::rFloat(seed), remapped);
+			}
+
+			MetropolisChain& chain = metropolisChains_[c];
+			chain.sampler = std::make_unique<MetropolisSampleGenerator>(index, settings.metropolisSigma,
+																		settings.metropolisLargeStep);
+			chain.radiance = metropolisPath(frame, scene, *chain.sampler, chain.raster);
+			chain.luminance = utils::luminance(chain.radiance);
+		}
+		metropolisProposed_ = 0;
+		metropolisAccepted_ = 0;
+	}
+
+	glm::vec3 Renderer::metropolisPath(const FrameState& frame, const SceneSnapshot& scene, SampleGenerator& sampler,
+									   glm::vec2& raster) {
+		sampler.startSample(0, 0, 0);
+		raster = sampler.get2D() * glm::vec2((float)imageWidth_, (float)imageHeight_);
+
+		Ray ray;
+		ray.origin = frame.camera->getPosition();
+		ray.dir = frame.camera->computeRayDirection(raster.x, raster.y);
+		return tracePath(ray, frame, scene, sampler);
+	}
+
+	uint32_t Renderer::runMetropolisChain(const Tile& tile, const FrameState& frame, const SceneSnapshot& scene) {
+		MetropolisChain& chain = metropolisChains_[tile.index];
+		uint32_t tilePixels = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+		uint32_t mutations = samplesPerPixel_ * tilePixels;
+
+		// Both the current and the proposed path are splatted, weighted by how likely the chain
+		// is to be at each after this step, over the target function. That's the expected value
+		// of the chain's samples rather than just the one it ends up taking.
+		uint32_t m = 0;
+		uint32_t accepted = 0;
+		for (; m < mutations; ++m) {
+			// Checked once per sample's worth of mutations, like the tiles of the path tracer
+			if (m > 0 && m % tilePixels == 0 &&
+				(Clock::now() >= deadline_ || cancelToken_.isCancelled(frame.generation))) {
+				break;
+			}
+
+			chain.sampler->startIteration();
+			glm::vec2 raster;
+			glm::vec3 radiance = metropolisPath(frame, scene, *chain.sampler, raster);
+			float luminance = utils::luminance(radiance);
+			float acceptance = chain.luminance > 0.0f ? std::min(1.0f, luminance / chain.luminance) : 1.0f;
+
+			if (acceptance > 0.0f && luminance > 0.0f) {
+				addSplat(raster, radiance * (acceptance * metropolisNormalization_ / luminance));
+			}
+			if (acceptance < 1.0f) {
+				addSplat(chain.raster, chain.radiance * ((1.0f - acceptance) * metropolisNormalization_ / chain.luminance));
+			}
+
+			if (chain.sampler->uniform() < acceptance) {
+				chain.raster = raster;
+				chain.radiance = radiance;
+				chain.luminance = luminance;
+				chain.sampler->accept();
+				++accepted;
+			}
+			else {
+				chain.sampler->reject();
+			}
+		}
+
+		frameSamples_ += m;
+		splatPaths_ += m;
+		metropolisProposed_ += m;
+		metropolisAccepted_ += accepted;
+		return m;
+	}
+
+	void Renderer::prepareEmitterTable(const FrameState& frame) {
+		bool needed = frame.settings.integrator == Integrator::BIDIRECTIONAL ||
+					  (frame.settings.integrator == Integrator::PATH && frame.settings.photonMapping);
+		if (!needed || frame.scene->version == emitterTableVersion_) {
+			return;
+		}
+		emitterTableVersion_ = frame.scene->version;
+
+		// Power is radiance times area, and the constant factors cancel out of the pmf
+		const SceneSnapshot& scene = *frame.scene;
+		std::vector<float> weights;
+		weights.reserve(scene.emissiveSpheres().size());
+		emitterWeightSum_ = 0.0f;
+		for (uint32_t i : scene.emissiveSpheres()) {
+			const Sphere& sphere = scene.spheres[i];
+			weights.push_back(utils::luminance(scene.materials[sphere.matIdx].getEmission()) * sphere.radius * sphere.radius);
+			emitterWeightSum_ += weights.back();
+		}
+		emitterTable_ = weights.empty() ? AliasTable() : AliasTable(weights);
+	}
+
+	void Renderer::tracePhotons(const FrameState& frame) {
+		const RendererSettings& settings = frame.settings;
+		if (!settings.photonMapping || settings.integrator != Integrator::PATH || emitterTable_.size() == 0) {
+			if (photonMap_.size() > 0) {
+				photonMap_.clear();
+			}
+			photonCount_ = 0;
+			photonMapMb_ = 0.0f;
+			return;
+		}
+
+		// Progressive photon mapping (Knaus and Zwicker 2011). Each pass shrinks the area of the
+		// gather by (i + alpha) / (i + 1), which is slow enough for the noise of every pass to
+		// average out and fast enough for the bias to go to zero.
+		if (photonPass_ == 0) {
+			photonRadius_ = settings.photonRadius;
+		}
+		else {
+			photonRadius_ *= std::sqrt((photonPass_ + PHOTON_ALPHA) / (photonPass_ + 1.0f));
+		}
+		++photonPass_;
+
+		const SceneSnapshot& scene = *frame.scene;
+		uint32_t count = (uint32_t)std::max(settings.photonsPerPass, 1);
+		const uint32_t CHUNK = 4096;
+		std::vector<std::vector<Photon>> chunkPhotons((count + CHUNK - 1) / CHUNK);
+		std::vector<uint32_t> chunks(chunkPhotons.size());
+		std::iota(chunks.begin(), chunks.end(), 0);
+
+		auto shootChunk = [this, &frame, &scene, &chunkPhotons, count](uint32_t chunk) {
+			std::unique_ptr<SampleGenerator> sampler = createSampleGenerator(frame.settings.sampleSequence);
+			for (uint32_t i = chunk * CHUNK; i < std::min(count, (chunk + 1) * CHUNK); ++i) {
+				shootPhoton(i, (float)count, frame, scene, *sampler, chunkPhotons[chunk]);
+			}
+		};
+		if (settings.multithread) {
+			std::for_each(std::execution::par, chunks.begin(), chunks.end(), shootChunk);
+		}
+		else {
+			std::for_each(chunks.begin(), chunks.end(), shootChunk);
+		}
+
+		size_t stored = 0;
+		for (const std::vector<Photon>& photons : chunkPhotons) {
+			stored += photons.size();
+		}
+		std::vector<Photon> photons;
+		photons.reserve(stored);
+		for (const std::vector<Photon>& chunk : chunkPhotons) {
+			photons.insert(photons.end(), chunk.begin(), chunk.end());
+		}
+		photonMap_.build(std::move(photons), photonRadius_);
+
+		photonCount_ = (uint32_t)photonMap_.size();
+		photonMapMb_ = photonMap_.memoryBytes() / (1024.0f * 1024.0f);
+		displayedPhotonRadius_ = photonRadius_;
+	}
+
+	void Renderer::shootPhoton(uint32_t index, float photonCount, const FrameState& frame, const SceneSnapshot& scene,
+							   SampleGenerator& sampler, std::vector<Photon>& stored) {
+		const RendererSettings& settings = frame.settings;
+		sampler.startSample(index, 0, photonPass_);
+
+		// Starts uniformly over the area of an emitter picked by power and leaves it in a cosine
+		// distribution, like a light subpath
+		float uPick = sampler.get1D();
+		glm::vec2 uPos = sampler.get2D();
+		glm::vec2 uDir = sampler.get2D();
+
+		float remapped;
+		uint32_t light = emitterTable_.sample(uPick, remapped);
+		const Sphere& sphere = scene.spheres[scene.emissiveSpheres()[light]];
+
+		float z = 1.0f - 2.0f * uPos.x;
+		float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+		float phi = glm::two_pi<float>() * uPos.y;
+		glm::vec3 normal(r * std::cos(phi), r * std::sin(phi), z);
+
+		glm::vec3 tangent, bitangent;
+		makeBasis(normal, tangent, bitangent);
+		float cosTheta = std::sqrt(1.0f - uDir.x);
+		float sinTheta = std::sqrt(uDir.x);
+		phi = glm::two_pi<float>() * uDir.y;
+
+		Ray ray;
+		ray.dir = glm::normalize(sinTheta * (std::cos(phi) * tangent + std::sin(phi) * bitangent) + cosTheta * normal);
+		ray.origin = utils::offsetOrigin(sphere.pos + normal * sphere.radius, normal, ray.dir);
+
+		// Emission over the pdfs of the pick, the point (1 / area) and the direction (cos / pi),
+		// shared between all the photons of the pass
+		float area = 2.0f * glm::two_pi<float>() * sphere.radius * sphere.radius;
+		glm::vec3 power = scene.materials[sphere.matIdx].getEmission() *
+						  (glm::pi<float>() * area / (emitterTable_.pmf(light) * photonCount));
+
+		for (int depth = 0; depth < settings.maxBounces; ++depth) {
+			glm::vec2 uScatter = sampler.get2D();
+			float uLobe = sampler.get1D();
+			float uRoulette = sampler.get1D();
+
+			HitData hitData = traceRay(ray, scene);
+			if (hitData.hitDistance < 0.0f) {
+				break;
+			}
+
+			const Material& material = scene.materials[scene.spheres[hitData.objIdx].matIdx];
+			// Direct light is left to the light samples taken where the photons are gathered
+			if (depth > 0 && material.matType == MaterialType::LAMBERTIAN) {
+				stored.emplace_back(hitData.worldPos, ray.dir, power);
+			}
+
+			Bsdf bsdf(material, hitData.worldNormal, -ray.dir);
+			BsdfSample scatter;
+			if (!bsdf.sample(uScatter, uLobe, scatter)) {
+				break;
+			}
+
+			glm::vec3 scattered = power * scatter.weight;
+			ray.origin = utils::offsetOrigin(hitData.worldPos, hitData.worldNormal, scatter.dir);
+			ray.dir = scatter.dir;
+
+			// Continues with the fraction of power the bounce kept, so every photon that survives
+			// carries about as much as it started with
+			if (settings.russianRoulette && depth + 1 >= settings.rouletteMinBounces) {
+				float survival = std::min(glm::max(glm::max(scattered.r, scattered.g), scattered.b) /
+										  glm::max(glm::max(power.r, power.g), power.b), 0.95f);
+				if (uRoulette >= survival) {
+					break;
+				}
+				scattered /= survival;
+			}
+			power = scattered;
+		}
+	}
+
+	glm::vec4 Renderer::perPixelBidirectional(uint32_t x, uint32_t y, uint32_t sampleIndex, const FrameState& frame,
+											  const SceneSnapshot& scene, SampleGenerator& sampler) {
+		sampler.startSample(x, y, sampleIndex);
+
+		const RendererSettings& settings = frame.settings;
+		const Camera& camera = *frame.camera;
+
+		// maxBounces goes up to 64, and a path of depth d has d + 2 vertices
+		const int MAX_VERTICES = 66;
+		BdptVertex cameraPath[MAX_VERTICES];
+		BdptVertex lightPath[MAX_VERTICES];
+		int maxDepth = std::min(settings.maxBounces, MAX_VERTICES - 2);
+
+		// The camera subpath is jittered over the pixel, so it covers the same area the splats do
+		glm::vec2 uPixel = sampler.get2D();
+		cameraPath[0].isCamera = true;
+		cameraPath[0].pos = camera.getPosition();
+		cameraPath[0].beta = glm::vec3(1.0f);
+
+		Ray ray;
+		ray.origin = camera.getPosition();
+		ray.dir = camera.computeRayDirection(x + uPixel.x, y + uPixel.y);
+		float cosine = glm::dot(ray.dir, camera.getDirection());
+		float cameraPdf = 1.0f / (camera.imagePlaneArea() * cosine * cosine * cosine);
+
+		glm::vec3 escapedBeta(0.0f), escapedDir(0.0f);
+		int cameraCount = bdptRandomWalk(ray, glm::vec3(1.0f), cameraPdf, scene, sampler, maxDepth + 2, cameraPath,
+										 escapedBeta, escapedDir);
+
+		// The light subpath starts uniformly over the area of an emitter picked by power, and leaves
+		// it in a cosine distribution
+		float uPick = sampler.get1D();
+		glm::vec2 uPos = sampler.get2D();
+		glm::vec2 uDir = sampler.get2D();
+		int lightCount = 0;
+		if (emitterTable_.size() > 0) {
+			float remapped;
+			BdptVertex& origin = lightPath[0];
+			origin.isLight = true;
+			origin.objIdx = scene.emissiveSpheres()[emitterTable_.sample(uPick, remapped)];
+
+			const Sphere& sphere = scene.spheres[origin.objIdx];
+			float z = 1.0f - 2.0f * uPos.x;
+			float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+			float phi = glm::two_pi<float>() * uPos.y;
+			origin.normal = glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+			origin.pos = sphere.pos + origin.normal * sphere.radius;
+			origin.pdfFwd = bdptLightOriginPdf(origin, scene);
+			origin.beta = scene.materials[sphere.matIdx].getEmission() / origin.pdfFwd;
+			lightCount = 1;
+
+			glm::vec3 tangent, bitangent;
+			makeBasis(origin.normal, tangent, bitangent);
+			float cosTheta = std::sqrt(1.0f - uDir.x);
+			float sinTheta = std::sqrt(uDir.x);
+			phi = glm::two_pi<float>() * uDir.y;
+			glm::vec3 dir = glm::normalize(sinTheta * (std::cos(phi) * tangent + std::sin(phi) * bitangent) +
+										   cosTheta * origin.normal);
+			float pdfDir = cosTheta * glm::one_over_pi<float>();
+			if (pdfDir > 0.0f) {
+				Ray lightRay;
+				lightRay.origin = utils::offsetOrigin(origin.pos, origin.normal, dir);
+				lightRay.dir = dir;
+				// Le cos / (pdfPos pdfDir), where the cosines cancel
+				glm::vec3 unusedBeta, unusedDir;
+				lightCount = bdptRandomWalk(lightRay, origin.beta * glm::pi<float>(), pdfDir, scene, sampler,
+											maxDepth + 1, lightPath, unusedBeta, unusedDir);
+			}
+		}
+
+		glm::vec3 totalLight(0.0f);
+
+		// Only camera subpaths can find the sky, so no other strategy competes for its light
+		if (escapedBeta != glm::vec3(0.0f)) {
+			const EnvironmentMap* environment = settings.skylight ? frame.environment.get() : nullptr;
+			if (environment) {
+				totalLight += escapedBeta * environment->lookup(escapedDir) * settings.environmentIntensity;
+			}
+			else if (settings.skylight) {
+				totalLight += escapedBeta * skyLight;
+			}
+		}
+
+		const AccelerationState* acceleration = scene.acceleration->get();
+		const LightBvh* lights = settings.lightSelection == LightSelection::LIGHT_BVH && acceleration
+			? acceleration->lights.get() : nullptr;
+
+		for (int t = 2; t <= cameraCount; ++t) {
+			BdptVertex& pt = cameraPath[t - 1];
+			float uLight = sampler.get1D();
+			glm::vec2 uCone = sampler.get2D();
+
+			// s = 0: the camera subpath found an emitter on its own
+			glm::vec3 emitted = bdptEmitted(pt, pt.wo, scene);
+			if (emitted != glm::vec3(0.0f)) {
+				totalLight += pt.beta * emitted * bdptMisWeight(lightPath, cameraPath, 0, t, frame, scene);
+			}
+
+			if (pt.delta) {
+				continue;
+			}
+			const Material& ptMaterial = scene.materials[scene.spheres[pt.objIdx].matIdx];
+			Bsdf ptBsdf(ptMaterial, pt.normal, pt.wo);
+
+			// s = 1: a new point sampled on an emitter, as in next event estimation. The sampled
+			// direction's pdf weights the estimate, and the area pdf of starting a light subpath there
+			// goes into the MIS weight.
+			if (!scene.emissiveSpheres().empty() && t - 1 <= maxDepth) {
+				glm::vec3 origin = utils::offsetOrigin(pt.pos, ptBsdf.getNormal(), ptBsdf.getNormal());
+				uint32_t lightIdx = 0;
+				glm::vec3 lightDir;
+				float lightPdf;
+				glm::vec3 lightEmitted = sampleEmitter(origin, ptBsdf.getNormal(), scene, lights, uLight, uCone,
+													   lightDir, lightPdf, &lightIdx);
+				glm::vec3 f = lightPdf > 0.0f ? ptBsdf.evaluate(lightDir) : glm::vec3(0.0f);
+				if (f != glm::vec3(0.0f)) {
+					const Sphere& light = scene.spheres[lightIdx];
+					Ray toLight;
+					toLight.origin = origin;
+					toLight.dir = lightDir;
+
+					BdptVertex sampled;
+					sampled.isLight = true;
+					sampled.objIdx = lightIdx;
+					sampled.pos = origin + lightDir * light.intersect(toLight);
+					sampled.normal = glm::normalize(sampled.pos - light.pos);
+					sampled.pdfFwd = bdptLightOriginPdf(sampled, scene);
+
+					BdptVertex lightOrigin = lightPath[0];
+					lightPath[0] = sampled;
+					totalLight += pt.beta * f * lightEmitted / lightPdf *
+								  bdptMisWeight(lightPath, cameraPath, 1, t, frame, scene);
+					lightPath[0] = lightOrigin;
+				}
+			}
+
+			// s >= 2: connections to the vertices of the light subpath
+			for (int s = 2; s <= lightCount && s + t - 2 <= maxDepth; ++s) {
+				const BdptVertex& qs = lightPath[s - 1];
+				if (qs.delta) {
+					continue;
+				}
+
+				glm::vec3 d = pt.pos - qs.pos;
+				float distanceSq = glm::dot(d, d);
+				glm::vec3 dir = d / std::sqrt(distanceSq);
+				const Material& qsMaterial = scene.materials[scene.spheres[qs.objIdx].matIdx];
+				// Both evaluations include their cosine, which leaves 1 / d^2 of the geometry term
+				glm::vec3 contribution = qs.beta * Bsdf(qsMaterial, qs.normal, qs.wo).evaluate(dir) *
+										 ptBsdf.evaluate(-dir) * pt.beta / distanceSq;
+				if (contribution == glm::vec3(0.0f) || !bdptVisible(qs, pt, scene)) {
+					continue;
+				}
+				totalLight += contribution * bdptMisWeight(lightPath, cameraPath, s, t, frame, scene);
+			}
+		}
+
+		// t = 1: light subpath vertices the camera sees, splatted to whichever pixel they land on
+		for (int s = 2; s <= lightCount; ++s) {
+			const BdptVertex& qs = lightPath[s - 1];
+			glm::vec2 raster;
+			if (qs.delta || !camera.projectToRaster(qs.pos, raster)) {
+				continue;
+			}
+
+			glm::vec3 d = cameraPath[0].pos - qs.pos;
+			float distanceSq = glm::dot(d, d);
+			glm::vec3 dir = d / std::sqrt(distanceSq);
+			float cameraCosine = -glm::dot(dir, camera.getDirection());
+			const Material& qsMaterial = scene.materials[scene.spheres[qs.objIdx].matIdx];
+			glm::vec3 f = Bsdf(qsMaterial, qs.normal, qs.wo).evaluate(dir);
+			if (cameraCosine <= 0.0f || f == glm::vec3(0.0f) || !bdptVisible(qs, cameraPath[0], scene)) {
+				continue;
+			}
+
+			// The pinhole's importance 1 / (A cos^4), over the density d^2 / cos of reaching it from qs
+			float importance = 1.0f / (camera.imagePlaneArea() * cameraCosine * cameraCosine * cameraCosine * distanceSq);
+			glm::vec3 splat = qs.beta * f * importance * bdptMisWeight(lightPath, cameraPath, s, 1, frame, scene);
+
+			addSplat(raster, splat);
+		}
+
+		return glm::vec4(totalLight, 1.0f);
+	}
+
+	void Renderer::addSplat(const glm::vec2& raster, const glm::vec3& value) {
+		uint32_t idx = std::min((uint32_t)raster.x, imageWidth_ - 1) +
+					   std::min((uint32_t)raster.y, imageHeight_ - 1) * imageWidth_;
+		for (int c = 0; c < 3; ++c) {
+			utils::atomicAdd(pSplatData_[idx * 3 + c], value[c]);
+		}
+	}
+
+	int Renderer::bdptRandomWalk(Ray ray, glm::vec3 beta, float pdfDir, const SceneSnapshot& scene,
+								 SampleGenerator& sampler, int maxVertices, BdptVertex* path, glm::vec3& escapedBeta,
+								 glm::vec3& escapedDir) {
+		int count = 1;
+		while (count < maxVertices) {
+			glm::vec2 uScatter = sampler.get2D();
+			float uLobe = sampler.get1D();
+
+			HitData hitData = traceRay(ray, scene);
+			if (hitData.hitDistance < 0.0f) {
+				escapedBeta = beta;
+				escapedDir = ray.dir;
+				break;
+			}
+
+			BdptVertex& prev = path[count - 1];
+			BdptVertex& v = path[count++];
+			v = BdptVertex();
+			v.pos = hitData.worldPos;
+			v.normal = hitData.worldNormal;
+			v.wo = -ray.dir;
+			v.beta = beta;
+			v.objIdx = hitData.objIdx;
+
+			// Converting a solid angle density to an area density takes the cosine at the receiving
+			// end over the squared distance
+			glm::vec3 d = v.pos - prev.pos;
+			float distanceSq = glm::dot(d, d);
+			v.pdfFwd = pdfDir * std::abs(glm::dot(v.normal, ray.dir)) / distanceSq;
+			if (count == maxVertices) {
+				break;
+			}
+
+			const Material& material = scene.materials[scene.spheres[v.objIdx].matIdx];
+			Bsdf bsdf(material, v.normal, v.wo);
+			BsdfSample scatter;
+			if (!bsdf.sample(uScatter, uLobe, scatter)) {
+				break;
+			}
+
+			// Delta vertices can't be connected to, so their pdfs drop out of the MIS weights
+			float pdfRev = 0.0f;
+			if (bsdf.isDelta()) {
+				v.delta = true;
+				pdfDir = 0.0f;
+			}
+			else {
+				pdfDir = scatter.pdf;
+				pdfRev = Bsdf(material, v.normal, scatter.dir).pdf(v.wo);
+			}
+			prev.pdfRev = pdfRev * (prev.isCamera ? 1.0f : std::abs(glm::dot(prev.normal, v.wo))) / distanceSq;
+
+			beta *= scatter.weight;
+			if (beta == glm::vec3(0.0f)) {
+				break;
+			}
+
+			ray.origin = utils::offsetOrigin(v.pos, v.normal, scatter.dir);
+			ray.dir = scatter.dir;
+		}
+		return count;
+	}
+
+	float Renderer::bdptPdf(const BdptVertex& v, const BdptVertex* prev, const BdptVertex& next,
+							const FrameState& frame, const SceneSnapshot& scene) const {
+		glm::vec3 d = next.pos - v.pos;
+		float distanceSq = glm::dot(d, d);
+		if (distanceSq <= 0.0f) {
+			return 0.0f;
+		}
+		glm::vec3 dir = d / std::sqrt(distanceSq);
+
+		float pdfDir;
+		if (v.isCamera) {
+			// Uniform over the image plane, which is 1 / (A cos^3) per unit solid angle
+			glm::vec2 raster;
+			float cosine = glm::dot(dir, frame.camera->getDirection());
+			if (cosine <= 0.0f || !frame.camera->projectToRaster(next.pos, raster)) {
+				return 0.0f;
+			}
+			pdfDir = 1.0f / (frame.camera->imagePlaneArea() * cosine * cosine * cosine);
+		}
+		else if (!prev) {
+			// Emitters send light subpaths out in a cosine distribution
+			pdfDir = std::max(glm::dot(v.normal, dir), 0.0f) * glm::one_over_pi<float>();
+		}
+		else {
+			const Material& material = scene.materials[scene.spheres[v.objIdx].matIdx];
+			pdfDir = Bsdf(material, v.normal, glm::normalize(prev->pos - v.pos)).pdf(dir);
+		}
+		return pdfDir * (next.isCamera ? 1.0f : std::abs(glm::dot(next.normal, dir))) / distanceSq;
+	}
+
+	float Renderer::bdptLightOriginPdf(const BdptVertex& v, const SceneSnapshot& scene) const {
+		const Sphere& sphere = scene.spheres[v.objIdx];
+		const Material& material = scene.materials[sphere.matIdx];
+		if (!material.isEmissive() || emitterWeightSum_ <= 0.0f) {
+			return 0.0f;
+		}
+		// The pmf of picking the sphere, luminance * r^2 / sum, times 1 / (4 pi r^2) over its area
+		return utils::luminance(material.getEmission()) / (2.0f * glm::two_pi<float>() * emitterWeightSum_);
+	}
+
+	float Renderer::bdptMisWeight(BdptVertex* lightPath, BdptVertex* cameraPath, int s, int t,
+								  const FrameState& frame, const SceneSnapshot& scene) {
+		// A pinhole can't be hit, so the camera seeing an emitter has only one strategy
+		if (s + t == 2) {
+			return 1.0f;
+		}
+
+		BdptVertex* qs = s > 0 ? &lightPath[s - 1] : nullptr;
+		BdptVertex* pt = &cameraPath[t - 1];
+		BdptVertex* qsMinus = s > 1 ? &lightPath[s - 2] : nullptr;
+		BdptVertex* ptMinus = t > 1 ? &cameraPath[t - 2] : nullptr;
+
+		// The vertices around the connection get the densities of being sampled across it
+		float ptRev = qs ? bdptPdf(*qs, qsMinus, *pt, frame, scene) : bdptLightOriginPdf(*pt, scene);
+		float ptMinusRev = ptMinus ? bdptPdf(*pt, qs, *ptMinus, frame, scene) : 0.0f;
+		float qsRev = qs ? bdptPdf(*pt, ptMinus, *qs, frame, scene) : 0.0f;
+		float qsMinusRev = qsMinus ? bdptPdf(*qs, pt, *qsMinus, frame, scene) : 0.0f;
+
+		BdptVertex savedPt = *pt;
+		pt->pdfRev = ptRev;
+		pt->delta = false;
+		BdptVertex savedPtMinus, savedQs, savedQsMinus;
+		if (ptMinus) {
+			savedPtMinus = *ptMinus;
+			ptMinus->pdfRev = ptMinusRev;
+		}
+		if (qs) {
+			savedQs = *qs;
+			qs->pdfRev = qsRev;
+			qs->delta = false;
+		}
+		if (qsMinus) {
+			savedQsMinus = *qsMinus;
+			qsMinus->pdfRev = qsMinusRev;
+		}
+
+		// Each step along a subpath swaps one of its pdfs for the other side's, giving the ratio
+		// of the next strategy's pdf to this one's. Delta densities are left out as 1 on both sides.
+		auto ratio = [](float rev, float fwd) {
+			float r = (rev != 0.0f ? rev : 1.0f) / (fwd != 0.0f ? fwd : 1.0f);
+			return r * r;
+		};
+		float sum = 0.0f;
+		float r = 1.0f;
+		for (int i = t - 1; i > 0; --i) {
+			r *= ratio(cameraPath[i].pdfRev, cameraPath[i].pdfFwd);
+			if (!cameraPath[i].delta && !cameraPath[i - 1].delta) {
+				sum += r;
+			}
+		}
+		r = 1.0f;
+		for (int i = s - 1; i >= 0; --i) {
+			r *= ratio(lightPath[i].pdfRev, lightPath[i].pdfFwd);
+			if (!lightPath[i].delta && (i == 0 || !lightPath[i - 1].delta)) {
+				sum += r;
+			}
+		}
+
+		*pt = savedPt;
+		if (ptMinus) {
+			*ptMinus = savedPtMinus;
+		}
+		if (qs) {
+			*qs = savedQs;
+		}
+		if (qsMinus) {
+			*qsMinus = savedQsMinus;
+		}
+		return 1.0f / (1.0f + sum);
+	}
+
+	glm::vec3 Renderer::bdptEmitted(const BdptVertex& v, const glm::vec3& dir, const SceneSnapshot& scene) const {
+		// Emitters only light the outside of their sphere, the side light subpaths leave from
+		const Material& material = scene.materials[scene.spheres[v.objIdx].matIdx];
+		return material.isEmissive() && glm::dot(v.normal, dir) > 0.0f ? material.getEmission() : glm::vec3(0.0f);
+	}
+
+	bool Renderer::bdptVisible(const BdptVertex& a, const BdptVertex& b, const SceneSnapshot& scene) {
+		glm::vec3 dir = glm::normalize(b.pos - a.pos);
+		Ray ray;
+		ray.origin = utils::offsetOrigin(a.pos, a.normal, dir);
+		ray.dir = dir;
+		float distance = glm::length(b.pos - ray.origin);
+
+		// The ray has to reach b itself, or get past where the camera is
+		HitData hit = traceRay(ray, scene);
+		if (b.isCamera) {
+			return hit.hitDistance < 0.0f || hit.hitDistance > distance;
+		}
+		return hit.hitDistance >= 0.0f && hit.objIdx == b.objIdx && std::abs(hit.hitDistance - distance) < 1e-3f + 1e-3f * distance;
+	}
+
+	glm::vec3 Renderer::sampleEmitter(const glm::vec3& pos, const glm::vec3& normal, const SceneSnapshot& scene,
+									  const LightBvh* lights, float uPick, const glm::vec2& uCone,
+									  glm::vec3& lightDir, float& lightPdf, uint32_t* sampledLight) {
+		lightPdf = 0.0f;
+
+		uint32_t lightIdx;
+		float pickPdf;
+		if (lights) {
+			if (!lights->sample(pos, normal, uPick, lightIdx, pickPdf)) {
+				return glm::vec3(0.0f);
+			}
+		}
+		else {
+			const std::vector<uint32_t>& emitters = scene.emissiveSpheres();
+			uint32_t pick = std::min((uint32_t)(uPick * emitters.size()), (uint32_t)emitters.size() - 1);
+			lightIdx = emitters[pick];
+			pickPdf = 1.0f / emitters.size();
+		}
+		const Sphere& light = scene.spheres[lightIdx];
+
+		glm::vec3 toCenter = light.pos - pos;
+		float distanceSq = glm::dot(toCenter, toCenter);
+		float radiusSq = light.radius * light.radius;
+		if (distanceSq <= radiusSq) {
+			return glm::vec3(0.0f);
+		}
+
+		// Sample the cone of directions the sphere subtends uniformly
+		float coneSize = utils::sphereConeSize(distanceSq, radiusSq);
+
+		float cosTheta = 1.0f - uCone.x * coneSize;
+		float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+		float phi = uCone.y * glm::two_pi<float>();
+
+		glm::vec3 axis = toCenter / std::sqrt(distanceSq);
+		glm::vec3 tangent, bitangent;
+		makeBasis(axis, tangent, bitangent);
+		lightDir = glm::normalize(sinTheta * (std::cos(phi) * tangent + std::sin(phi) * bitangent) +
+								  cosTheta * axis);
+
+		// The shadow ray has to reach the emitter itself, not just anything
+		Ray shadowRay;
+		shadowRay.origin = pos;
+		shadowRay.dir = lightDir;
+		HitData hit = traceRay(shadowRay, scene);
+		if (hit.hitDistance < 0.0f || hit.objIdx != lightIdx) {
+			return glm::vec3(0.0f);
+		}
+
+		lightPdf = pickPdf / (glm::two_pi<float>() * coneSize);
+		if (sampledLight) {
+			*sampledLight = lightIdx;
+		}
+		return scene.materials[light.matIdx].getEmission();
+	}
+
+	glm::vec3 Renderer::sampleEnvironment(const glm::vec3& pos, const SceneSnapshot& scene,
+										  const EnvironmentMap& environment, const glm::vec2& u,
+										  glm::vec3& lightDir, float& lightPdf) {
+		glm::vec3 radiance = environment.sample(u, lightDir, lightPdf);
+		if (lightPdf <= 0.0f) {
+			return glm::vec3(0.0f);
+		}
+
+		// Anything in the way blocks the environment
+		Ray shadowRay;
+		shadowRay.origin = pos;
+		shadowRay.dir = lightDir;
+		if (traceRay(shadowRay, scene).hitDistance >= 0.0f) {
+			return glm::vec3(0.0f);
+		}
+		return radiance;
+	}
+
+	float Renderer::emitterPdf(const glm::vec3& pos, const glm::vec3& normal, uint32_t sphereIdx,
+							   const SceneSnapshot& scene, const LightBvh* lights) const {
+		const Sphere& light = scene.spheres[sphereIdx];
+
+		glm::vec3 toCenter = light.pos - pos;
+		float distanceSq = glm::dot(toCenter, toCenter);
+		float radiusSq = light.radius * light.radius;
+		if (distanceSq <= radiusSq) {
+			return 0.0f;
+		}
+
+		float pickPdf = lights ? lights->pmf(pos, normal, sphereIdx) : 1.0f / scene.emissiveSpheres().size();
+		float coneSize = utils::sphereConeSize(distanceSq, radiusSq);
+		return pickPdf / (glm::two_pi<float>() * coneSize);
+	}
+
+	HitData Renderer::traceRay(const Ray& ray, const SceneSnapshot& scene) {
+		int closestSphereIdx = -1;
+
+		float closestHitDistance = std::numeric_limits<float>::max();
+
+		const AccelerationState* acceleration = scene.acceleration->get();
+		if (acceleration) {
+			acceleration->bvh->intersect(ray, scene.spheres, closestHitDistance, closestSphereIdx);
+
+			// Spheres edited since the BVH was built may have moved out of their nodes
+			for (uint32_t i : acceleration->changedSpheres) {
+				float t = scene.spheres[i].intersect(ray);
+				if (t > 0.0f && t < closestHitDistance) {
+					closestSphereIdx = (int)i;
+					closestHitDistance = t;
+				}
+			}
+		}
+		else {
+			// No BVH has been built for this snapshot yet
+			for (size_t i = 0; i < scene.spheres.size(); ++i) {
+				float t = scene.spheres[i].intersect(ray);
+				if (t > 0.0f && t < closestHitDistance) {
+					closestSphereIdx = (int)i;
+					closestHitDistance = t;
+				}
+			}
+		}
+
+		if (closestSphereIdx < 0) {
+			return miss(ray);
+		}
+
+		return closestHit(ray, closestHitDistance, closestSphereIdx, scene);
+	}
+
+	HitData Renderer::closestHit(const Ray& ray, float hitDistance, int objIdx, const SceneSnapshot& scene) {
+		const Sphere& sphere = scene.spheres[objIdx];
+
+		glm::vec3 hitPos = ray.origin + ray.dir * hitDistance; // a + bt
+
+		HitData hitData;
+		hitData.hitDistance = hitDistance;
+		hitData.worldPos = hitPos;
+		hitData.worldNormal = glm::normalize(hitPos - sphere.pos);
+		hitData.objIdx = objIdx;
+		
+		return hitData;
+	}
+
+	HitData Renderer::miss(const Ray& ray) {
+		HitData missData;
+		missData.hitDistance = -1.0f;
+		return missData;
 	}
 
 	void debugMessageCallback(GLenum source, GLenum type, GLuint id, GLenum severity,
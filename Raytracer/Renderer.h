@@ -7,12 +7,31 @@
 #include "Camera.h"
 #include "Ray.h"
 #include "Scene.h"
+#include "FrameGraph.h"
+#include "Bvh.h"
+#include "LightBvh.h"
+#include "PathGuide.h"
+#include "RadianceCache.h"
+#include "PhotonMap.h"
+#include "Restir.h"
+#include "WorkerPool.h"
+#include "Bsdf.h"
+#include "EnvironmentMap.h"
+#include "SampleGenerator.h"
+#include "PixelFilter.h"
 
 #include "glad.h"
 #include <glm/glm.hpp>
 #include <imgui/imgui.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 // This is going to be a huge class that controls all of the rendering of the engine.
 // EnTT will do most of the heavy lifting in regards to keep this somewhat clean, but it will be
@@ -20,45 +39,362 @@
 
 namespace mtn {
 
+	// How emission is found at diffuse and glossy bounces
+	enum class LightSampling : int {
+		BSDF = 0,		// Only by scattered rays hitting emitters
+		EMITTERS,		// Only by sampling the emitters directly
+		MIS_BALANCE,	// Both, combined with the balance heuristic
+		MIS_POWER		// Both, combined with the power heuristic
+	};
+
+	// How sampleEmitter() chooses which emitter to sample
+	enum class LightSelection : int {
+		UNIFORM = 0,
+		LIGHT_BVH		// In proportion to estimated contribution, see LightBvh
+	};
+
+	enum class Integrator : int {
+		PATH = 0,			// Unidirectional path tracing from the camera
+		BIDIRECTIONAL,		// Connects camera and light subpaths, splatting the ones that reach the camera
+		METROPOLIS			// Primary sample space MLT over the path tracer, splatting wherever the chains go
+	};
+
+	enum class DisplayMode : int {
+		IMAGE = 0,
+		SAMPLE_HEATMAP		// Samples per pixel on a log scale, from blue to red
+	};
+
 	struct RendererSettings {
 		bool accumulate = true;
 		bool gammaCorrect = true;
 		bool multithread = true;
 		bool skylight = true;
+		float environmentIntensity = 1.0f;	// Scales the environment map when one is loaded
+
+		// The render thread takes as many samples per pixel per frame as it expects to fit in
+		// this budget, and stops adding samples once it runs out.
+		float frameBudgetMs = 16.0f;
+
+		// Precompute every primary ray direction in view space instead of computing them while
+		// tracing. Costs 12 bytes per pixel, rebuilt only on resize and shared by camera copies. Only used
+		// without a pixel filter, since jittered rays have to be computed anyway.
+		bool rayDirectionTable = false;
+
+		// Places framebuffer tiles and a copy of the scene in the memory of the NUMA node whose
+		// workers trace them
+		bool numaAware = true;
+
+		LightSampling lightSampling = LightSampling::MIS_POWER;
+		LightSelection lightSelection = LightSelection::LIGHT_BVH;
+
+		// Learns where indirect light comes from while rendering and samples directions from it
+		bool pathGuiding = false;
+
+		// Ends paths at diffuse surfaces after this many bounces with the radiance cached there,
+		// trading a little bias for many bounces of light at the cost of a few
+		bool radianceCache = false;
+		int radianceCacheBounces = 1;
+		float radianceCacheCellSize = 0.05f;	// World units
+
+		// Shoots photons from the emitters every frame and ends paths at their first diffuse surface
+		// with the light the photons brought there. The gather radius shrinks with every pass, so
+		// the bias fades as the image accumulates. Needs the emitters to be sampled directly.
+		bool photonMapping = false;
+		int photonsPerPass = 200000;
+		float photonRadius = 0.1f;		// World units, at the first pass
+
+		// Guiding, the radiance cache and photon mapping only apply to the path integrator
+		Integrator integrator = Integrator::PATH;
+
+		// Camera moves carry the accumulated samples of the pixels that still see the same diffuse
+		// surface or sky over to the new view, rather than starting from one sample. They keep this
+		// fraction of their samples, up to the cap, so stale light fades as the camera keeps moving.
+		// Only the path integrator reprojects, since splats don't belong to a surface.
+		bool temporalReprojection = true;
+		float reprojectionWeight = 0.5f;
+		int reprojectionMaxSamples = 64;
+
+		// Lights the first hit of each pixel's first sample per frame from a reservoir of light
+		// samples resampled from its own candidates, its reprojected reservoir of the last frame and
+		// those of its neighbours (ReSTIR)
+		bool restir = false;
+		int restirCandidates = 8;
+		bool restirTemporal = true;
+		int restirSpatialNeighbors = 4;
+		float restirSpatialRadius = 16.0f;	// Pixels
+
+		// Metropolis chains mutate their primary samples by sigma, or replace them all with the
+		// large step probability. The bootstrap paths estimate the image's total brightness.
+		int metropolisBootstrap = 100000;
+		float metropolisSigma = 0.01f;
+		float metropolisLargeStep = 0.3f;
+
+		SampleSequence sampleSequence = SampleSequence::SOBOL;
+
+		// Primary rays are jittered around the pixel center by importance sampling this filter
+		FilterType pixelFilter = FilterType::GAUSSIAN;
+		float filterRadius = 1.5f;		// Pixels
+
+		// Stops sampling tiles once every pixel's estimated relative error is below the target
+		bool adaptiveSampling = true;
+		float adaptiveErrorTarget = 0.02f;
+		int adaptiveMinSamples = 32;
+		DisplayMode displayMode = DisplayMode::IMAGE;
+
+		// Stops rendering once the image's mean relative error reaches the target, or once either
+		// cap is hit. A cap of 0 is unlimited. Raising a cap or lowering the target resumes.
+		bool autoStop = true;
+		float errorTarget = 0.01f;
+		int maxSamples = 0;
+		float maxSeconds = 0.0f;
+
+		// Path length limits. maxBounces counts traced rays, the others count scatters of each kind,
+		// where specular covers metal and dielectric reflection and transmission covers refraction.
+		int maxBounces = 16;
+		int maxDiffuseBounces = 16;
+		int maxSpecularBounces = 16;
+		int maxTransmissionBounces = 16;
+
+		// Randomly ends paths with low throughput once they're this many rays long
+		bool russianRoulette = true;
+		int rouletteMinBounces = 3;
+	};
+
+	// Cooperative cancellation for in-flight frames. Every cancel() bumps the generation, and
+	// workers compare it against the generation their frame started with between tiles.
+	class CancellationToken {
+	public:
+		inline void cancel() { generation_.fetch_add(1, std::memory_order_acq_rel); }
+		inline uint32_t generation() const { return generation_.load(std::memory_order_acquire); }
+		inline bool isCancelled(uint32_t generation) const { return this->generation() != generation; }
+
+	private:
+		std::atomic<uint32_t> generation_{ 0 };
+	};
+
+	// Why the render thread stopped refining the current image
+	enum class StopReason : int {
+		NONE = 0,
+		ERROR_TARGET,
+		SAMPLE_CAP,
+		TIME_CAP,
+		ALL_TILES_CONVERGED
+	};
+
+	// Measurements the render thread runs in place of frames when the UI asks for them
+	enum class Benchmark : int {
+		NONE = 0,
+		NUMA,
+		GUIDING
+	};
+
+	// Rectangle of pixels [x0, x1) x [y0, y1). The unit of work and of cancellation.
+	struct Tile {
+		uint32_t x0 = 0, y0 = 0;
+		uint32_t x1 = 0, y1 = 0;
+		uint32_t index = 0;
 	};
 
 	class Renderer {
 	public:
 		Renderer() = delete;
 		Renderer(Window* const window);
+		~Renderer();
 
 		void startFrame(float dt);
 		void render(Scene* scene, Camera* camera);
 		void endFrame();
-		
+		void shutdown();
+
 		void setWindow(Window* const window);
 		void setWireframeMode(bool b);
 
-		inline void resetFrameIndex() { frameIndex_ = 1; }
+		// Abandons the frame in flight and restarts accumulation from the camera and scene state
+		// published at the end of this frame's render() call.
+		inline void resetFrameIndex() {
+			restartPending_ = true;
+			++historyEpoch_;
+			changeTime_ = std::chrono::steady_clock::now();
+		}
+		// Restarts like resetFrameIndex() when only the camera moved, which lets the render thread
+		// reproject the accumulated image into the new view
+		inline void cameraMoved() {
+			restartPending_ = true;
+			changeTime_ = std::chrono::steady_clock::now();
+		}
 
 		bool wireframeOn = false;
 
 	private:
+		using Clock = std::chrono::steady_clock;
+
+		// Everything the render thread needs to produce one frame, copied under stateMutex_
+		struct FrameState {
+			std::shared_ptr<const Camera> camera;
+			std::shared_ptr<const SceneSnapshot> scene;
+			std::shared_ptr<const EnvironmentMap> environment;	// Replaces the constant sky when set
+			std::shared_ptr<const PixelFilter> filter;			// Null when primary rays aren't jittered
+			RendererSettings settings;
+			uint32_t generation = 0;
+			uint32_t historyEpoch = 0;		// Only restarts other than camera moves change it
+			std::chrono::steady_clock::time_point changeTime;
+		};
+
+		// The first hit of a pixel's center ray, which tells whether the pixel still sees the same
+		// surface after the camera moves
+		struct PrimaryHit {
+			glm::vec3 pos{ 0.0f };
+			float depth = -1.0f;		// Negative when the ray missed
+			uint32_t objIdx = 0;
+		};
+
+		// A node-local copy of a snapshot's spheres, materials and BVH
+		struct SceneReplica {
+			std::shared_ptr<const SceneSnapshot> source;
+			const AccelerationState* sourceState = nullptr;
+			std::shared_ptr<SceneSnapshot> snapshot;
+		};
+
 		void initGlad();
 		void initImGui();
 
 		void onRender();
-		void renderImage();
 		void onResize(uint32_t width, uint32_t height);
 
-		// Like RayGen in DirectX and Vulkan
-		glm::vec4 perPixel(uint32_t x, uint32_t y);
+		// Render thread
+		void renderLoop();
+		bool renderImage(const FrameState& frame);
+		void buildFrameGraph();
+		void forEachTile(const FrameState& frame, const std::function<void(const Tile&, uint32_t)>& fn);
+		// reservoirs is null unless ReSTIR is on
+		void traceTile(const Tile& tile, uint32_t node, const FrameState& frame, glm::vec4* radiance,
+					   const glm::vec4* accumulation, float* variance, const RestirPixel* reservoirs);
+		void clearAccumulation(const FrameState& frame);
+		// Only called for restarts from cameraMoved(). Traces the primary hits of the new view, and
+		// fills the cleared accumulation with the history of the pixels whose hits match.
+		void reprojectAccumulation(const FrameState& frame);
+		void recordFirstPixel(const FrameState& frame);
+		void replicateScene(const FrameState& frame);
+		const SceneSnapshot& sceneForNode(const FrameState& frame, uint32_t node) const;
+		// Stops early if the frame's generation is cancelled
+		float measureThroughput(const FrameState& frame, float seconds);
+		// Render thread. Runs under the frame lock like a frame would, and restarts accumulation after.
+		void runBenchmark(Benchmark benchmark, FrameState frame);
+		void runNumaBenchmark(FrameState& frame);
+		void runGuidingComparison(FrameState& frame);
+		void prepareGuide(const FrameState& frame);
+		void finishGuideFrame(const FrameState& frame, float samplesPerPixel);
+		void prepareRadianceCache(const FrameState& frame);
+		void prepareEmitterTable(const FrameState& frame);
+		void tracePhotons(const FrameState& frame);
+		// Follows one photon from an emitter, storing it at every diffuse surface after the first hit
+		void shootPhoton(uint32_t index, float photonCount, const FrameState& frame, const SceneSnapshot& scene,
+						 SampleGenerator& sampler, std::vector<Photon>& stored);
+		void updateConvergence(const FrameState& frame);
+		StopReason checkStop(const RendererSettings& settings) const;
 
-		HitData traceRay(const Ray& ray);
-		HitData closestHit(const Ray& ray, float hitDistance, int objIdx);
-		HitData miss(const Ray& ray);
+		// Main thread helpers for synchronizing with the render thread. The scene is never shared
+		// with the render thread, which only reads the snapshots published here.
+		void publishFrameState();
+		void pauseRendering();
+		void resumeRendering();
+		void presentImage();
+		void allocateImageBuffers(bool numaAware);
+		// Hands the benchmark to the render thread, which publishes its result when it's done
+		void requestBenchmark(Benchmark benchmark);
+
+		// Like RayGen in DirectX and Vulkan. Returns linear radiance, with gamma left to the resolve.
+		glm::vec4 perPixel(uint32_t x, uint32_t y, uint32_t sampleIndex, const FrameState& frame,
+						   const SceneSnapshot& scene, SampleGenerator& sampler, const RestirPixel* reservoir = nullptr);
+		// The path tracer behind perPixel(), returning the linear radiance arriving along the ray. The
+		// reservoir, if any, replaces the emitter samples at the first hit.
+		glm::vec3 tracePath(Ray ray, const FrameState& frame, const SceneSnapshot& scene, SampleGenerator& sampler,
+							const RestirPixel* reservoir = nullptr);
+
+		// ReSTIR passes, run for every pixel before the Trace pass. Candidates are resampled with the
+		// last frame's reservoir, then with the candidates of random neighbours.
+		void prepareRestir(const FrameState& frame);
+		void generateReservoir(uint32_t x, uint32_t y, const FrameState& frame, const SceneSnapshot& scene,
+							   SampleGenerator& sampler, const RestirPixel* history, RestirPixel& out);
+		void reuseReservoirs(uint32_t x, uint32_t y, const FrameState& frame, const SceneSnapshot& scene,
+							 SampleGenerator& sampler, const RestirPixel* candidates, RestirPixel& out);
+		// The reservoir's light times its weight, if the light is visible
+		glm::vec3 shadeReservoir(const Reservoir& reservoir, const RestirSurface& surface, const SceneSnapshot& scene);
+		bool restirVisible(const RestirSurface& surface, const LightSample& sample, const SceneSnapshot& scene);
+		// Reservoirs are stored tile by tile, so a tile's pixels share cache lines and pages
+		inline size_t restirIndex(uint32_t x, uint32_t y) const {
+			uint32_t tilesX = (imageWidth_ + TILE_SIZE - 1) / TILE_SIZE;
+			return ((size_t)(y / TILE_SIZE) * tilesX + x / TILE_SIZE) * TILE_SIZE * TILE_SIZE +
+				   (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE;
+		}
+
+		// Primary sample space Metropolis light transport (Kelemen et al. 2002, following PBRT's
+		// formulation). Each tile slot owns a chain that takes the tile's share of the frame's
+		// samples as mutations, but splats them wherever its paths land.
+		void prepareMetropolis(const FrameState& frame);
+		// Returns the number of mutations taken, which stops short at the frame's deadline
+		uint32_t runMetropolisChain(const Tile& tile, const FrameState& frame, const SceneSnapshot& scene);
+		// A path from the camera through the raster position drawn from the first two dimensions
+		glm::vec3 metropolisPath(const FrameState& frame, const SceneSnapshot& scene, SampleGenerator& sampler,
+								 glm::vec2& raster);
+		void addSplat(const glm::vec2& raster, const glm::vec3& value);
 
-		float schlickReflectance(float cosine, float refIdx);
+		// Bidirectional path tracing (Veach 1997, following PBRT's formulation). Returns the
+		// estimate of the strategies that end at this pixel's camera subpath, and splats the light
+		// subpath's connections to the camera into pSplatData_.
+		glm::vec4 perPixelBidirectional(uint32_t x, uint32_t y, uint32_t sampleIndex, const FrameState& frame,
+										const SceneSnapshot& scene, SampleGenerator& sampler);
+
+		// A subpath vertex. The densities are per unit area so the strategies that could have made
+		// the same path can be compared.
+		struct BdptVertex {
+			glm::vec3 pos{ 0.0f };
+			glm::vec3 normal{ 0.0f };	// Outward from the sphere, unused for the camera
+			glm::vec3 wo{ 0.0f };		// Toward the previous vertex
+			glm::vec3 beta{ 0.0f };		// Throughput from the start of the subpath
+			uint32_t objIdx = 0;
+			bool isCamera = false;
+			bool isLight = false;		// The start of a light subpath, or a point sampled on an emitter
+			bool delta = false;
+			float pdfFwd = 0.0f;		// Of being sampled by its own subpath
+			float pdfRev = 0.0f;		// Of being sampled by a subpath from the other end
+		};
+
+		// Extends a subpath from path[0] until it escapes, is absorbed or reaches maxVertices, and
+		// returns the vertex count. If the last ray left the scene, escapedBeta is set to the
+		// throughput it carried and escapedDir to its direction.
+		int bdptRandomWalk(Ray ray, glm::vec3 beta, float pdfDir, const SceneSnapshot& scene, SampleGenerator& sampler,
+						   int maxVertices, BdptVertex* path, glm::vec3& escapedBeta, glm::vec3& escapedDir);
+		// Area density at next of v scattering toward it, having been reached from prev
+		float bdptPdf(const BdptVertex& v, const BdptVertex* prev, const BdptVertex& next, const FrameState& frame,
+					  const SceneSnapshot& scene) const;
+		// Area density of a light subpath starting at v
+		float bdptLightOriginPdf(const BdptVertex& v, const SceneSnapshot& scene) const;
+		// The power heuristic over every strategy that could have made the path of s light and t
+		// camera vertices. Temporarily overwrites the pdfs at the connection.
+		float bdptMisWeight(BdptVertex* lightPath, BdptVertex* cameraPath, int s, int t, const FrameState& frame,
+							const SceneSnapshot& scene);
+		glm::vec3 bdptEmitted(const BdptVertex& v, const glm::vec3& dir, const SceneSnapshot& scene) const;
+		bool bdptVisible(const BdptVertex& a, const BdptVertex& b, const SceneSnapshot& scene);
+
+		// Picks an emitter for a surface at pos facing normal and samples a direction toward it.
+		// Returns the emitted radiance if nothing blocks it, along with the direction and its solid
+		// angle pdf. Emitters are picked uniformly when lights is null.
+		glm::vec3 sampleEmitter(const glm::vec3& pos, const glm::vec3& normal, const SceneSnapshot& scene,
+								const LightBvh* lights, float uPick, const glm::vec2& uCone, glm::vec3& lightDir,
+								float& lightPdf, uint32_t* sampledLight = nullptr);
+
+		// Samples a direction from the environment map and returns its radiance if nothing blocks it
+		glm::vec3 sampleEnvironment(const glm::vec3& pos, const SceneSnapshot& scene, const EnvironmentMap& environment,
+									const glm::vec2& u, glm::vec3& lightDir, float& lightPdf);
+
+		// Solid angle pdf of sampleEmitter() choosing the direction toward a point on the sphere
+		float emitterPdf(const glm::vec3& pos, const glm::vec3& normal, uint32_t sphereIdx,
+						 const SceneSnapshot& scene, const LightBvh* lights) const;
+
+		HitData traceRay(const Ray& ray, const SceneSnapshot& scene);
+		HitData closestHit(const Ray& ray, float hitDistance, int objIdx, const SceneSnapshot& scene);
+		HitData miss(const Ray& ray);
 
 		float deltaTime_ = 0.0f;
 
@@ -73,17 +409,144 @@ namespace mtn {
 		ImGuiIO* imguiIO_ = nullptr;
 
 		std::unique_ptr<Texture2D> pFinalImage_ = nullptr;
+		// pImageData_ is written by the render thread, pPresentImageData_ holds the last finished
+		// frame until the main thread uploads it.
 		std::shared_ptr<uint32_t[]> pImageData_ = nullptr;
+		std::shared_ptr<uint32_t[]> pPresentImageData_ = nullptr;
+		bool imageReady_ = false;
 
 		bool accumulate_ = true;
-		std::unique_ptr<glm::vec4[]> pAccumulatedImageData_ = nullptr;
+		std::shared_ptr<glm::vec4[]> pAccumulatedImageData_ = nullptr;
+		// Welford's M2 of each pixel's luminance, for the adaptive sampling error estimate
+		std::shared_ptr<float[]> pVarianceData_ = nullptr;
+		// The accumulation of the view before the last camera move and the primary hits of both
+		// views, swapped at every restart
+		std::shared_ptr<glm::vec4[]> pHistoryImageData_ = nullptr;
+		std::shared_ptr<float[]> pHistoryVarianceData_ = nullptr;
+		std::shared_ptr<PrimaryHit[]> pPrimaryHits_ = nullptr;
+		std::shared_ptr<PrimaryHit[]> pHistoryHits_ = nullptr;
+		std::shared_ptr<const Camera> hitsCamera_;		// Null when pPrimaryHits_ isn't filled
+		std::shared_ptr<const Camera> accumulatedCamera_;	// View of the accumulation, null if it can't be reprojected
+		// History is rejected where the new hit is further than this fraction of its depth from the
+		// plane of the old one
+		const float REPROJECTION_TOLERANCE = 0.01f;
+		// Light subpaths connecting to the camera and Metropolis samples land on any pixel, so they're
+		// added atomically and scaled by the pixel count over splatPaths_ when resolved
+		std::shared_ptr<std::atomic<float>[]> pSplatData_ = nullptr;
+		std::atomic<uint64_t> splatPaths_{ 0 };
 
-		std::vector<uint32_t> imageHorizontalItr_, imageVerticalItr_;
+		std::vector<Tile> tiles_;
+		const uint32_t TILE_SIZE = 32;
+
+		// Trace -> Accumulate -> Resolve, rebuilt whenever the image is resized
+		FrameGraph frameGraph_;
+		FrameResource radianceBuffer_ = 0;
+		FrameResource accumulationBuffer_ = 0;
+		FrameResource displayBuffer_ = 0;
+		FrameResource varianceBuffer_ = 0;
+		FrameResource splatBuffer_ = 0;
+		FrameResource restirCandidateBuffer_ = 0;
+		FrameResource restirBuffer_ = 0;
+		FrameResource restirHistoryBuffer_ = 0;
+		std::string frameGraphReport_;		// Guarded by presentMutex_
 
 		glm::vec3 skyLight{ 0.6f, 0.75f, 1.0f };
 		glm::vec3 skyLightBrightness{ 1.0f };
 
+		// Main thread copy, published with the next frame state
+		std::shared_ptr<const EnvironmentMap> pEnvironment_ = nullptr;
+		char environmentPath_[260] = "";
+		std::string environmentStatus_ = "Constant sky";
+		// Rebuilt by publishFrameState() when the filter settings change
+		std::shared_ptr<const PixelFilter> pPixelFilter_ = nullptr;
+
+		// Only touched by the render thread
 		uint32_t frameIndex_ = 1;
+		uint32_t accumulatedGeneration_ = 0;
+		uint32_t accumulatedEpoch_ = 0;
+		float samplePassMs_ = 0.0f;		// Running estimate of the cost of one sample per pixel
+		const FrameState* pFrame_ = nullptr;
+		uint32_t samplesPerPixel_ = 1;
+		Clock::time_point deadline_;
+		const uint32_t MAX_SAMPLES_PER_FRAME = 256;
+
+		std::vector<SceneReplica> sceneReplicas_;	// One per node, empty when not NUMA aware
+		std::vector<uint8_t> tileConverged_;			// Written by the worker tracing each tile
+		std::vector<float> tileError_;					// Sum of the tile's per-pixel relative errors
+		float activeTileFraction_ = 1.0f;
+
+		// Statistics of the current generation, for the convergence monitor
+		uint64_t generationSamples_ = 0;
+		float generationRenderMs_ = 0.0f;
+		float imageError_ = 1.0f;
+
+		std::atomic<uint64_t> frameSamples_{ 0 };
+		std::atomic<uint32_t> samplesPerFrame_{ 1 };
+		std::atomic<uint32_t> convergedTiles_{ 0 };
+
+		// Convergence monitor readouts for the settings window
+		std::atomic<float> displayedError_{ 1.0f };
+		std::atomic<float> etaSeconds_{ -1.0f };
+		std::atomic<float> displayedSpp_{ 0.0f };
+		std::atomic<float> displayedSeconds_{ 0.0f };
+		std::atomic<StopReason> stopReason_{ StopReason::NONE };
+
+		// Learned from the paths of every frame while guiding is on. Reset when the scene or its
+		// lighting changes, which makes what was learned wrong.
+		PathGuide pathGuide_;
+		uint64_t guideSceneVersion_ = std::numeric_limits<uint64_t>::max();
+		std::shared_ptr<const EnvironmentMap> guideEnvironment_;
+		float guideEnvironmentIntensity_ = 0.0f;
+		std::atomic<uint32_t> guideIteration_{ 0 };
+		std::atomic<uint32_t> guideLeaves_{ 0 };
+		const float GUIDE_BSDF_FRACTION = 0.5f;		// Of guided bounces that sample the BSDF
+		std::string guidingComparisonResult_;	// Guarded by stateMutex_
+
+		// Kept across frames, and only invalidated where the scene changed since cacheScene_
+		RadianceCache radianceCache_;
+		std::shared_ptr<const SceneSnapshot> cacheScene_;
+		std::shared_ptr<const EnvironmentMap> cacheEnvironment_;
+		float cacheEnvironmentIntensity_ = 0.0f;
+		bool cacheSkylight_ = false;
+		std::atomic<uint32_t> cacheEntries_{ 0 };
+
+		// A new map every frame, gathered with a radius that shrinks from pass to pass
+		PhotonMap photonMap_;
+		uint32_t photonPass_ = 0;		// Reset with the accumulation
+		float photonRadius_ = 0.0f;
+		const float PHOTON_ALPHA = 2.0f / 3.0f;		// Fraction of the photons each pass keeps
+		std::atomic<uint32_t> photonCount_{ 0 };
+		std::atomic<float> photonMapMb_{ 0.0f };
+		std::atomic<float> displayedPhotonRadius_{ 0.0f };
+
+		// This frame's reservoirs and the last frame's, swapped every frame, along with the cameras
+		// that saw them. The history camera is null when there's nothing to reuse.
+		std::shared_ptr<RestirPixel[]> pReservoirs_ = nullptr;
+		std::shared_ptr<RestirPixel[]> pReservoirHistory_ = nullptr;
+		std::shared_ptr<const Camera> restirCamera_;
+		std::shared_ptr<const Camera> restirHistoryCamera_;
+		uint32_t restirFrame_ = 0;
+		const float RESTIR_MAX_HISTORY = 20.0f;		// Candidates a reprojected reservoir can stand for, per new one
+
+		struct MetropolisChain {
+			std::unique_ptr<MetropolisSampleGenerator> sampler;
+			glm::vec2 raster{ 0.0f };
+			glm::vec3 radiance{ 0.0f };
+			float luminance = 0.0f;		// The chain's target function
+		};
+
+		// Started from the bootstrap paths in proportion to their luminance, and restarted with the
+		// accumulation. The normalization is the bootstrap's mean luminance.
+		std::vector<MetropolisChain> metropolisChains_;
+		float metropolisNormalization_ = 0.0f;
+		std::atomic<uint64_t> metropolisProposed_{ 0 };
+		std::atomic<uint64_t> metropolisAccepted_{ 0 };
+
+		// Light subpaths and photons start on emitters in proportion to their power
+		AliasTable emitterTable_;
+		float emitterWeightSum_ = 0.0f;
+		uint64_t emitterTableVersion_ = std::numeric_limits<uint64_t>::max();
+
 		RendererSettings settings_;
 
 		Camera* pCamera_ = nullptr;
@@ -91,6 +554,41 @@ namespace mtn {
 
 		uint32_t viewportWidth_ = 0;
 		uint32_t viewportHeight_ = 0;
+		uint32_t imageWidth_ = 0;
+		uint32_t imageHeight_ = 0;
+
+		std::string numaBenchmarkResult_;	// Guarded by stateMutex_
+
+		// Builds the acceleration structures for published scene snapshots in the background
+		BvhBuilder bvhBuilder_;
+
+		// Node-pinned workers for tiles when NUMA aware, std::execution::par is used otherwise
+		WorkerPool workerPool_;
+
+		// Render thread synchronization
+		std::thread renderThread_;
+		CancellationToken cancelToken_;
+		std::mutex stateMutex_;			// Guards pendingFrame_, running_, pauseCount_ and the benchmarks
+		std::condition_variable stateCv_;
+		std::mutex frameMutex_;			// Held by the render thread for the duration of a frame
+		std::mutex presentMutex_;		// Guards pPresentImageData_ and imageReady_
+		FrameState pendingFrame_;
+		bool renderRequested_ = false;
+		bool running_ = true;
+		uint32_t pauseCount_ = 0;
+		bool restartPending_ = false;
+		Benchmark pendingBenchmark_ = Benchmark::NONE;
+		bool benchmarkRunning_ = false;
+		bool sceneDirty_ = false;
+		uint32_t historyEpoch_ = 0;
+
+		// Motion-to-pixel latency, measured from the last resetFrameIndex() call
+		Clock::time_point changeTime_ = Clock::now();
+		std::atomic<uint32_t> firstPixelGeneration_{ std::numeric_limits<uint32_t>::max() };
+		uint32_t presentedGeneration_ = std::numeric_limits<uint32_t>::max();
+		std::atomic<float> firstPixelLatencyMs_{ 0.0f };
+		std::atomic<float> firstFrameLatencyMs_{ 0.0f };
+		std::atomic<float> renderTimeMs_{ 0.0f };
 	};
 
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include "Restir.h"
+
+#include "Bsdf.h"
+
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace mtn {
+
+	float restirTarget(const RestirSurface& surface, const LightSample& sample, const SceneSnapshot& scene,
+					   glm::vec3* radiance) {
+		if (radiance) {
+			*radiance = glm::vec3(0.0f);
+		}
+		// Samples carried over from an older snapshot can point at spheres that changed since
+		if (surface.depth < 0.0f || sample.light >= scene.spheres.size()) {
+			return 0.0f;
+		}
+		const Sphere& light = scene.spheres[sample.light];
+		const Material& emitter = scene.materials[light.matIdx];
+		if (!emitter.isEmissive()) {
+			return 0.0f;
+		}
+
+		glm::vec3 toLight = light.pos + sample.normal * light.radius - surface.pos;
+		float distanceSq = glm::dot(toLight, toLight);
+		glm::vec3 dir = toLight / std::sqrt(distanceSq);
+		float lightCosine = -glm::dot(sample.normal, dir);
+		if (lightCosine <= 0.0f) {
+			return 0.0f;
+		}
+
+		const Material& material = scene.materials[scene.spheres[surface.objIdx].matIdx];
+		glm::vec3 value = Bsdf(material, surface.normal, surface.wo).evaluate(dir) * emitter.getEmission() *
+						  (lightCosine / distanceSq);
+		if (radiance) {
+			*radiance = value;
+		}
+		return glm::dot(value, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+	}
+
+	bool sampleLightPoint(const RestirSurface& surface, const SceneSnapshot& scene, const LightBvh* lights,
+						  float uPick, const glm::vec2& uCone, LightSample& sample, float& areaPdf) {
+		uint32_t lightIdx;
+		float pickPdf;
+		if (lights) {
+			if (!lights->sample(surface.pos, surface.normal, uPick, lightIdx, pickPdf)) {
+				return false;
+			}
+		}
+		else {
+			const std::vector<uint32_t>& emitters = scene.emissiveSpheres();
+			uint32_t pick = std::min((uint32_t)(uPick * emitters.size()), (uint32_t)emitters.size() - 1);
+			lightIdx = emitters[pick];
+			pickPdf = 1.0f / emitters.size();
+		}
+		const Sphere& light = scene.spheres[lightIdx];
+
+		glm::vec3 toCenter = light.pos - surface.pos;
+		float distanceSq = glm::dot(toCenter, toCenter);
+		float radiusSq = light.radius * light.radius;
+		if (distanceSq <= radiusSq) {
+			return false;
+		}
+
+		// The same uniform cone as sampleEmitter(), followed to where it meets the sphere
+		float sinThetaMaxSq = radiusSq / distanceSq;
+		float coneSize = sinThetaMaxSq / (1.0f + std::sqrt(1.0f - sinThetaMaxSq));
+		float cosTheta = 1.0f - uCone.x * coneSize;
+		float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+		float phi = uCone.y * glm::two_pi<float>();
+
+		glm::vec3 axis = toCenter / std::sqrt(distanceSq);
+		glm::vec3 tangent, bitangent;
+		makeBasis(axis, tangent, bitangent);
+		Ray ray;
+		ray.origin = surface.pos;
+		ray.dir = glm::normalize(sinTheta * (std::cos(phi) * tangent + std::sin(phi) * bitangent) + cosTheta * axis);
+		float t = light.intersect(ray);
+		if (t <= 0.0f) {
+			return false;
+		}
+
+		glm::vec3 point = ray.origin + ray.dir * t;
+		sample.light = lightIdx;
+		sample.normal = glm::normalize(point - light.pos);
+		float lightCosine = -glm::dot(sample.normal, ray.dir);
+		if (lightCosine <= 0.0f) {
+			return false;
+		}
+		areaPdf = pickPdf / (glm::two_pi<float>() * coneSize) * lightCosine / (t * t);
+		return true;
+	}
+
+	bool similarSurfaces(const RestirSurface& a, const RestirSurface& b) {
+		return a.depth >= 0.0f && b.depth >= 0.0f && glm::dot(a.normal, b.normal) > 0.9f &&
+			   std::abs(a.depth - b.depth) < 0.1f * a.depth;
+	}
+
+	Reservoir combineReservoirs(const RestirSurface& surface, const RestirPixel* const* sources, const float* counts,
+								uint32_t sourceCount, const SceneSnapshot& scene, SampleGenerator& sampler) {
+		// Each reservoir's sample is weighted by its target here times its contribution weight there
+		Reservoir combined;
+		for (uint32_t i = 0; i < sourceCount; ++i) {
+			const Reservoir& source = sources[i]->reservoir;
+			float target = source.weight > 0.0f ? restirTarget(surface, source.sample, scene) : 0.0f;
+			combined.update(source.sample, target * source.weight * counts[i], target, sampler.get1D());
+			combined.count += counts[i];
+		}
+		if (combined.targetPdf <= 0.0f) {
+			return combined;
+		}
+
+		// Only the sources whose surfaces could have found the sample count toward its normalization
+		float supported = 0.0f;
+		for (uint32_t i = 0; i < sourceCount; ++i) {
+			if (i == 0 || restirTarget(sources[i]->surface, combined.sample, scene) > 0.0f) {
+				supported += counts[i];
+			}
+		}
+		combined.weight = combined.weightSum / (supported * combined.targetPdf);
+		return combined;
+	}
+
+}
\ No newline at end of file
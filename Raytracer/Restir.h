@@ -0,0 +1,74 @@
+#pragma once
+
+#include "LightBvh.h"
+#include "SampleGenerator.h"
+#include "Scene.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+
+namespace mtn {
+
+	// A point on an emissive sphere, kept as the sphere and the outward normal there so any surface
+	// can evaluate it
+	struct LightSample {
+		uint32_t light = 0;
+		glm::vec3 normal{ 0.0f, 0.0f, 1.0f };
+	};
+
+	// Weighted reservoir sampling of light samples, as in ReSTIR (Bitterli et al. 2020)
+	struct Reservoir {
+		LightSample sample;
+		float weightSum = 0.0f;
+		float count = 0.0f;			// M, the candidates it stands for
+		float weight = 0.0f;		// W, the sample's unbiased contribution weight per unit area
+		float targetPdf = 0.0f;		// Of the sample, at the surface the reservoir belongs to
+
+		// Keeps the candidate with probability candidateWeight over the new weight sum. The caller
+		// adds the candidates it stands for to count.
+		inline bool update(const LightSample& candidate, float candidateWeight, float candidateTarget, float u) {
+			weightSum += candidateWeight;
+			if (candidateWeight <= 0.0f || u * weightSum >= candidateWeight) {
+				return false;
+			}
+			sample = candidate;
+			targetPdf = candidateTarget;
+			return true;
+		}
+	};
+
+	// The first hit of a pixel's center ray, which its reservoir lights
+	struct RestirSurface {
+		glm::vec3 pos{ 0.0f };
+		glm::vec3 normal{ 0.0f };	// Facing wo
+		glm::vec3 wo{ 0.0f };
+		float depth = -1.0f;		// Negative when the ray missed or hit a delta BSDF
+		uint32_t objIdx = 0;
+	};
+
+	struct RestirPixel {
+		RestirSurface surface;
+		Reservoir reservoir;
+	};
+
+	// Unshadowed luminance the sample sends off the surface toward wo, f * Le * cos / d^2, which is
+	// what the reservoirs resample toward. If radiance isn't null it's set to the full color.
+	float restirTarget(const RestirSurface& surface, const LightSample& sample, const SceneSnapshot& scene,
+					   glm::vec3* radiance = nullptr);
+
+	// Picks an emitter and a direction toward it the way sampleEmitter() does, and returns the point
+	// the direction reaches with its density per unit area. No shadow ray is traced.
+	bool sampleLightPoint(const RestirSurface& surface, const SceneSnapshot& scene, const LightBvh* lights,
+						  float uPick, const glm::vec2& uCone, LightSample& sample, float& areaPdf);
+
+	// Neighbouring reservoirs are only reused from surfaces at about the same depth and orientation
+	bool similarSurfaces(const RestirSurface& a, const RestirSurface& b);
+
+	// Resamples the reservoirs of sources into one for surface, sources[0] being its own. Each source
+	// stands for counts[i] candidates. The sample's weight is normalized by the candidates of the
+	// sources that could have produced it, which keeps the result unbiased.
+	Reservoir combineReservoirs(const RestirSurface& surface, const RestirPixel* const* sources, const float* counts,
+								uint32_t sourceCount, const SceneSnapshot& scene, SampleGenerator& sampler);
+
+}
\ No newline at end of file
@@ -0,0 +1,373 @@
+#include "SampleGenerator.h"
+
+#include "Logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+namespace mtn {
+
+	namespace {
+
+		// lowbias32 from Chris Wellons' hash prospector
+		inline uint32_t hash(uint32_t x) {
+			x ^= x >> 16;
+			x *= 0x7feb352du;
+			x ^= x >> 15;
+			x *= 0x846ca68bu;
+			x ^= x >> 16;
+			return x;
+		}
+
+		inline uint32_t hashCombine(uint32_t seed, uint32_t v) {
+			return hash(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+		}
+
+		// Keeps the top 24 bits so the result is strictly below 1
+		inline float toUnitFloat(uint32_t x) {
+			return (x >> 8) * (1.0f / 16777216.0f);
+		}
+
+		inline uint32_t reverseBits(uint32_t x) {
+			x = (x << 16) | (x >> 16);
+			x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+			x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+			x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+			x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+			return x;
+		}
+
+		// Burley's hash-based nested uniform scramble, an Owen scramble that only needs a seed
+		inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+			x = reverseBits(x);
+			x += seed;
+			x ^= x * 0x6c50b47cu;
+			x ^= x * 0xb82f1e52u;
+			x ^= x * 0xc7afe638u;
+			x ^= x * 0x8d22f6e6u;
+			return reverseBits(x);
+		}
+
+		// Generator matrices for the first two Sobol dimensions: the van der Corput sequence and
+		// Joe and Kuo's second dimension (s = 1, a = 0, m = 1)
+		struct SobolMatrices {
+			uint32_t v[2][32];
+
+			SobolMatrices() {
+				for (uint32_t k = 0; k < 32; ++k) {
+					v[0][k] = 1u << (31 - k);
+					v[1][k] = k == 0 ? (1u << 31) : (v[1][k - 1] ^ (v[1][k - 1] >> 1));
+				}
+			}
+		};
+
+		inline uint32_t sobol(uint32_t index, uint32_t dimension) {
+			static const SobolMatrices matrices;
+
+			uint32_t result = 0;
+			for (uint32_t k = 0; index; index >>= 1, ++k) {
+				if (index & 1) {
+					result ^= matrices.v[dimension][k];
+				}
+			}
+			return result;
+		}
+
+		const uint32_t PRIMES[HaltonSampleGenerator::PRIME_COUNT] = {
+			2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+			59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+		};
+
+		float radicalInverse(uint32_t base, uint32_t index) {
+			float inverseBase = 1.0f / base;
+			float scale = inverseBase;
+			float result = 0.0f;
+			while (index > 0) {
+				result += (index % base) * scale;
+				index /= base;
+				scale *= inverseBase;
+			}
+			return std::min(result, 0.99999994f);
+		}
+
+		// Ulichney's void-and-cluster method with a Gaussian energy filter on a torus. Returns the
+		// rank of every pixel, remapped to [0, 1).
+		std::vector<float> generateBlueNoise(uint32_t size) {
+			auto startTime = std::chrono::steady_clock::now();
+
+			const uint32_t count = size * size;
+			const float SIGMA = 1.5f;
+
+			// Energy a point at the origin adds to every offset, wrapping around the torus
+			std::vector<float> kernel(count);
+			for (uint32_t y = 0; y < size; ++y) {
+				for (uint32_t x = 0; x < size; ++x) {
+					float dx = (float)std::min(x, size - x);
+					float dy = (float)std::min(y, size - y);
+					kernel[x + y * size] = std::exp(-(dx * dx + dy * dy) / (2.0f * SIGMA * SIGMA));
+				}
+			}
+
+			std::vector<uint8_t> pattern(count, 0);
+			std::vector<float> energy(count, 0.0f);
+			auto splat = [&](uint32_t p, float sign) {
+				uint32_t px = p % size, py = p / size;
+				for (uint32_t y = 0; y < size; ++y) {
+					const float* row = &kernel[((y + size - py) % size) * size];
+					for (uint32_t x = 0; x < size; ++x) {
+						energy[x + y * size] += sign * row[(x + size - px) % size];
+					}
+				}
+			};
+			auto tightestCluster = [&]() {
+				uint32_t best = 0;
+				float bestEnergy = -1.0f;
+				for (uint32_t p = 0; p < count; ++p) {
+					if (pattern[p] && energy[p] > bestEnergy) {
+						bestEnergy = energy[p];
+						best = p;
+					}
+				}
+				return best;
+			};
+			auto largestVoid = [&]() {
+				uint32_t best = 0;
+				float bestEnergy = std::numeric_limits<float>::max();
+				for (uint32_t p = 0; p < count; ++p) {
+					if (!pattern[p] && energy[p] < bestEnergy) {
+						bestEnergy = energy[p];
+						best = p;
+					}
+				}
+				return best;
+			};
+
+			// Initial pattern: a tenth of the pixels at random, relaxed until moving the tightest
+			// cluster into the largest void doesn't change anything
+			uint32_t seed = 1;
+			uint32_t initialCount = count / 10;
+			for (uint32_t placed = 0; placed < initialCount;) {
+				seed = hash(seed);
+				uint32_t p = seed % count;
+				if (!pattern[p]) {
+					pattern[p] = 1;
+					splat(p, 1.0f);
+					++placed;
+				}
+			}
+			for (uint32_t iteration = 0; iteration < count; ++iteration) {
+				uint32_t cluster = tightestCluster();
+				pattern[cluster] = 0;
+				splat(cluster, -1.0f);
+
+				uint32_t hole = largestVoid();
+				pattern[hole] = 1;
+				splat(hole, 1.0f);
+				if (hole == cluster) {
+					break;
+				}
+			}
+
+			std::vector<uint32_t> rank(count, 0);
+			std::vector<uint8_t> initialPattern = pattern;
+			std::vector<float> initialEnergy = energy;
+
+			// Phase 1: rank the initial points by removing tightest clusters
+			for (uint32_t r = initialCount; r-- > 0;) {
+				uint32_t cluster = tightestCluster();
+				pattern[cluster] = 0;
+				splat(cluster, -1.0f);
+				rank[cluster] = r;
+			}
+
+			// Phases 2 and 3: fill the largest voids. With a Gaussian filter on a torus the tightest
+			// cluster of the inverted pattern is also the largest void, so one loop covers both.
+			pattern = initialPattern;
+			energy = initialEnergy;
+			for (uint32_t r = initialCount; r < count; ++r) {
+				uint32_t hole = largestVoid();
+				pattern[hole] = 1;
+				splat(hole, 1.0f);
+				rank[hole] = r;
+			}
+
+			std::vector<float> mask(count);
+			for (uint32_t p = 0; p < count; ++p) {
+				mask[p] = (rank[p] + 0.5f) / count;
+			}
+
+			float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+			Logger::debug("Generated {0}x{0} blue noise mask in {1:.1f}ms", size, ms);
+			return mask;
+		}
+
+		const std::vector<float>& blueNoiseMask() {
+			static const std::vector<float> mask = generateBlueNoise(BlueNoiseSampleGenerator::MASK_SIZE);
+			return mask;
+		}
+
+	}
+
+	void SobolSampleGenerator::startSample(uint32_t x, uint32_t y, uint32_t sampleIndex) {
+		pixelSeed_ = hashCombine(hash(x), y);
+		index_ = sampleIndex > 0 ? sampleIndex - 1 : 0;
+		dimension_ = 0;
+	}
+
+	float SobolSampleGenerator::get1D() {
+		uint32_t seed = hashCombine(pixelSeed_, dimension_++);
+		uint32_t index = nestedUniformScramble(index_, hash(seed));
+		return toUnitFloat(nestedUniformScramble(sobol(index, 0), hashCombine(seed, 0)));
+	}
+
+	glm::vec2 SobolSampleGenerator::get2D() {
+		uint32_t seed = hashCombine(pixelSeed_, dimension_++);
+		// Both components share the index shuffle so the pair stays a (0, 2)-sequence
+		uint32_t index = nestedUniformScramble(index_, hash(seed));
+		return glm::vec2(toUnitFloat(nestedUniformScramble(sobol(index, 0), hashCombine(seed, 0))),
+						 toUnitFloat(nestedUniformScramble(sobol(index, 1), hashCombine(seed, 1))));
+	}
+
+	void HaltonSampleGenerator::startSample(uint32_t x, uint32_t y, uint32_t sampleIndex) {
+		pixelSeed_ = hashCombine(hash(x), y);
+		index_ = sampleIndex;
+		dimension_ = 0;
+	}
+
+	float HaltonSampleGenerator::dimension() {
+		uint32_t d = dimension_++;
+		uint32_t shiftSeed = hashCombine(pixelSeed_, d);
+		if (d >= PRIME_COUNT) {
+			return toUnitFloat(hashCombine(shiftSeed, index_));
+		}
+
+		// Cranley-Patterson rotation decorrelates neighbouring pixels
+		float u = radicalInverse(PRIMES[d], index_) + toUnitFloat(shiftSeed);
+		return u >= 1.0f ? u - 1.0f : u;
+	}
+
+	float HaltonSampleGenerator::get1D() {
+		return dimension();
+	}
+
+	glm::vec2 HaltonSampleGenerator::get2D() {
+		float u = dimension();
+		return glm::vec2(u, dimension());
+	}
+
+	BlueNoiseSampleGenerator::BlueNoiseSampleGenerator() : mask_(blueNoiseMask()) {}
+
+	void BlueNoiseSampleGenerator::startSample(uint32_t x, uint32_t y, uint32_t sampleIndex) {
+		x_ = x;
+		y_ = y;
+		sampleIndex_ = sampleIndex;
+		dimension_ = 0;
+	}
+
+	float BlueNoiseSampleGenerator::dimension() {
+		// Every dimension reads the mask at its own toroidal offset
+		uint32_t offset = hash(dimension_++);
+		uint32_t x = (x_ + offset) % MASK_SIZE;
+		uint32_t y = (y_ + (offset >> 16)) % MASK_SIZE;
+
+		// The golden ratio sequence in 32 bit fixed point, so it stays precise for any sample count
+		const uint32_t GOLDEN_RATIO_CONJUGATE = 2654435769u;
+		float u = mask_[x + y * MASK_SIZE] + toUnitFloat(sampleIndex_ * GOLDEN_RATIO_CONJUGATE);
+		return u >= 1.0f ? u - 1.0f : u;
+	}
+
+	float BlueNoiseSampleGenerator::get1D() {
+		return dimension();
+	}
+
+	glm::vec2 BlueNoiseSampleGenerator::get2D() {
+		float u = dimension();
+		return glm::vec2(u, dimension());
+	}
+
+	MetropolisSampleGenerator::MetropolisSampleGenerator(uint32_t seed, float sigma, float largeStepProbability)
+		: rng_(seed), sigma_(sigma), largeStepProbability_(largeStepProbability) {}
+
+	void MetropolisSampleGenerator::startSample(uint32_t, uint32_t, uint32_t) {
+		dimension_ = 0;
+	}
+
+	float MetropolisSampleGenerator::uniform() {
+		return toUnitFloat(rng_());
+	}
+
+	void MetropolisSampleGenerator::startIteration() {
+		++iteration_;
+		largeStep_ = uniform() < largeStepProbability_;
+	}
+
+	void MetropolisSampleGenerator::accept() {
+		if (largeStep_) {
+			lastLargeStep_ = iteration_;
+		}
+	}
+
+	void MetropolisSampleGenerator::reject() {
+		for (PrimarySample& sample : samples_) {
+			if (sample.lastModification == iteration_) {
+				sample.value = sample.valueBackup;
+				sample.lastModification = sample.modificationBackup;
+			}
+		}
+		--iteration_;
+	}
+
+	void MetropolisSampleGenerator::ensureReady(uint32_t dimension) {
+		if (dimension >= samples_.size()) {
+			samples_.resize(dimension + 1);
+		}
+		PrimarySample& sample = samples_[dimension];
+
+		// A dimension no path has read since the last accepted large step would have been replaced
+		// by it, so it starts from a fresh value taken then
+		if (sample.lastModification < lastLargeStep_) {
+			sample.value = uniform();
+			sample.lastModification = lastLargeStep_;
+		}
+
+		sample.valueBackup = sample.value;
+		sample.modificationBackup = sample.lastModification;
+		if (largeStep_) {
+			sample.value = uniform();
+		}
+		else {
+			// The small steps it missed while unused add up to one with their combined variance
+			float spread = sigma_ * std::sqrt((float)(iteration_ - sample.lastModification));
+			sample.value += std::normal_distribution<float>(0.0f, spread)(rng_);
+			// Wrapped around, which can round up to 1 for values just below 0
+			sample.value = std::min(sample.value - std::floor(sample.value), 0.99999994f);
+		}
+		sample.lastModification = iteration_;
+	}
+
+	float MetropolisSampleGenerator::get1D() {
+		// Each dimension is only mutated by the first read of an iteration
+		uint32_t dimension = dimension_++;
+		if (samples_.size() <= dimension || samples_[dimension].lastModification != iteration_) {
+			ensureReady(dimension);
+		}
+		return samples_[dimension].value;
+	}
+
+	glm::vec2 MetropolisSampleGenerator::get2D() {
+		float u = get1D();
+		return glm::vec2(u, get1D());
+	}
+
+	std::unique_ptr<SampleGenerator> createSampleGenerator(SampleSequence sequence) {
+		switch (sequence) {
+			case SampleSequence::SOBOL: return std::make_unique<SobolSampleGenerator>();
+			case SampleSequence::HALTON: return std::make_unique<HaltonSampleGenerator>();
+			case SampleSequence::BLUE_NOISE: return std::make_unique<BlueNoiseSampleGenerator>();
+			default: return std::make_unique<PcgSampleGenerator>();
+		}
+	}
+
+}
\ No newline at end of file
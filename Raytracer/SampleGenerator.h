@@ -0,0 +1,149 @@
+#pragma once
+
+#include "Random.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace mtn {
+
+	enum class SampleSequence : int {
+		PCG = 0,		// White noise
+		SOBOL,			// Owen-scrambled Sobol (Burley 2020)
+		HALTON,			// Halton with a per-pixel random shift
+		BLUE_NOISE		// Blue noise mask, animated per sample along the golden ratio sequence
+	};
+
+	// Source of the random numbers that drive a path. Every call takes the next dimension of the
+	// current sample, so the integrator draws a fixed set of dimensions per bounce to keep each
+	// dimension tied to the same decision on every path.
+	class SampleGenerator {
+	public:
+		virtual ~SampleGenerator() = default;
+
+		// Starts the sampleIndex-th sample of a pixel at dimension 0
+		virtual void startSample(uint32_t x, uint32_t y, uint32_t sampleIndex) = 0;
+		virtual float get1D() = 0;
+		virtual glm::vec2 get2D() = 0;
+	};
+
+	// Independent white noise from the PCG hash
+	class PcgSampleGenerator : public SampleGenerator {
+	public:
+		void startSample(uint32_t x, uint32_t y, uint32_t sampleIndex) override {
+			seed_ = (x * 1973u + y * 9277u + sampleIndex * 26699u) | 1u;
+		}
+
+		float get1D() override { return Random::rFloat(seed_); }
+		glm::vec2 get2D() override {
+			float u = Random::rFloat(seed_);
+			return glm::vec2(u, Random::rFloat(seed_));
+		}
+
+	private:
+		uint32_t seed_ = 1;
+	};
+
+	// Each get1D()/get2D() call is its own padded dimension: a fresh 1D or 2D Sobol point set
+	// with its own index shuffle and scramble, so 2D draws keep their stratification.
+	class SobolSampleGenerator : public SampleGenerator {
+	public:
+		void startSample(uint32_t x, uint32_t y, uint32_t sampleIndex) override;
+		float get1D() override;
+		glm::vec2 get2D() override;
+
+	private:
+		uint32_t pixelSeed_ = 0;
+		uint32_t index_ = 0;
+		uint32_t dimension_ = 0;
+	};
+
+	// Radical inverses in the first PRIME_COUNT prime bases, falling back to hashed white noise
+	// for deeper dimensions where high bases correlate badly
+	class HaltonSampleGenerator : public SampleGenerator {
+	public:
+		void startSample(uint32_t x, uint32_t y, uint32_t sampleIndex) override;
+		float get1D() override;
+		glm::vec2 get2D() override;
+
+		static const uint32_t PRIME_COUNT = 32;
+
+	private:
+		float dimension();
+
+		uint32_t pixelSeed_ = 0;
+		uint32_t index_ = 0;
+		uint32_t dimension_ = 0;
+	};
+
+	// A void-and-cluster blue noise mask, offset per dimension and shifted by the golden ratio per
+	// sample, so error is blue in screen space and well spread over consecutive samples
+	class BlueNoiseSampleGenerator : public SampleGenerator {
+	public:
+		BlueNoiseSampleGenerator();
+
+		void startSample(uint32_t x, uint32_t y, uint32_t sampleIndex) override;
+		float get1D() override;
+		glm::vec2 get2D() override;
+
+		static const uint32_t MASK_SIZE = 64;
+
+	private:
+		float dimension();
+
+		const std::vector<float>& mask_;
+		uint32_t x_ = 0, y_ = 0;
+		uint32_t sampleIndex_ = 0;
+		uint32_t dimension_ = 0;
+	};
+
+	// Primary sample space for Metropolis light transport (Kelemen et al. 2002). A path is a function
+	// of the vector of every number it draws, so the vector is kept and mutated instead of drawn
+	// anew. Dimensions are added and mutated lazily, when a path first reads them after a mutation.
+	class MetropolisSampleGenerator : public SampleGenerator {
+	public:
+		// The vector before the first iteration is a large step, so the same seed makes the same path
+		MetropolisSampleGenerator(uint32_t seed, float sigma, float largeStepProbability);
+
+		// Restarts the path at dimension 0. The arguments are ignored, since the pixel is a dimension.
+		void startSample(uint32_t x, uint32_t y, uint32_t sampleIndex) override;
+		float get1D() override;
+		glm::vec2 get2D() override;
+
+		// Proposes either a small Gaussian perturbation of every dimension or, with the large step
+		// probability, a new independent vector
+		void startIteration();
+		void accept();
+		// Restores the dimensions the proposal changed
+		void reject();
+
+		// Independent of the vector, for the chain's acceptance decisions
+		float uniform();
+
+	private:
+		struct PrimarySample {
+			float value = 0.0f;
+			int64_t lastModification = -1;	// Iteration it was last mutated in, -1 before its first use
+			float valueBackup = 0.0f;
+			int64_t modificationBackup = -1;
+		};
+
+		void ensureReady(uint32_t dimension);
+
+		std::vector<PrimarySample> samples_;
+		std::mt19937 rng_;
+		float sigma_;
+		float largeStepProbability_;
+		int64_t iteration_ = 0;
+		int64_t lastLargeStep_ = 0;
+		bool largeStep_ = true;
+		uint32_t dimension_ = 0;
+	};
+
+	std::unique_ptr<SampleGenerator> createSampleGenerator(SampleSequence sequence);
+
+}
\ No newline at end of file
@@ -1,7 +1,13 @@
 #pragma once
 
+#include "CowVector.h"
+#include "Ray.h"
+
 #include <glm/glm.hpp>
 
+#include <algorithm>
+#include <memory>
+#include <string>
 #include <vector>
 
 enum class MaterialType : int {
@@ -31,6 +37,9 @@ public:
 	inline const static float RI_DIAMOND = 2.417f;
 
 	glm::vec3 getEmission() const { return emissionColor * emissionStrength; }
+	inline bool isEmissive() const {
+		return emissionStrength > 0.0f && glm::max(glm::max(emissionColor.r, emissionColor.g), emissionColor.b) > 0.0f;
+	}
 
 	inline uint32_t getId() const { return id_; }
 
@@ -49,14 +58,107 @@ public:
 
 	inline uint32_t getId() const { return id_; }
 
+	/*
+	* Ray intersection formula (for a circle at (0,0), for simplicity):
+	* Simply the equation for a point on a ray (a_xy + b_xy*t) plugged into the quadratic
+	* equation (x^2 + y^2 + z^2 - r^2 = 0)
+	*
+	* (b_x^2 + b_y^2)t^2 + (2(a_x*b_x + a_y*b_y))t + (a_x^2 + a_y^2 - r^2) = 0
+	* at^2 + 2bt + c = 0
+	*
+	* a = ray origin
+	* b = ray direction
+	* r = radius
+	* t = hit distance
+	*
+	* Returns the distance to the nearest hit in front of the origin, or a negative value if there
+	* is none.
+	*/
+	inline float intersect(const Ray& ray) const {
+		// Shifting the origin effectively moves the sphere into position
+		glm::vec3 origin = ray.origin - pos;
+
+		float a = glm::dot(ray.dir, ray.dir);
+		float halfB = glm::dot(origin, ray.dir);
+		float c = glm::dot(origin, origin) - (radius * radius);
+
+		// Use the discriminant to check if there is an intersection
+		float discriminant = (halfB * halfB) - (a * c);
+		if (discriminant < 0) {
+			return -1.0f;
+		}
+
+		float root = sqrt(discriminant);
+		float closestT = (-halfB - root) / a;
+		// From inside the sphere the near hit is behind the origin, and the exit is the hit
+		if (closestT <= 1e-8f) {
+			closestT = (-halfB + root) / a;
+		}
+		// closestT > 0 prevents redrawing spheres that don't actually exist
+		return closestT > 1e-8f ? closestT : -1.0f;
+	}
+
 private:
 	uint32_t id_ = 0;
 	inline static uint32_t nextId_ = 0;
 };
 
+namespace mtn {
+	class SceneAcceleration;
+}
+
+// Immutable, versioned copy of a Scene for the render thread. The arrays share their chunks with
+// the Scene they were taken from until the editor changes them.
+struct SceneSnapshot {
+	uint64_t version = 0;
+
+	mtn::CowVector<Sphere> spheres;
+	mtn::CowVector<Material> materials;
+
+	// Spheres edited since the previous snapshot, so acceleration structures can be reused
+	std::vector<uint32_t> changedSpheres;
+	// Spheres with an emissive material, for sampling lights directly. Shared with the Scene and
+	// every other snapshot taken while the set of emitters stayed the same.
+	std::shared_ptr<const std::vector<uint32_t>> emitterList;
+	// Filled in by the BvhBuilder after the snapshot is published
+	std::shared_ptr<mtn::SceneAcceleration> acceleration;
+
+	inline const std::vector<uint32_t>& emissiveSpheres() const {
+		static const std::vector<uint32_t> none;
+		return emitterList ? *emitterList : none;
+	}
+};
+
+// The editor's staging copy of the scene. Use editSphere()/editMaterial() to change elements
+// so snapshots that are still being rendered keep their own version and the emitter list keeps up.
 struct Scene {
-	std::vector<Sphere> spheres;
-	std::vector<Material> materials;
+	mtn::CowVector<Sphere> spheres;
+	mtn::CowVector<Material> materials;
+
+	Sphere& editSphere(size_t i) {
+		changedSpheres_.push_back((uint32_t)i);
+		return spheres.edit(i);
+	}
+
+	Material& editMaterial(size_t i) {
+		changedMaterials_.push_back((uint32_t)i);
+		return materials.edit(i);
+	}
+
+	// Copies the chunk pointers and shares the emitter list, and only looks at the spheres edited
+	// or added since the last snapshot, so this is cheap enough to call after every edit
+	std::shared_ptr<SceneSnapshot> snapshot() {
+		std::shared_ptr<SceneSnapshot> snap = std::make_shared<SceneSnapshot>();
+		snap->version = ++version_;
+		snap->spheres = spheres;
+		snap->materials = materials;
+		snap->changedSpheres = std::move(changedSpheres_);
+		changedSpheres_.clear();
+
+		updateEmitters(snap->changedSpheres);
+		snap->emitterList = emitterList_;
+		return snap;
+	}
 
 	inline const std::vector<std::string>& getIdStrList() { return idList_; }
 	inline const std::vector<std::string>& getMatStrList() { return matList_; }
@@ -65,8 +167,8 @@ struct Scene {
 		idList_.clear();
 		idList_.reserve(spheres.size());
 
-		for (const Sphere& sphere : spheres) {
-			idList_.push_back(std::to_string(sphere.getId()));
+		for (size_t i = 0; i < spheres.size(); ++i) {
+			idList_.push_back(std::to_string(spheres[i].getId()));
 		}
 	}
 
@@ -74,12 +176,85 @@ struct Scene {
 		matList_.clear();
 		matList_.reserve(materials.size());
 
-		for (const Material& mat : materials) {
-			matList_.push_back(mat.name);
+		for (size_t i = 0; i < materials.size(); ++i) {
+			matList_.push_back(materials[i].name);
 		}
 	}
 
 private:
+	// Rechecks the edited and added spheres, and copies the emitter list only if one of them
+	// started or stopped emitting. A material that starts or stops emitting can change any sphere,
+	// so that rare edit rechecks them all.
+	void updateEmitters(const std::vector<uint32_t>& changedSpheres) {
+		bool materialFlipped = false;
+		size_t knownMaterials = materialEmissive_.size();
+		materialEmissive_.resize(materials.size(), 0);
+		for (size_t i = knownMaterials; i < materials.size(); ++i) {
+			changedMaterials_.push_back((uint32_t)i);
+		}
+		for (uint32_t m : changedMaterials_) {
+			uint8_t emissive = materials[m].isEmissive() ? 1 : 0;
+			materialFlipped |= emissive != materialEmissive_[m];
+			materialEmissive_[m] = emissive;
+		}
+		changedMaterials_.clear();
+
+		size_t knownSpheres = sphereEmissive_.size();
+		sphereEmissive_.resize(spheres.size(), 0);
+		std::vector<uint32_t> added;
+		bool removed = false;
+		auto recheck = [&](size_t i) {
+			uint8_t emissive = materialEmissive_[spheres[i].matIdx];
+			if (emissive != sphereEmissive_[i]) {
+				sphereEmissive_[i] = emissive;
+				if (emissive) {
+					added.push_back((uint32_t)i);
+				}
+				else {
+					removed = true;
+				}
+			}
+		};
+		if (materialFlipped) {
+			for (size_t i = 0; i < spheres.size(); ++i) {
+				recheck(i);
+			}
+		}
+		else {
+			for (uint32_t i : changedSpheres) {
+				recheck(i);
+			}
+			for (size_t i = knownSpheres; i < spheres.size(); ++i) {
+				recheck(i);
+			}
+		}
+		if (added.empty() && !removed && emitterList_) {
+			return;
+		}
+
+		// Snapshots still holding the old list keep it
+		std::shared_ptr<std::vector<uint32_t>> list = std::make_shared<std::vector<uint32_t>>();
+		if (emitterList_) {
+			for (uint32_t i : *emitterList_) {
+				if (sphereEmissive_[i]) {
+					list->push_back(i);
+				}
+			}
+		}
+		list->insert(list->end(), added.begin(), added.end());
+		std::sort(list->begin(), list->end());
+		emitterList_ = list;
+	}
+
+	uint64_t version_ = 0;
+	std::vector<uint32_t> changedSpheres_;
+	std::vector<uint32_t> changedMaterials_;
+
+	// Whether each sphere and material emitted at the last snapshot
+	std::vector<uint8_t> sphereEmissive_;
+	std::vector<uint8_t> materialEmissive_;
+	std::shared_ptr<const std::vector<uint32_t>> emitterList_;
+
 	std::vector<std::string> idList_;
 	std::vector<std::string> matList_;
 };
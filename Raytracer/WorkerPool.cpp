@@ -0,0 +1,103 @@
+#include "WorkerPool.h"
+
+#include "Logger.h"
+#include "Numa.h"
+
+#include <algorithm>
+
+namespace mtn {
+
+	WorkerPool::WorkerPool() {
+		for (uint32_t node = 0; node < numa::nodeCount(); ++node) {
+			if (numa::processorCount(node) > 0) {
+				nodes_.push_back(node);
+			}
+		}
+		if (nodes_.empty()) {
+			nodes_.push_back(0);
+		}
+		ranges_ = std::make_unique<Range[]>(nodes_.size());
+
+		for (uint32_t group = 0; group < nodes_.size(); ++group) {
+			uint32_t processors = std::max(numa::processorCount(nodes_[group]), 1u);
+			for (uint32_t i = 0; i < processors; ++i) {
+				workers_.emplace_back(&WorkerPool::workerLoop, this, group);
+			}
+		}
+
+		Logger::info("Started {} workers on {} NUMA node(s)", workers_.size(), nodes_.size());
+	}
+
+	WorkerPool::~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			running_ = false;
+		}
+		workCv_.notify_all();
+
+		for (std::thread& worker : workers_) {
+			worker.join();
+		}
+	}
+
+	void WorkerPool::run(uint32_t count, const std::function<void(uint32_t, uint32_t)>& fn, bool steal) {
+		std::unique_lock<std::mutex> lock(mutex_);
+
+		// Contiguous ranges keep each node's items, and the memory they touch, together
+		uint32_t groups = nodeCount();
+		for (uint32_t group = 0; group < groups; ++group) {
+			ranges_[group].next.store((uint32_t)((uint64_t)count * group / groups), std::memory_order_relaxed);
+			ranges_[group].end = (uint32_t)((uint64_t)count * (group + 1) / groups);
+		}
+		pFn_ = &fn;
+		steal_ = steal;
+		busyWorkers_ = (uint32_t)workers_.size();
+		++job_;
+
+		workCv_.notify_all();
+		doneCv_.wait(lock, [this]() { return busyWorkers_ == 0; });
+		pFn_ = nullptr;
+	}
+
+	void WorkerPool::runOnEachNode(const std::function<void(uint32_t)>& fn) {
+		// With one item per node and no stealing, each node's item runs on one of its own workers
+		run(nodeCount(), [&fn](uint32_t, uint32_t node) { fn(node); }, false);
+	}
+
+	void WorkerPool::workerLoop(uint32_t node) {
+		if (!numa::bindCurrentThread(nodes_[node]) && nodeCount() > 1) {
+			Logger::warn("Failed to bind a worker to NUMA node {}", nodes_[node]);
+		}
+
+		uint64_t lastJob = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				workCv_.wait(lock, [this, lastJob]() { return !running_ || job_ != lastJob; });
+				if (!running_) {
+					return;
+				}
+				lastJob = job_;
+			}
+
+			// Own node first, then help the others in order so stealing spreads out
+			uint32_t groups = nodeCount();
+			for (uint32_t i = 0; i < (steal_ ? groups : 1); ++i) {
+				uint32_t group = (node + i) % groups;
+				Range& range = ranges_[group];
+				for (uint32_t item = range.next.fetch_add(1, std::memory_order_relaxed); item < range.end;
+					 item = range.next.fetch_add(1, std::memory_order_relaxed)) {
+					(*pFn_)(item, node);
+				}
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (--busyWorkers_ == 0) {
+					doneCv_.notify_one();
+				}
+			}
+		}
+	}
+
+}
\ No newline at end of file
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mtn {
+
+	// Worker threads grouped by NUMA node, each pinned to its node's processors. Work items are
+	// split into one contiguous range per node, and a worker drains its own node's range before
+	// helping with the others, so the same items keep landing on the same node from run to run.
+	// Only one thread may call run() at a time.
+	class WorkerPool {
+	public:
+		WorkerPool();
+		~WorkerPool();
+
+		// Node groups, not counting nodes without processors
+		inline uint32_t nodeCount() const { return (uint32_t)nodes_.size(); }
+		inline uint32_t workerCount() const { return (uint32_t)workers_.size(); }
+
+		// Calls fn(item, node) for every item in [0, count) and waits for all of them. Without
+		// stealing, every item runs on the node that owns it.
+		void run(uint32_t count, const std::function<void(uint32_t, uint32_t)>& fn, bool steal = true);
+		// Calls fn(node) once on a worker of every node, e.g. to place data in node-local memory
+		void runOnEachNode(const std::function<void(uint32_t)>& fn);
+
+	private:
+		struct Range {
+			std::atomic<uint32_t> next{ 0 };
+			uint32_t end = 0;
+		};
+
+		void workerLoop(uint32_t node);
+
+		std::vector<uint32_t> nodes_;		// OS node number of each group
+		std::vector<std::thread> workers_;
+
+		std::mutex mutex_;
+		std::condition_variable workCv_;
+		std::condition_variable doneCv_;
+		uint64_t job_ = 0;
+		uint32_t busyWorkers_ = 0;
+		bool running_ = true;
+
+		// The current job, only written while no worker is busy
+		const std::function<void(uint32_t, uint32_t)>* pFn_ = nullptr;
+		std::unique_ptr<Range[]> ranges_;
+		bool steal_ = true;
+	};
+
+}
\ No newline at end of file